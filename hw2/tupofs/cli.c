@@ -4,8 +4,14 @@
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "tupofs.h"
+#include "tfs_errs.h"
 
 TFS_Driver* driver = NULL;
 
@@ -16,13 +22,28 @@ TFS_Driver* driver = NULL;
         } \
     } while (0)
 
-void cmd_open(const char* holder_path) {
-    FILE* file = fopen(holder_path, "r+");
-    if (file == NULL) {
+void cmd_open(const char* holder_path, const char* mode) {
+    if (holder_path == NULL) {
+        printf("Usage: open <file> [mmap]\n");
+        return;
+    }
+    TFS_Backend backend;
+    const TFS_BackendOps* ops = mode != NULL && strcmp(mode, "mmap") == 0 ? &TFS_BACKEND_MMAP : &TFS_BACKEND_FD;
+    if (TFS_Backend_Open(&backend, ops, holder_path, false) <= 0) {
         perror("Couldn't open holder file");
+        return;
+    }
+    if (driver != NULL) {
+        TFS_Driver_Destruct(driver);
+        free(driver);
     }
     driver = malloc(sizeof(TFS_Driver));
-    TFS_Driver_Init(driver, file, false);
+    int init_code = TFS_Driver_Init(driver, &backend, false);
+    if (init_code <= 0) {
+        fprintf(stderr, "Couldn't open holder file: %s\n", TFS_GetError(init_code));
+        free(driver);
+        driver = NULL;
+    }
 }
 
 void print_inode(int idx) {
@@ -39,10 +60,19 @@ void print_inode(int idx) {
         case TFS_INODE_DIR:
             printf("[dir]\n");
             printf("dir->children_cnt=%d\n", inode->dir.children_cnt);
+            printf("dir->bucket_cnt=%d\n", inode->dir.bucket_cnt);
             break;
         case TFS_INODE_FILE:
             printf("[file]\n");
-            printf("file->size=%d\n", inode->file.file_size);
+            printf("file->size=%lld\n", (long long)inode->file.file_size);
+            if (TFS_Inode_File_IsInline(&inode->file)) {
+                printf("file data is inline\n");
+            } else {
+                printf("file extents=%d\n", TFS_Inode_File_GetExtentCnt(&inode->file));
+                if (inode->flags & TFS_INODE_COMPRESSED) {
+                    printf("file data is compressed\n");
+                }
+            }
             break;
         default:
             printf("[UNKNOWN!]\n");
@@ -87,9 +117,13 @@ void cmd_ls(const char* path) {
         return;
     }
 
-    for (int i = 0; i < inode->dir.children_cnt; ++i) {
-        TFS_Inode_DirEnt* ent = &inode->dir.entries[i];
-        printf("%d %s\n", ent->inode_idx, ent->name);
+    TFS_Inode_DirEnt entries[64];
+    int64_t cookie = 0;
+    int cnt;
+    while ((cnt = TFS_Driver_ReadDirEntries(driver, inode, &cookie, entries, 64)) > 0) {
+        for (int i = 0; i < cnt; ++i) {
+            printf("%d %s\n", entries[i].inode_idx, entries[i].name);
+        }
     }
 
     free(inode);
@@ -124,29 +158,46 @@ void cmd_put(char* from, char* to) {
         perror("Couldn't open source file");
         return;
     }
-    fseek(file, 0, SEEK_END);
-    int file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char* buf = malloc(file_size + 1);
-    int read = fread(buf, file_size, 1, file);
-    fclose(file);
-    if (read != 1) {
-        perror("Couldn't read source file");
+
+    TFS_File* tfs_file;
+    if (TFS_Driver_CreateIdxByRawPath(driver, to, TFS_INODE_FILE) <= 0 ||
+        TFS_Driver_OpenFile(driver, to, &tfs_file) <= 0) {
+        printf("Error\n");
+        fclose(file);
         return;
     }
 
-    TFS_Inode inode;
+    // chunk by chunk, so memory use doesn't depend on file size
+    char* buf = malloc(TFS_STREAM_CHUNK);
+    size_t read;
+    while ((read = fread(buf, 1, TFS_STREAM_CHUNK, file)) > 0) {
+        int written = TFS_Driver_FileAppend(driver, tfs_file, read, buf);
+        if (written < 0) {
+            printf("Error: %s\n", TFS_GetError(written));
+            break;
+        }
+    }
+    if (ferror(file)) {
+        perror("Couldn't read source file");
+    }
+    free(buf);
+    TFS_Driver_CloseFile(driver, tfs_file);
+    fclose(file);
+}
 
-    int inode_idx = TFS_Driver_CreateByRawPath(driver, &inode, to, TFS_INODE_FILE);
-    if (inode_idx <= 0) {
-        printf("Error\n");
-        return;
+// copies whole file to `to`
+static void stream_out(TFS_File* file, FILE* to) {
+    char* buf = malloc(TFS_STREAM_CHUNK);
+    int64_t offset = 0;
+    int read;
+    while ((read = TFS_Driver_FileRead(driver, file, offset, TFS_STREAM_CHUNK, buf)) > 0) {
+        fwrite(buf, read, 1, to);
+        offset += read;
     }
-    int written = TFS_Driver_WriteFile(driver, &inode, buf, file_size);
-    if (written <= 0) {
-        printf("Error\n");
-        return;
+    if (read < 0) {
+        printf("Error: %s\n", TFS_GetError(read));
     }
+    free(buf);
 }
 
 void cmd_cat(char* path, FILE* to) {
@@ -157,15 +208,13 @@ void cmd_cat(char* path, FILE* to) {
 
     CHECK_OPEN;
 
-    int size = TFS_Driver_ReadFileByRawPath(driver, path, NULL);
-    if (size < 0) {
+    TFS_File* file;
+    if (TFS_Driver_OpenFile(driver, path, &file) <= 0) {
         printf("Error\n");
         return;
     }
-    char* buf = malloc(size);
-    TFS_Driver_ReadFileByRawPath(driver, path, buf);
-    fwrite(buf, size, 1, to);
-    free(buf);
+    stream_out(file, to);
+    TFS_Driver_CloseFile(driver, file);
 }
 
 void cmd_get(char* from, char* to) {
@@ -177,16 +226,353 @@ void cmd_get(char* from, char* to) {
 
     CHECK_OPEN;
 
+    TFS_File* tfs_file;
+    if (TFS_Driver_OpenFile(driver, from, &tfs_file) <= 0) {
+        printf("Error\n");
+        return;
+    }
     FILE* file = fopen(to, "wb");
     if (file == NULL) {
-        perror("Couldn't open source file");
+        perror("Couldn't open destination file");
+        TFS_Driver_CloseFile(driver, tfs_file);
         return;
     }
 
-    cmd_cat(from, file); // TODO: don't create file on failure
+    stream_out(tfs_file, file);
     fclose(file);
+    TFS_Driver_CloseFile(driver, tfs_file);
+}
+
+// import/export of whole trees: dirs are addressed by inode idx, so nothing is
+// resolved by path more than once; host files are read by a pool of threads
+// while the main thread writes them into the image one by one, in walk order,
+// each with a single append so its' data lands in one contiguous extent
+
+// files larger than this are streamed by the writer itself instead of being read ahead
+#define IMPORT_MAX_BUFFERED (1 << 20)
+// how many files readers may run ahead of the writer
+#define IMPORT_WINDOW 64
+#define IMPORT_MAX_THREADS 8
+
+typedef struct ImportJob {
+    char* host_path;
+    int dir_idx;
+    char* name;
+    size_t size;
+
+    // filled by readers
+    bool ready;
+    char* data; // NULL if the file is big (or failed to read)
+    size_t data_size;
+} ImportJob;
+
+typedef struct ImportQueue {
+    ImportJob* jobs;
+    int job_cnt;
+    int job_capacity;
+
+    pthread_mutex_t lock;
+    pthread_cond_t can_read; // next_write moved
+    pthread_cond_t ready; // some job got ready
+    int next_read;
+    int next_write;
+} ImportQueue;
+
+static char* join_path(const char* dir, const char* name) {
+    char* result = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(result, "%s/%s", dir, name);
+    return result;
+}
+
+// creates tfs dirs right away, files are queued
+static void import_walk(ImportQueue* queue, const char* host_path, int dir_idx) {
+    DIR* dir = opendir(host_path);
+    if (dir == NULL) {
+        perror(host_path);
+        return;
+    }
+    struct dirent* host_ent;
+    while ((host_ent = readdir(dir)) != NULL) {
+        if (strcmp(host_ent->d_name, ".") == 0 || strcmp(host_ent->d_name, "..") == 0) {
+            continue;
+        }
+        char* child_path = join_path(host_path, host_ent->d_name);
+        struct stat st;
+        if (lstat(child_path, &st) != 0) {
+            perror(child_path);
+        } else if (S_ISDIR(st.st_mode)) {
+            TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+            int child_idx = TFS_Driver_CreateAt(driver, dir_idx, host_ent->d_name, TFS_INODE_DIR, inode);
+            if (child_idx == TFS_EEXISTS) {
+                child_idx = TFS_Driver_LookupAt(driver, dir_idx, host_ent->d_name, inode);
+                child_idx = child_idx > 0 && inode->type == TFS_INODE_DIR ? child_idx : TFS_EEXISTS;
+            }
+            free(inode);
+            if (child_idx <= 0) {
+                printf("Skipping %s: %s\n", child_path, TFS_GetError(child_idx));
+            } else {
+                import_walk(queue, child_path, child_idx);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            if (queue->job_cnt == queue->job_capacity) {
+                queue->job_capacity = queue->job_capacity * 2 + 16;
+                queue->jobs = realloc(queue->jobs, sizeof(ImportJob) * queue->job_capacity);
+            }
+            ImportJob* job = &queue->jobs[queue->job_cnt++];
+            memset(job, 0, sizeof(ImportJob));
+            job->host_path = child_path;
+            job->dir_idx = dir_idx;
+            job->name = strdup(host_ent->d_name);
+            job->size = st.st_size;
+            continue; // path is owned by job now
+        } else {
+            printf("Skipping %s: not a regular file\n", child_path);
+        }
+        free(child_path);
+    }
+    closedir(dir);
+}
+
+static void import_read(ImportJob* job) {
+    if (job->size > IMPORT_MAX_BUFFERED) {
+        return;
+    }
+    FILE* file = fopen(job->host_path, "rb");
+    if (file == NULL) {
+        return;
+    }
+    job->data = malloc(job->size + 1);
+    job->data_size = fread(job->data, 1, job->size + 1, file);
+    if (ferror(file) || job->data_size > job->size) {
+        // changed meanwhile, the writer will stream it
+        free(job->data);
+        job->data = NULL;
+    }
+    fclose(file);
+}
+
+static void* import_reader(void* arg) {
+    ImportQueue* queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (true) {
+        while (queue->next_read < queue->job_cnt && queue->next_read >= queue->next_write + IMPORT_WINDOW) {
+            pthread_cond_wait(&queue->can_read, &queue->lock);
+        }
+        if (queue->next_read >= queue->job_cnt) {
+            break;
+        }
+        ImportJob* job = &queue->jobs[queue->next_read++];
+        pthread_mutex_unlock(&queue->lock);
+
+        import_read(job);
+
+        pthread_mutex_lock(&queue->lock);
+        job->ready = true;
+        pthread_cond_broadcast(&queue->ready);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// returns false on error
+static bool import_write(ImportJob* job) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_CreateAt(driver, job->dir_idx, job->name, TFS_INODE_FILE, inode);
+    free(inode);
+    TFS_File* file;
+    if (inode_idx > 0) {
+        inode_idx = TFS_Driver_OpenFileAt(driver, inode_idx, &file);
+    }
+    if (inode_idx <= 0) {
+        printf("Skipping %s: %s\n", job->host_path, TFS_GetError(inode_idx));
+        return false;
+    }
+
+    int written = 0;
+    if (job->data != NULL) {
+        written = TFS_Driver_FileAppend(driver, file, job->data_size, job->data);
+    } else {
+        FILE* host_file = fopen(job->host_path, "rb");
+        if (host_file == NULL) {
+            perror(job->host_path);
+        } else {
+            char* buf = malloc(TFS_STREAM_CHUNK);
+            size_t read;
+            while (written >= 0 && (read = fread(buf, 1, TFS_STREAM_CHUNK, host_file)) > 0) {
+                written = TFS_Driver_FileAppend(driver, file, read, buf);
+            }
+            free(buf);
+            fclose(host_file);
+        }
+    }
+    TFS_Driver_CloseFile(driver, file);
+    if (written < 0) {
+        printf("Error writing %s: %s\n", job->host_path, TFS_GetError(written));
+        return false;
+    }
+    return true;
+}
+
+// resolves tfs dir, creating it if missing
+static int get_or_create_dir(const char* path) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_GetInodeByRawPath(driver, path, inode);
+    if (inode_idx == TFS_ENOENT) {
+        inode_idx = TFS_Driver_CreateByRawPath(driver, inode, path, TFS_INODE_DIR);
+    }
+    if (inode_idx > 0 && inode->type != TFS_INODE_DIR) {
+        inode_idx = TFS_ENOENT;
+    }
+    free(inode);
+    return inode_idx;
+}
+
+void cmd_import(const char* from, const char* to) {
+    if (to == NULL) {
+        printf("Usage: import <local dir> <tupofs dir>\n");
+        return;
+    }
+
+    CHECK_OPEN;
+
+    int dir_idx = get_or_create_dir(to);
+    if (dir_idx <= 0) {
+        printf("Error: %s\n", TFS_GetError(dir_idx));
+        return;
+    }
+
+    ImportQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    import_walk(&queue, from, dir_idx);
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.can_read, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_cnt = cpus < 2 ? 2 : cpus > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : cpus;
+    pthread_t threads[IMPORT_MAX_THREADS];
+    for (int i = 0; i < thread_cnt; ++i) {
+        pthread_create(&threads[i], NULL, import_reader, &queue);
+    }
+
+    int imported = 0;
+    for (int i = 0; i < queue.job_cnt; ++i) {
+        ImportJob* job = &queue.jobs[i];
+        pthread_mutex_lock(&queue.lock);
+        while (!job->ready) {
+            pthread_cond_wait(&queue.ready, &queue.lock);
+        }
+        pthread_mutex_unlock(&queue.lock);
+
+        imported += import_write(job);
+        free(job->data);
+        free(job->host_path);
+        free(job->name);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.next_write = i + 1;
+        pthread_cond_broadcast(&queue.can_read);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    for (int i = 0; i < thread_cnt; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&queue.ready);
+    pthread_cond_destroy(&queue.can_read);
+    pthread_mutex_destroy(&queue.lock);
+    printf("Imported %d of %d files\n", imported, queue.job_cnt);
+    free(queue.jobs);
+}
+
+static void export_dir(int dir_idx, const char* host_path) {
+    if (mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+        perror(host_path);
+        return;
+    }
+    TFS_DirEntry entries[64];
+    int64_t cookie = 0;
+    int cnt;
+    while ((cnt = TFS_Driver_ReadDirAttrsAt(driver, dir_idx, &cookie, entries, 64)) > 0) {
+        for (int i = 0; i < cnt; ++i) {
+            char* child_path = join_path(host_path, entries[i].ent.name);
+            if (entries[i].type == TFS_INODE_DIR) {
+                export_dir(entries[i].ent.inode_idx, child_path);
+            } else {
+                TFS_File* file;
+                FILE* host_file = NULL;
+                if (TFS_Driver_OpenFileAt(driver, entries[i].ent.inode_idx, &file) > 0) {
+                    host_file = fopen(child_path, "wb");
+                    if (host_file == NULL) {
+                        perror(child_path);
+                    } else {
+                        stream_out(file, host_file);
+                        fclose(host_file);
+                    }
+                    TFS_Driver_CloseFile(driver, file);
+                }
+            }
+            free(child_path);
+        }
+    }
+}
+
+void cmd_export(const char* from, const char* to) {
+    if (to == NULL) {
+        printf("Usage: export <tupofs dir> <local dir>\n");
+        return;
+    }
+
+    CHECK_OPEN;
+
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int dir_idx = TFS_Driver_GetInodeByRawPath(driver, from, inode);
+    if (dir_idx <= 0 || inode->type != TFS_INODE_DIR) {
+        printf("Error\n");
+    } else {
+        export_dir(dir_idx, to);
+    }
+    free(inode);
+}
+
+void cmd_sync() {
+    CHECK_OPEN;
+
+    TFS_Driver_Sync(driver);
+}
+
+void cmd_stats() {
+    CHECK_OPEN;
+
+    TFS_BlockCache* cache = &driver->cache;
+    printf("cache: %d blocks, %ld hits, %ld misses, %ld write-backs\n",
+        cache->capacity, cache->hits, cache->misses, cache->write_backs);
+    TFS_DentryCache* dentries = &driver->dentries;
+    printf("dentries: %d entries, %ld hits, %ld misses\n",
+        dentries->capacity, dentries->hits, dentries->misses);
+    if (driver->super_block.journal_blocks > 0) {
+        TFS_Journal* journal = &driver->journal;
+        printf("journal: %d blocks%s, %ld commits of %ld blocks, %ld checkpoints, %d replayed at open\n",
+            journal->blocks, driver->journaling ? "" : " (off)", journal->commits, journal->logged_blocks,
+            journal->checkpoints, journal->replayed);
+    }
+
+    TFS_FragStats frag;
+    TFS_Driver_GetFragStats(driver, &frag);
+    printf("data: %d free blocks in %d runs, largest run %d, fragmentation %.1f%%\n",
+        frag.free_blocks, frag.free_runs, frag.largest_free_run, frag.fragmentation * 100);
 }
 
+void cmd_cache(const char* size) {
+    if (size == NULL) {
+        printf("Usage: cache <blocks>\n");
+        return;
+    }
+
+    CHECK_OPEN;
+
+    TFS_Driver_SetCacheSize(driver, atoi(size));
+}
 
 char* read_cmd() {
     static char* line = NULL;
@@ -208,8 +594,9 @@ void handle_cmd(char* cmd) {
     char* state;
     char* token = strtok_r(cmd, delim, &state);
     if (strcmp(token, "open") == 0) {
-        token = strtok_r(NULL, delim, &state);
-        cmd_open(token);
+        char* path = strtok_r(NULL, delim, &state);
+        char* mode = strtok_r(NULL, delim, &state);
+        cmd_open(path, mode);
     } else if (strcmp(token, "inode") == 0) {
         token = strtok_r(NULL, delim, &state);
         int idx = atoi(token); // TODO: strtol
@@ -240,14 +627,29 @@ void handle_cmd(char* cmd) {
     } else if (strcmp(token, "cat") == 0) {
         token = strtok_r(NULL, delim, &state);
         cmd_cat(token, stdout);
+    } else if (strcmp(token, "import") == 0) {
+        char* from = strtok_r(NULL, delim, &state);
+        char* to = strtok_r(NULL, delim, &state);
+        cmd_import(from, to);
+    } else if (strcmp(token, "export") == 0) {
+        char* from = strtok_r(NULL, delim, &state);
+        char* to = strtok_r(NULL, delim, &state);
+        cmd_export(from, to);
+    } else if (strcmp(token, "sync") == 0) {
+        cmd_sync();
+    } else if (strcmp(token, "stats") == 0) {
+        cmd_stats();
+    } else if (strcmp(token, "cache") == 0) {
+        token = strtok_r(NULL, delim, &state);
+        cmd_cache(token);
     } else {
         printf("unknown command\n");
     }
 }
 
 int main(int argc, char** argv) {
-    if (argc == 2) {
-        cmd_open(argv[1]);
+    if (argc >= 2) {
+        cmd_open(argv[1], argc >= 3 ? argv[2] : NULL);
     }
 
     char* line; // managed by read_cmd
@@ -21,123 +21,373 @@
 #include <memory.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "tupofs.h"
+#include "tfs_errs.h"
 
 TFS_Driver* driver = NULL;
 
-static int hello_getattr(const char *path, struct stat *stbuf)
+struct tfs_options {
+    char* image;
+    int mmap;
+    int cache;
+};
+
+static struct tfs_options options = { NULL, 0, 0 };
+
+static const struct fuse_opt tfs_opts[] = {
+    { "image=%s", offsetof(struct tfs_options, image), 0 },
+    { "mmap", offsetof(struct tfs_options, mmap), 1 },
+    { "cache", offsetof(struct tfs_options, cache), 1 },
+    FUSE_OPT_END
+};
+
+// -o cache: the kernel keeps dentries, attrs and pages; that is only correct
+// as long as this daemon is the only writer of the image
+#define TFS_CACHE_TIMEOUT "60"
+#define TFS_MAX_IO (128 * 1024)
+
+// inode gen seen by the last open + 1 (0 - never opened)
+static uint32_t* open_gens = NULL;
+
+// page cache of the file may be kept if nobody wrote it since the last open
+static int tfs_keep_cache(const TFS_File* file)
+{
+    uint32_t prev = __atomic_exchange_n(&open_gens[file->inode_idx], file->inode_gen + 1, __ATOMIC_RELAXED);
+    return prev == file->inode_gen + 1;
+}
+
+// TFS_E* -> -errno
+static int tfs_errno(int code)
+{
+    switch (code) {
+        case TFS_ENOENT:
+            return -ENOENT;
+        case TFS_ENOSPACE:
+            return -ENOSPC;
+        case TFS_EEXISTS:
+            return -EEXIST;
+        case TFS_ENAMETOOLONG:
+            return -ENAMETOOLONG;
+        case TFS_EINVAL:
+            return -EINVAL;
+        default:
+            return -EIO;
+    }
+}
+
+static void tfs_fill_stat(int inode_idx, char type, int64_t file_size, struct stat *stbuf)
 {
     memset(stbuf, 0, sizeof(struct stat));
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_ino = inode_idx;
+    if (type == TFS_INODE_DIR) {
+        stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-        return 0;
     } else {
-        TFS_Inode* inode = malloc(sizeof(TFS_Inode));
-        int ret = TFS_Driver_GetInodeByRawPath(driver, path, inode);
-        if (ret <= 0) {
-            free(inode);
-            return -ENOENT;
-        }
-        if (inode->type == TFS_INODE_DIR) {
-            stbuf->st_mode = S_IFDIR | 0555;
-            stbuf->st_nlink = 2;
-        } else if (inode->type == TFS_INODE_FILE) {
-            stbuf->st_mode = S_IFREG | 0444;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = inode->file.file_size;
-        } else {
-            free(inode);
-            return -ENOENT;
-        }
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = file_size;
+    }
+}
+
+static int hello_getattr(const char *path, struct stat *stbuf)
+{
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int ret = TFS_Driver_GetInodeByRawPath(driver, path, inode);
+    if (ret <= 0 || (inode->type != TFS_INODE_DIR && inode->type != TFS_INODE_FILE)) {
         free(inode);
-        return 0;
+        return -ENOENT;
     }
+    tfs_fill_stat(ret, inode->type, inode->type == TFS_INODE_FILE ? inode->file.file_size : 0, stbuf);
+    free(inode);
+    return 0;
 }
 
+// directory offsets: 1 and 2 are "." and "..", entry offset is next_cookie + 3,
+// so a listing that didn't fit is resumed right after the last entry passed
+#define TFS_DIROFF 3
+
 static int hello_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
-    (void) offset;
     (void) fi;
 
-    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
-    int ret = TFS_Driver_GetInodeByRawPath(driver, path, inode);
-    if (ret <= 0 || inode->type != TFS_INODE_DIR) {
-        free(inode);
+    TFS_DirEntry entries[64];
+    int64_t cookie = offset > TFS_DIROFF ? offset - TFS_DIROFF : 0;
+    int cnt = TFS_Driver_ReadDirAttrsByRawPath(driver, path, &cookie, entries, 64);
+    if (cnt < 0) {
         return -ENOENT;
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    for (int i = 0; i < inode->dir.children_cnt; ++i) {
-        filler(buf, inode->dir.entries[i].name, NULL, 0);
+    if (offset < 1 && filler(buf, ".", NULL, 1)) {
+        return 0;
+    }
+    if (offset < 2 && filler(buf, "..", NULL, 2)) {
+        return 0;
+    }
+    struct stat stbuf;
+    for (; cnt > 0; cnt = TFS_Driver_ReadDirAttrsByRawPath(driver, path, &cookie, entries, 64)) {
+        for (int i = 0; i < cnt; ++i) {
+            tfs_fill_stat(entries[i].ent.inode_idx, entries[i].type, entries[i].file_size, &stbuf);
+            if (filler(buf, entries[i].ent.name, &stbuf, entries[i].next_cookie + TFS_DIROFF)) {
+                return 0;
+            }
+        }
     }
 
     return 0;
 }
 
+// open file lives in fi->fh until release, so I/O skips the path walk
+static TFS_File* tfs_file(struct fuse_file_info *fi)
+{
+    return (TFS_File*)(uintptr_t)fi->fh;
+}
+
 static int hello_open(const char *path, struct fuse_file_info *fi)
 {
-    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
-    int ret = TFS_Driver_GetInodeByRawPath(driver, path, inode);
-    if (ret <= 0 || inode->type != TFS_INODE_FILE) {
-        free(inode);
-        return -ENOENT;
+    TFS_File* file;
+    int ret = TFS_Driver_OpenFile(driver, path, &file);
+    if (ret <= 0) {
+        // either missing or not a file
+        return TFS_Driver_GetInodeIdxByRawPath(driver, path) > 0 ? -EISDIR : -ENOENT;
     }
+    fi->fh = (uintptr_t)file;
+    fi->keep_cache = options.cache && tfs_keep_cache(file);
+    return 0;
+}
 
-    if ((fi->flags & 3) != O_RDONLY) {
-        free(inode);
-        return -EACCES;
+static int hello_release(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    TFS_Driver_CloseFile(driver, tfs_file(fi));
+    fi->fh = 0;
+    return 0;
+}
+
+// data goes to the kernel as (image fd, offset) pieces, so it can be spliced
+// straight from the image without passing through our buffers
+static int hello_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+    (void) path;
+    int max_runs = size / TFS_SECTOR_SIZE + 2;
+    TFS_ImageRun* runs = malloc(sizeof(TFS_ImageRun) * max_runs);
+    int cnt = TFS_Driver_FileMapRange(driver, tfs_file(fi), offset, size, runs, max_runs);
+    if (cnt == TFS_EINVAL) {
+        // compressed file is not in the image as is, it is decompressed into memory
+        free(runs);
+        char* data = malloc(size + 1);
+        int read = TFS_Driver_FileRead(driver, tfs_file(fi), offset, size, data);
+        if (read < 0) {
+            free(data);
+            return tfs_errno(read);
+        }
+        // both freed by libfuse
+        struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec));
+        *bufv = FUSE_BUFVEC_INIT(read);
+        bufv->buf[0].mem = data;
+        *bufp = bufv;
+        return 0;
+    }
+    if (cnt < 0) {
+        free(runs);
+        return tfs_errno(cnt);
     }
 
+    // freed by libfuse
+    struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * max_runs);
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = cnt > 0 ? cnt : 1;
+    for (int i = 0; i < cnt; ++i) {
+        bufv->buf[i].size = runs[i].size;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = driver->backend.fd;
+        bufv->buf[i].pos = runs[i].offset;
+    }
+    free(runs);
+    *bufp = bufv;
     return 0;
 }
 
-static int hello_read(const char *path, char *buf, size_t size, off_t offset,
+static int hello_write(const char *path, const char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi)
 {
+    (void) path;
+    int written = TFS_Driver_FileWrite(driver, tfs_file(fi), offset, size, buf);
+    return written < 0 ? tfs_errno(written) : written;
+}
+
+// everything written so far is committed to the journal, one sync for all of it
+static int hello_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) path;
+    (void) datasync;
     (void) fi;
+    TFS_Driver_Commit(driver);
+    return 0;
+}
+
+static int hello_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    (void) path;
+    int ret = TFS_Driver_FileTruncate(driver, tfs_file(fi), size);
+    return ret < 0 ? tfs_errno(ret) : 0;
+}
+
+static int hello_truncate(const char *path, off_t size)
+{
+    int ret = TFS_Driver_TruncateByRawPath(driver, path, size);
+    return ret < 0 ? tfs_errno(ret) : 0;
+}
+
+static int hello_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void) mode;
+    int ret = TFS_Driver_CreateIdxByRawPath(driver, path, TFS_INODE_FILE);
+    if (ret <= 0) {
+        return tfs_errno(ret);
+    }
+    return hello_open(path, fi);
+}
+
+static int hello_mkdir(const char *path, mode_t mode)
+{
+    (void) mode;
+    int ret = TFS_Driver_CreateIdxByRawPath(driver, path, TFS_INODE_DIR);
+    return ret <= 0 ? tfs_errno(ret) : 0;
+}
+
+// deletes path if it is of given type
+static int tfs_remove(const char *path, enum TFS_InodeType type)
+{
     TFS_Inode* inode = malloc(sizeof(TFS_Inode));
     int ret = TFS_Driver_GetInodeByRawPath(driver, path, inode);
-    if (ret <= 0 || inode->type != TFS_INODE_FILE) {
+    if (ret <= 0) {
         free(inode);
-        return -ENOENT;
+        return tfs_errno(ret);
     }
-
-    int to_return = inode->file.file_size - offset;
-    if ((int)size < to_return) {
-        to_return = size;
+    enum TFS_InodeType actual = inode->type;
+    free(inode);
+    if (actual != type) {
+        return type == TFS_INODE_DIR ? -ENOTDIR : -EISDIR;
     }
-    if (to_return <= 0) {
-        return 0;
+    ret = TFS_Driver_DeleteByRawPath(driver, path);
+    if (ret == 0) {
+        return -ENOTEMPTY;
     }
+    return ret < 0 ? tfs_errno(ret) : 0;
+}
+
+static int hello_unlink(const char *path)
+{
+    return tfs_remove(path, TFS_INODE_FILE);
+}
+
+static int hello_rmdir(const char *path)
+{
+    return tfs_remove(path, TFS_INODE_DIR);
+}
 
-    char* whole_file = malloc(inode->file.file_size);
-    if (TFS_Driver_ReadFileByRawPath(driver, path, whole_file) <= 0) {
-        return -EACCES;
+static int hello_rename(const char *from, const char *to)
+{
+    int ret = TFS_Driver_MvRawPath(driver, from, to);
+    if (ret == TFS_EEXISTS) {
+        // rename replaces target; directories only if they are empty
+        TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+        TFS_Driver_GetInodeByRawPath(driver, from, inode);
+        int remove_ret = tfs_remove(to, inode->type);
+        free(inode);
+        if (remove_ret != 0) {
+            return remove_ret;
+        }
+        ret = TFS_Driver_MvRawPath(driver, from, to);
     }
-    memcpy(buf, whole_file + offset, to_return);
-    return to_return;
+    return ret <= 0 ? tfs_errno(ret) : 0;
+}
+
+// there are no timestamps yet, but touch needs this to succeed
+static int hello_utimens(const char *path, const struct timespec tv[2])
+{
+    (void) tv;
+    return TFS_Driver_GetInodeIdxByRawPath(driver, path) > 0 ? 0 : -ENOENT;
+}
+
+static void *hello_init(struct fuse_conn_info *conn)
+{
+    // replies with fd buffers are spliced into /dev/fuse when the kernel can
+    conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+    if (options.cache) {
+        conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES);
+        conn->max_write = TFS_MAX_IO;
+        conn->max_readahead = TFS_MAX_IO;
+    }
+    return NULL;
+}
+
+static void hello_destroy(void *private_data)
+{
+    (void) private_data;
+    TFS_Driver_Destruct(driver);
+    free(driver);
+    driver = NULL;
 }
 
 static struct fuse_operations hello_oper = {
+    .init       = hello_init,
+    .destroy    = hello_destroy,
     .getattr    = hello_getattr,
     .readdir    = hello_readdir,
     .open        = hello_open,
-    .read        = hello_read,
+    .release    = hello_release,
+    .read_buf   = hello_read_buf,
+    .write      = hello_write,
+    .fsync      = hello_fsync,
+    .truncate   = hello_truncate,
+    .ftruncate  = hello_ftruncate,
+    .create     = hello_create,
+    .mkdir      = hello_mkdir,
+    .unlink     = hello_unlink,
+    .rmdir      = hello_rmdir,
+    .rename     = hello_rename,
+    .utimens    = hello_utimens,
 };
 
 int main(int argc, char *argv[])
 {
-    FILE* f = fopen("tupofs.bin", "r+");
-    if (f == NULL) {
-        perror("Error opening FS host (tupofs.bin)");
+    // -o image=<path> (default tupofs.bin), -o mmap to map the whole image,
+    // -o cache to let the kernel cache (see TFS_CACHE_TIMEOUT)
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, tfs_opts, NULL) == -1) {
+        return 1;
+    }
+    if (options.cache) {
+        fuse_opt_add_arg(&args, "-oentry_timeout=" TFS_CACHE_TIMEOUT ",attr_timeout=" TFS_CACHE_TIMEOUT);
+        fuse_opt_add_arg(&args, "-omax_read=131072"); // TFS_MAX_IO
+    }
+    const char* image = options.image != NULL ? options.image : "tupofs.bin";
+
+    TFS_Backend backend;
+    const TFS_BackendOps* ops = options.mmap ? &TFS_BACKEND_MMAP : &TFS_BACKEND_FD;
+    if (TFS_Backend_Open(&backend, ops, image, false) <= 0) {
+        fprintf(stderr, "Error opening FS host (%s): ", image);
+        perror(NULL);
         return 1;
     }
     driver = malloc(sizeof(TFS_Driver));
-    TFS_Driver_Init(driver, f, false);
+    int init_code = TFS_Driver_Init(driver, &backend, false);
+    if (init_code <= 0) {
+        fprintf(stderr, "Error opening FS host (%s): %s\n", image, TFS_GetError(init_code));
+        return 1;
+    }
+    open_gens = calloc(8 * driver->super_block.inode_map_size + 1, sizeof(uint32_t));
 
-    return fuse_main(argc, argv, &hello_oper, NULL);
+    int ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+    fuse_opt_free_args(&args);
+    free(options.image);
+    free(open_gens);
+    return ret;
 }
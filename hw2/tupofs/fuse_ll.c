@@ -0,0 +1,525 @@
+/*
+  based on https://github.com/libfuse/libfuse/blob/fuse-2_9_bugfix/example/hello_ll.c
+  (C) 2019 Roman Nikonov
+
+  low-level (inode number based) version of fuse.c: nodeid is inode idx,
+  so requests start from a known inode and never walk paths from root;
+  the kernel keeps dentries itself
+
+  use cmake to compile
+  use run_fuse_ll.sh to run
+
+    [Original copyright:]
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU GPL.
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tupofs.h"
+#include "tfs_errs.h"
+
+// FUSE_ROOT_ID is the root inode idx
+_Static_assert(FUSE_ROOT_ID == TFS_ROOT_INODE_IDX, "");
+
+TFS_Driver* driver = NULL;
+
+struct tfs_options {
+    char* image;
+    int mmap;
+    int cache;
+};
+
+static struct tfs_options options = { NULL, 0, 0 };
+
+static const struct fuse_opt tfs_opts[] = {
+    { "image=%s", offsetof(struct tfs_options, image), 0 },
+    { "mmap", offsetof(struct tfs_options, mmap), 1 },
+    { "cache", offsetof(struct tfs_options, cache), 1 },
+    FUSE_OPT_END
+};
+
+// -o cache: the kernel keeps dentries, attrs and pages; that is only correct
+// as long as this daemon is the only writer of the image
+#define TFS_CACHE_TIMEOUT 60.0
+#define TFS_MAX_IO (128 * 1024)
+
+// entry and attr timeout
+static double cache_timeout = 1.0;
+
+// inode gen seen by the last open + 1 (0 - never opened)
+static uint32_t* open_gens = NULL;
+
+// page cache of the file may be kept if nobody wrote it since the last open
+static int tfs_keep_cache(const TFS_File* file)
+{
+    uint32_t prev = __atomic_exchange_n(&open_gens[file->inode_idx], file->inode_gen + 1, __ATOMIC_RELAXED);
+    return prev == file->inode_gen + 1;
+}
+
+// TFS_E* -> errno
+static int tfs_errno(int code)
+{
+    switch (code) {
+        case TFS_ENOENT:
+            return ENOENT;
+        case TFS_ENOSPACE:
+            return ENOSPC;
+        case TFS_EEXISTS:
+            return EEXIST;
+        case TFS_ENAMETOOLONG:
+            return ENAMETOOLONG;
+        case TFS_EINVAL:
+            return EINVAL;
+        default:
+            return EIO;
+    }
+}
+
+static void tfs_fill_stat(int inode_idx, char type, int64_t file_size, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode_idx;
+    if (type == TFS_INODE_DIR) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = file_size;
+    }
+}
+
+static void hello_ll_fill_stat(const TFS_Inode* inode, struct stat *stbuf)
+{
+    tfs_fill_stat(inode->inode_idx, inode->type, inode->type == TFS_INODE_FILE ? inode->file.file_size : 0, stbuf);
+}
+
+static void hello_ll_fill_entry(const TFS_Inode* inode, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = inode->inode_idx;
+    e->attr_timeout = cache_timeout;
+    e->entry_timeout = cache_timeout;
+    hello_ll_fill_stat(inode, &e->attr);
+}
+
+static void hello_ll_reply_attr(fuse_req_t req, fuse_ino_t ino)
+{
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int ret = TFS_Driver_GetInodeByIdx(driver, ino, inode);
+    if (ret <= 0) {
+        fuse_reply_err(req, tfs_errno(ret));
+    } else {
+        struct stat stbuf;
+        hello_ll_fill_stat(inode, &stbuf);
+        fuse_reply_attr(req, &stbuf, cache_timeout);
+    }
+    free(inode);
+}
+
+static void hello_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                 struct fuse_file_info *fi)
+{
+    (void) fi;
+    hello_ll_reply_attr(req, ino);
+}
+
+// open file lives in fi->fh until release, see fuse.c
+static TFS_File* tfs_file(struct fuse_file_info *fi)
+{
+    return (TFS_File*)(uintptr_t)fi->fh;
+}
+
+// only size is supported, there are no modes and timestamps yet
+static void hello_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                 int to_set, struct fuse_file_info *fi)
+{
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int ret = fi != NULL
+            ? TFS_Driver_FileTruncate(driver, tfs_file(fi), attr->st_size)
+            : TFS_Driver_TruncateAt(driver, ino, attr->st_size);
+        if (ret < 0) {
+            fuse_reply_err(req, tfs_errno(ret));
+            return;
+        }
+    }
+    hello_ll_reply_attr(req, ino);
+}
+
+static void hello_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int ret = TFS_Driver_LookupAt(driver, parent, name, inode);
+    if (ret <= 0) {
+        fuse_reply_err(req, tfs_errno(ret));
+    } else {
+        struct fuse_entry_param e;
+        hello_ll_fill_entry(inode, &e);
+        fuse_reply_entry(req, &e);
+    }
+    free(inode);
+}
+
+// nothing is kept per inode, so lookup counts are not tracked
+static void hello_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    (void) ino;
+    (void) nlookup;
+    fuse_reply_none(req);
+}
+
+static void hello_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+               mode_t mode)
+{
+    (void) mode;
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int ret = TFS_Driver_CreateAt(driver, parent, name, TFS_INODE_DIR, inode);
+    if (ret <= 0) {
+        fuse_reply_err(req, tfs_errno(ret));
+    } else {
+        struct fuse_entry_param e;
+        hello_ll_fill_entry(inode, &e);
+        fuse_reply_entry(req, &e);
+    }
+    free(inode);
+}
+
+// deletes name if it is of given type, returns errno
+static int tfs_remove(fuse_ino_t parent, const char *name, enum TFS_InodeType type)
+{
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int ret = TFS_Driver_LookupAt(driver, parent, name, inode);
+    if (ret <= 0) {
+        free(inode);
+        return tfs_errno(ret);
+    }
+    enum TFS_InodeType actual = inode->type;
+    free(inode);
+    if (actual != type) {
+        return type == TFS_INODE_DIR ? ENOTDIR : EISDIR;
+    }
+    ret = TFS_Driver_DeleteAt(driver, parent, name);
+    if (ret == 0) {
+        return ENOTEMPTY;
+    }
+    return ret < 0 ? tfs_errno(ret) : 0;
+}
+
+static void hello_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, tfs_remove(parent, name, TFS_INODE_FILE));
+}
+
+static void hello_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, tfs_remove(parent, name, TFS_INODE_DIR));
+}
+
+static void hello_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                fuse_ino_t newparent, const char *newname)
+{
+    int ret = TFS_Driver_MvAt(driver, parent, name, newparent, newname);
+    if (ret == TFS_EEXISTS) {
+        // rename replaces target; directories only if they are empty
+        TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+        ret = TFS_Driver_LookupAt(driver, parent, name, inode);
+        if (ret <= 0) {
+            free(inode);
+            fuse_reply_err(req, tfs_errno(ret));
+            return;
+        }
+        enum TFS_InodeType type = inode->type;
+        free(inode);
+        int remove_err = tfs_remove(newparent, newname, type);
+        if (remove_err != 0) {
+            fuse_reply_err(req, remove_err);
+            return;
+        }
+        ret = TFS_Driver_MvAt(driver, parent, name, newparent, newname);
+    }
+    fuse_reply_err(req, ret <= 0 ? tfs_errno(ret) : 0);
+}
+
+static void hello_ll_open(fuse_req_t req, fuse_ino_t ino,
+              struct fuse_file_info *fi)
+{
+    TFS_File* file;
+    int ret = TFS_Driver_OpenFileAt(driver, ino, &file);
+    if (ret <= 0) {
+        // dirs are opened through opendir, so the inode is gone
+        fuse_reply_err(req, tfs_errno(ret));
+        return;
+    }
+    fi->fh = (uintptr_t)file;
+    fi->keep_cache = options.cache && tfs_keep_cache(file);
+    fuse_reply_open(req, fi);
+}
+
+static void hello_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode, struct fuse_file_info *fi)
+{
+    (void) mode;
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_File* file;
+    int ret = TFS_Driver_CreateAt(driver, parent, name, TFS_INODE_FILE, inode);
+    if (ret > 0) {
+        ret = TFS_Driver_OpenFileAt(driver, ret, &file);
+    }
+    if (ret <= 0) {
+        fuse_reply_err(req, tfs_errno(ret));
+    } else {
+        struct fuse_entry_param e;
+        hello_ll_fill_entry(inode, &e);
+        fi->fh = (uintptr_t)file;
+        fi->keep_cache = options.cache && tfs_keep_cache(file);
+        fuse_reply_create(req, &e, fi);
+    }
+    free(inode);
+}
+
+static void hello_ll_release(fuse_req_t req, fuse_ino_t ino,
+                 struct fuse_file_info *fi)
+{
+    (void) ino;
+    TFS_Driver_CloseFile(driver, tfs_file(fi));
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
+// everything written so far is committed to the journal, one sync for all of it
+static void hello_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+              struct fuse_file_info *fi)
+{
+    (void) ino;
+    (void) datasync;
+    (void) fi;
+    TFS_Driver_Commit(driver);
+    fuse_reply_err(req, 0);
+}
+
+// data goes to the kernel as (image fd, offset) pieces, so it can be spliced
+// straight from the image without passing through our buffers
+static void hello_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+              off_t off, struct fuse_file_info *fi)
+{
+    (void) ino;
+    int max_runs = size / TFS_SECTOR_SIZE + 2;
+    TFS_ImageRun* runs = malloc(sizeof(TFS_ImageRun) * max_runs);
+    int cnt = TFS_Driver_FileMapRange(driver, tfs_file(fi), off, size, runs, max_runs);
+    if (cnt == TFS_EINVAL) {
+        // compressed file is not in the image as is, it is decompressed into memory
+        free(runs);
+        char* data = malloc(size + 1);
+        int read = TFS_Driver_FileRead(driver, tfs_file(fi), off, size, data);
+        if (read < 0) {
+            fuse_reply_err(req, tfs_errno(read));
+        } else {
+            fuse_reply_buf(req, data, read);
+        }
+        free(data);
+        return;
+    }
+    if (cnt < 0) {
+        free(runs);
+        fuse_reply_err(req, tfs_errno(cnt));
+        return;
+    }
+
+    struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * max_runs);
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = cnt > 0 ? cnt : 1;
+    for (int i = 0; i < cnt; ++i) {
+        bufv->buf[i].size = runs[i].size;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = driver->backend.fd;
+        bufv->buf[i].pos = runs[i].offset;
+    }
+    free(runs);
+    // falls back to a copy if splice is not available
+    fuse_reply_data(req, bufv, 0);
+    free(bufv);
+}
+
+static void hello_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+               size_t size, off_t off, struct fuse_file_info *fi)
+{
+    (void) ino;
+    int written = TFS_Driver_FileWrite(driver, tfs_file(fi), off, size, buf);
+    if (written < 0) {
+        fuse_reply_err(req, tfs_errno(written));
+    } else {
+        fuse_reply_write(req, written);
+    }
+}
+
+// directory offsets: 1 and 2 are "." and "..", entry offset is next_cookie + 3,
+// so the kernel continues right after the last entry it got
+#define TFS_LL_DIROFF 3
+
+// appends entry unless buffer is full; returns false then
+static bool tfs_add_direntry(fuse_req_t req, char *buf, size_t size, size_t *pos,
+                 const char *name, const struct stat *stbuf, off_t off)
+{
+    size_t len = fuse_add_direntry(req, buf + *pos, size - *pos, name, stbuf, off);
+    if (len > size - *pos) {
+        return false;
+    }
+    *pos += len;
+    return true;
+}
+
+static void hello_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                 off_t off, struct fuse_file_info *fi)
+{
+    (void) fi;
+
+    // the shortest dirent is 32 bytes, don't read attrs of entries that can't fit
+    int max = size / 32 + 1 < 64 ? size / 32 + 1 : 64;
+    TFS_DirEntry entries[64];
+    int64_t cookie = off > TFS_LL_DIROFF ? off - TFS_LL_DIROFF : 0;
+    int cnt = TFS_Driver_ReadDirAttrsAt(driver, ino, &cookie, entries, max);
+    if (cnt < 0) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    char* buf = malloc(size);
+    size_t pos = 0;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    // only inode number and type are used
+    stbuf.st_mode = S_IFDIR;
+    stbuf.st_ino = ino;
+    bool fits = true;
+    if (off < 1) {
+        fits = tfs_add_direntry(req, buf, size, &pos, ".", &stbuf, 1);
+    }
+    if (off < 2 && fits) {
+        fits = tfs_add_direntry(req, buf, size, &pos, "..", &stbuf, 2);
+    }
+    for (; cnt > 0 && fits; cnt = TFS_Driver_ReadDirAttrsAt(driver, ino, &cookie, entries, max)) {
+        for (int i = 0; i < cnt && fits; ++i) {
+            tfs_fill_stat(entries[i].ent.inode_idx, entries[i].type, entries[i].file_size, &stbuf);
+            // an entry that doesn't fit is sent again next time
+            fits = tfs_add_direntry(req, buf, size, &pos, entries[i].ent.name, &stbuf,
+                entries[i].next_cookie + TFS_LL_DIROFF);
+        }
+    }
+
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+static void hello_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+    // replies with fd buffers are spliced into /dev/fuse when the kernel can
+    conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+    if (options.cache) {
+        conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES);
+        conn->max_write = TFS_MAX_IO;
+        conn->max_readahead = TFS_MAX_IO;
+    }
+}
+
+static void hello_ll_destroy(void *userdata)
+{
+    (void) userdata;
+    TFS_Driver_Destruct(driver);
+    free(driver);
+    driver = NULL;
+}
+
+static struct fuse_lowlevel_ops hello_ll_oper = {
+    .init       = hello_ll_init,
+    .destroy    = hello_ll_destroy,
+    .lookup     = hello_ll_lookup,
+    .forget     = hello_ll_forget,
+    .getattr    = hello_ll_getattr,
+    .setattr    = hello_ll_setattr,
+    .readdir    = hello_ll_readdir,
+    .open       = hello_ll_open,
+    .release    = hello_ll_release,
+    .read       = hello_ll_read,
+    .write      = hello_ll_write,
+    .fsync      = hello_ll_fsync,
+    .create     = hello_ll_create,
+    .mkdir      = hello_ll_mkdir,
+    .unlink     = hello_ll_unlink,
+    .rmdir      = hello_ll_rmdir,
+    .rename     = hello_ll_rename,
+};
+
+int main(int argc, char *argv[])
+{
+    // -o image=<path> (default tupofs.bin), -o mmap to map the whole image,
+    // -o cache to let the kernel cache (see TFS_CACHE_TIMEOUT)
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, tfs_opts, NULL) == -1) {
+        return 1;
+    }
+    if (options.cache) {
+        cache_timeout = TFS_CACHE_TIMEOUT;
+        fuse_opt_add_arg(&args, "-omax_read=131072"); // TFS_MAX_IO
+    }
+    const char* image = options.image != NULL ? options.image : "tupofs.bin";
+
+    TFS_Backend backend;
+    const TFS_BackendOps* ops = options.mmap ? &TFS_BACKEND_MMAP : &TFS_BACKEND_FD;
+    if (TFS_Backend_Open(&backend, ops, image, false) <= 0) {
+        fprintf(stderr, "Error opening FS host (%s): ", image);
+        perror(NULL);
+        return 1;
+    }
+    driver = malloc(sizeof(TFS_Driver));
+    int init_code = TFS_Driver_Init(driver, &backend, false);
+    if (init_code <= 0) {
+        fprintf(stderr, "Error opening FS host (%s): %s\n", image, TFS_GetError(init_code));
+        return 1;
+    }
+    open_gens = calloc(8 * driver->super_block.inode_map_size + 1, sizeof(uint32_t));
+
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        struct fuse_session *se;
+
+        se = fuse_lowlevel_new(&args, &hello_ll_oper,
+                       sizeof(hello_ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            // calls hello_ll_destroy
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    free(options.image);
+    free(open_gens);
+
+    return err ? 1 : 0;
+}
@@ -0,0 +1,263 @@
+// builds an image offline: the whole image is put together in memory (TFS_BACKEND_MEM)
+// and written out in one sequential pass; images over TFS_MKFS_MEM_LIMIT are written
+// in place instead, the file stays sparse
+//
+// usage: tupofs_mkfs [-i inode_map_bytes] [-d data_map_bytes] [-j journal_blocks] [-z] [-s source_dir] <image>
+//
+// source dir is copied breadth-first: all entries of a dir are created before
+// going deeper, so dirs of one level get neighbouring inodes and each file's data
+// follows the previous file's data in one extent; with -z files are compressed,
+// each one is read whole and written at once
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tupofs.h"
+#include "tfs_errs.h"
+
+#define TFS_MKFS_MEM_LIMIT ((int64_t)256 * 1024 * 1024)
+
+typedef struct DirTask {
+    char* host_path;
+    int dir_idx;
+} DirTask;
+
+typedef struct MkfsStats {
+    int dirs;
+    int files;
+    int skipped;
+    int64_t bytes;
+    int64_t used_blocks; // data blocks taken by files
+} MkfsStats;
+
+static char* join_path(const char* dir, const char* name) {
+    char* result = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(result, "%s/%s", dir, name);
+    return result;
+}
+
+static int cmp_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// whole file at once, so it can be compressed; returns bytes written or error
+static int replace_file(TFS_Driver* driver, TFS_File* file, FILE* host_file, const char* host_path, MkfsStats* stats) {
+    struct stat st;
+    if (fstat(fileno(host_file), &st) != 0 || st.st_size > INT_MAX) {
+        fprintf(stderr, "%s: too large to compress\n", host_path);
+        return TFS_EINVAL;
+    }
+    char* data = malloc(st.st_size + 1);
+    int size = fread(data, 1, st.st_size, host_file);
+    int written = TFS_Driver_FileReplace(driver, file, size, data);
+    stats->bytes += size;
+    free(data);
+    return written;
+}
+
+// returns false on error
+static bool copy_file(TFS_Driver* driver, const char* host_path, int dir_idx, const char* name, char* buf, MkfsStats* stats) {
+    FILE* host_file = fopen(host_path, "rb");
+    if (host_file == NULL) {
+        perror(host_path);
+        return false;
+    }
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_CreateAt(driver, dir_idx, name, TFS_INODE_FILE, inode);
+    free(inode);
+    TFS_File* file;
+    if (inode_idx > 0) {
+        inode_idx = TFS_Driver_OpenFileAt(driver, inode_idx, &file);
+    }
+    if (inode_idx <= 0) {
+        fprintf(stderr, "%s: %s\n", host_path, TFS_GetError(inode_idx));
+        fclose(host_file);
+        return false;
+    }
+
+    int written = 0;
+    if (driver->compress) {
+        written = replace_file(driver, file, host_file, host_path, stats);
+    } else {
+        size_t read;
+        while (written >= 0 && (read = fread(buf, 1, TFS_STREAM_CHUNK, host_file)) > 0) {
+            written = TFS_Driver_FileAppend(driver, file, read, buf);
+            stats->bytes += read;
+        }
+    }
+    TFS_Driver_CloseFile(driver, file);
+    fclose(host_file);
+    if (written < 0) {
+        fprintf(stderr, "%s: %s\n", host_path, TFS_GetError(written));
+        return false;
+    }
+    return true;
+}
+
+static void populate(TFS_Driver* driver, const char* source, MkfsStats* stats) {
+    int queue_capacity = 16;
+    DirTask* queue = malloc(sizeof(DirTask) * queue_capacity);
+    int queue_begin = 0;
+    int queue_end = 0;
+    queue[queue_end++] = (DirTask){ strdup(source), TFS_ROOT_INODE_IDX };
+    char* buf = malloc(TFS_STREAM_CHUNK);
+
+    while (queue_begin < queue_end) {
+        DirTask task = queue[queue_begin++];
+        DIR* dir = opendir(task.host_path);
+        if (dir == NULL) {
+            perror(task.host_path);
+            ++stats->skipped;
+            free(task.host_path);
+            continue;
+        }
+        // sorted, so the same tree always gives the same image
+        int name_cnt = 0;
+        int name_capacity = 16;
+        char** names = malloc(sizeof(char*) * name_capacity);
+        struct dirent* host_ent;
+        while ((host_ent = readdir(dir)) != NULL) {
+            if (strcmp(host_ent->d_name, ".") == 0 || strcmp(host_ent->d_name, "..") == 0) {
+                continue;
+            }
+            if (name_cnt == name_capacity) {
+                name_capacity *= 2;
+                names = realloc(names, sizeof(char*) * name_capacity);
+            }
+            names[name_cnt++] = strdup(host_ent->d_name);
+        }
+        closedir(dir);
+        qsort(names, name_cnt, sizeof(char*), cmp_names);
+
+        for (int i = 0; i < name_cnt; ++i) {
+            char* child_path = join_path(task.host_path, names[i]);
+            struct stat st;
+            if (lstat(child_path, &st) != 0) {
+                perror(child_path);
+                ++stats->skipped;
+            } else if (S_ISDIR(st.st_mode)) {
+                TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+                int child_idx = TFS_Driver_CreateAt(driver, task.dir_idx, names[i], TFS_INODE_DIR, inode);
+                free(inode);
+                if (child_idx <= 0) {
+                    fprintf(stderr, "%s: %s\n", child_path, TFS_GetError(child_idx));
+                    ++stats->skipped;
+                } else {
+                    if (queue_end == queue_capacity) {
+                        // move pending tasks to the front before growing
+                        memmove(queue, queue + queue_begin, sizeof(DirTask) * (queue_end - queue_begin));
+                        queue_end -= queue_begin;
+                        queue_begin = 0;
+                        if (queue_end == queue_capacity) {
+                            queue_capacity *= 2;
+                            queue = realloc(queue, sizeof(DirTask) * queue_capacity);
+                        }
+                    }
+                    queue[queue_end++] = (DirTask){ child_path, child_idx };
+                    child_path = NULL; // owned by queue
+                    ++stats->dirs;
+                }
+            } else if (S_ISREG(st.st_mode)) {
+                if (copy_file(driver, child_path, task.dir_idx, names[i], buf, stats)) {
+                    ++stats->files;
+                } else {
+                    ++stats->skipped;
+                }
+            } else {
+                fprintf(stderr, "%s: not a regular file, skipped\n", child_path);
+                ++stats->skipped;
+            }
+            free(child_path);
+            free(names[i]);
+        }
+        free(names);
+        free(task.host_path);
+    }
+
+    free(buf);
+    free(queue);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Usage: %s [-i inode_map_bytes] [-d data_map_bytes] [-j journal_blocks] [-z] [-s source_dir] <image>\n", argv0);
+    fprintf(stderr, "bitmap sizes are 1..%d bytes (8 inodes/blocks per byte), %d by default\n",
+        TFS_MAX_MAP_SIZE, TFS_DEFAULT_MAP_SIZE);
+    fprintf(stderr, "journal is 0 (none) or %d..%d blocks, %d by default\n",
+        TFS_JOURNAL_MIN_BLOCKS, TFS_JOURNAL_MAX_BLOCKS, TFS_DEFAULT_JOURNAL_BLOCKS);
+    fprintf(stderr, "-z compresses files\n");
+}
+
+int main(int argc, char** argv) {
+    int inode_map_size = TFS_DEFAULT_MAP_SIZE;
+    int data_map_size = TFS_DEFAULT_MAP_SIZE;
+    int journal_blocks = TFS_DEFAULT_JOURNAL_BLOCKS;
+    const char* source = NULL;
+    bool compress = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:d:j:zs:")) != -1) {
+        switch (opt) {
+            case 'i':
+                inode_map_size = atoi(optarg);
+                break;
+            case 'd':
+                data_map_size = atoi(optarg);
+                break;
+            case 'j':
+                journal_blocks = atoi(optarg);
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 's':
+                source = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* image = argv[optind];
+
+    // bitmaps are a small part of it
+    int64_t image_bytes = ((int64_t)inode_map_size + 8 * (int64_t)data_map_size + journal_blocks) * TFS_SECTOR_SIZE;
+    const TFS_BackendOps* ops = image_bytes > TFS_MKFS_MEM_LIMIT ? &TFS_BACKEND_FD : &TFS_BACKEND_MEM;
+    TFS_Backend backend;
+    if (TFS_Backend_Open(&backend, ops, image, true) <= 0) {
+        perror("Couldn't create image");
+        return 1;
+    }
+    TFS_Driver driver;
+    int create_code = TFS_Driver_Create(&driver, &backend, inode_map_size, data_map_size, journal_blocks);
+    if (create_code <= 0) {
+        fprintf(stderr, "Couldn't create image: %s\n", TFS_GetError(create_code));
+        usage(argv[0]);
+        return 1;
+    }
+
+    TFS_Driver_SetCompression(&driver, compress);
+
+    MkfsStats stats = { 0, 0, 0, 0, 0 };
+    int free_blocks = TFS_Driver_GetFreeDataCnt(&driver);
+    if (source != NULL) {
+        populate(&driver, source, &stats);
+    }
+    stats.used_blocks = free_blocks - TFS_Driver_GetFreeDataCnt(&driver);
+    printf("%d inodes, %d data blocks; %d dirs, %d files, %lld bytes copied into %lld blocks, %d skipped\n",
+        8 * inode_map_size, 8 * data_map_size, stats.dirs, stats.files, (long long)stats.bytes,
+        (long long)stats.used_blocks, stats.skipped);
+
+    // image goes to disk here
+    TFS_Driver_Destruct(&driver);
+    return stats.skipped == 0 ? 0 : 2;
+}
@@ -1,5 +1,7 @@
 #!/bin/sh
 
 #cd build && 
-./tupofs_fuse -f -d mnt -s # it's important to have it single-threaded
+./tupofs_fuse -f -d mnt "$@" # multithreaded, add -s to serialize requests
+# pass -o mmap to map the image, -o image=<path> to use other image than tupofs.bin,
+# -o cache to let the kernel cache attrs and pages (read-mostly mounts)
 # TODO: Good interface (:
@@ -0,0 +1,5 @@
+#!/bin/sh
+
+#cd build && 
+./tupofs_fuse_ll -f -d mnt "$@" # multithreaded, add -s to serialize requests
+# same options as run_fuse.sh
@@ -3,14 +3,20 @@
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "tupofs.h"
 #include "tfs_errs.h"
+#include "tfs_lz.h"
 
 TFS_Driver* TFS_Test_Init() {
-    FILE* fs_host = fopen("tupofs_test.bin", "wb+");
+    TFS_Backend backend;
+    int open_code = TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", true);
+    assert(open_code == TFS_ESUCC);
     TFS_Driver* driver = malloc(sizeof(TFS_Driver));
-    TFS_Driver_Init(driver, fs_host, true);
+    int init_code = TFS_Driver_Init(driver, &backend, true);
+    assert(init_code == TFS_ESUCC);
 
     printf("first inode block = %d\n", TFS_Driver_GetInodeBlockIdx(driver, 1));
     printf("first inode addr = %x\n", TFS_Driver_GetInodeBlockIdx(driver, 1) * TFS_SECTOR_SIZE);
@@ -21,7 +27,7 @@ TFS_Driver* TFS_Test_Init() {
 }
 
 void TFS_Test_Finish(TFS_Driver* driver) {
-    fclose(driver->file);
+    TFS_Driver_Destruct(driver);
     free(driver);
 }
 
@@ -81,6 +87,32 @@ void TFS_TestBitmap() {
     TFS_TESTBITMAP_TEST(1, 0, 134, 511);
     TFS_TESTBITMAP_SET(0, 7, 128, 300); 
     TFS_TESTBITMAP_TEST(1, 0, 134, 511);
+
+    // word-sized scanning and bulk updates
+    memset(bitmap, 0, sizeof(bitmap));
+    TFS_Bitmap_SetRange(bitmap, 64, 3, 130, 1);
+    TFS_TESTBITMAP_TEST(0, 0, 1, 2, 133, 134);
+    TFS_TESTBITMAP_TEST(1, 3, 7, 8, 63, 64, 127, 132);
+    assert(TFS_Bitmap_CountSet(bitmap, 64) == 130);
+    assert(TFS_Bitmap_CountRange(bitmap, 64, 0, 512) == 130);
+    assert(TFS_Bitmap_CountRange(bitmap, 64, 1, 5) == 3);
+    assert(TFS_Bitmap_CountRange(bitmap, 64, 130, 10) == 3);
+
+    int free_idxes[4];
+    TFS_Bitmap_FindFree(bitmap, 64, free_idxes, 4);
+    assert(free_idxes[0] == 0 && free_idxes[1] == 1 && free_idxes[2] == 2 && free_idxes[3] == 133);
+
+    TFS_Bitmap_SetRange(bitmap, 64, 0, 510, 1);
+    TFS_Bitmap_FindFree(bitmap, 64, free_idxes, 2);
+    assert(free_idxes[0] == 510 && free_idxes[1] == 511);
+
+    // size not multiple of word, tail must not be reported free
+    char small_bitmap[5] = {};
+    memset(small_bitmap, 0xff, 4);
+    TFS_Bitmap_SetBit(small_bitmap, 5, 37, 1);
+    TFS_Bitmap_FindFree(small_bitmap, 5, free_idxes, 3);
+    assert(free_idxes[0] == 32 && free_idxes[1] == 33 && free_idxes[2] == 34);
+    assert(TFS_Bitmap_CountSet(small_bitmap, 5) == 33);
 }
 
 void TFS_TestMultiblock() {
@@ -98,9 +130,10 @@ void TFS_TestMultiblock() {
         TFS_Driver_WriteFile(driver, inode, file_content, TFS_SECTOR_SIZE * 2);
         TFS_Driver_GetInode(driver, inode->inode_idx, inode);
         assert(inode->type == TFS_INODE_FILE);
-        assert(inode->file.used_blocks[0] != 0);
-        assert(inode->file.used_blocks[1] != 0);
-        assert(inode->file.used_blocks[2] == 0);
+        assert(inode->file.extent_cnt == 1);
+        assert(inode->file.extents[0].logical == 0);
+        assert(inode->file.extents[0].start != 0);
+        assert(inode->file.extents[0].len == 2);
     }
 
     // free some files in between
@@ -113,7 +146,8 @@ void TFS_TestMultiblock() {
     // check datamap
     char* datamap = malloc(TFS_SECTOR_SIZE);
     int datamap_size = driver->super_block.data_map_size;
-    TFS_Driver_ReadBlock(driver, TFS_DATAMAP_BLOCK_IDX, datamap);
+    TFS_Driver_Sync(driver); // bitmaps are resident
+    TFS_Driver_ReadBlock(driver, driver->super_block.data_map_start, datamap);
     assert(TFS_Bitmap_GetBit(datamap, datamap_size, 0) == 0);
     assert(TFS_Bitmap_GetBit(datamap, datamap_size, 1) == 0);
     assert(TFS_Bitmap_GetBit(datamap, datamap_size, 2) == 1);
@@ -128,13 +162,20 @@ void TFS_TestMultiblock() {
     TFS_Driver_WriteFile(driver, inode, file_content, TFS_SECTOR_SIZE * 3);
 
     // refresh and check datamap
-    TFS_Driver_ReadBlock(driver, TFS_DATAMAP_BLOCK_IDX, datamap);
-    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 0) == 1); // 1
-    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 1) == 1); // 2
+    TFS_Driver_Sync(driver);
+    TFS_Driver_ReadBlock(driver, driver->super_block.data_map_start, datamap);
+    // next fit keeps the file contiguous after the last allocation instead of filling holes
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 0) == 0);
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 1) == 0);
     assert(TFS_Bitmap_GetBit(datamap, datamap_size, 2) == 1);
     assert(TFS_Bitmap_GetBit(datamap, datamap_size, 3) == 1);
-    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 14) == 1); // 3
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 14) == 0);
     assert(TFS_Bitmap_GetBit(datamap, datamap_size, 15) == 0);
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 20) == 1);
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 21) == 1);
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 22) == 1);
+    assert(TFS_Bitmap_GetBit(datamap, datamap_size, 23) == 0);
+    assert(TFS_Inode_File_GetExtentCnt(&inode->file) == 1);
 
     // try to read
     char* read_content = malloc(TFS_SECTOR_SIZE * 3);
@@ -148,6 +189,136 @@ void TFS_TestMultiblock() {
     TFS_Test_Finish(driver);
 }
 
+void TFS_TestExtentAllocator() {
+    TFS_Driver* driver = TFS_Test_Init();
+    int datamap_size = driver->super_block.data_map_size;
+
+    // leave free runs of 2, 5 and 3 blocks, everything else occupied
+    for (int i = 1; i <= datamap_size * 8; ++i) {
+        bool free_run = (11 <= i && i <= 12) || (21 <= i && i <= 25) || (31 <= i && i <= 33);
+        TFS_Driver_SetDataBlockOccupied(driver, i, !free_run);
+    }
+    assert(TFS_Driver_GetFreeDataCnt(driver) == 10);
+
+    TFS_FragStats stats;
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == 10 && stats.free_runs == 3 && stats.largest_free_run == 5);
+    assert(stats.fragmentation > 0.49 && stats.fragmentation < 0.51);
+
+    TFS_Extent extents[4];
+    assert(TFS_Driver_AllocExtents(driver, 11, extents, 4) == TFS_ENOSPACE);
+
+    // fits into a single run
+    assert(TFS_Driver_AllocExtents(driver, 3, extents, 4) == 1);
+    assert(extents[0].start == 21 && extents[0].len == 3);
+    TFS_Driver_FreeExtents(driver, extents, 1);
+
+    // doesn't fit anywhere: largest runs first
+    assert(TFS_Driver_AllocExtents(driver, 7, extents, 4) == 2);
+    assert(extents[0].start == 21 && extents[0].len == 5);
+    assert(extents[1].start == 31 && extents[1].len == 2);
+
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == 3 && stats.free_runs == 2 && stats.largest_free_run == 2);
+
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestLargeFile() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+
+    // well past the old 1 MB limit
+    const int file_size = 4 * 1024 * 1024 + 123;
+    char* file_content = malloc(file_size);
+    for (int i = 0; i < file_size; ++i) {
+        file_content[i] = i * 13 % 253;
+    }
+    TFS_Driver_GetFreeInode(driver, inode);
+    assert(TFS_Driver_WriteFile(driver, inode, file_content, file_size) == file_size);
+    assert(inode->file.extent_cnt == 1 && inode->file.index_cnt == 0);
+
+    char* read_content = malloc(file_size);
+    TFS_Driver_GetInode(driver, inode->inode_idx, inode);
+    assert(TFS_Driver_ReadFile(driver, inode, read_content) == file_size);
+    assert(memcmp(file_content, read_content, file_size) == 0);
+
+    free(read_content);
+    free(file_content);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestExtentLeaves() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int datamap_size = driver->super_block.data_map_size;
+
+    // only every other block is free, so each data block becomes its own extent
+    for (int i = 1; i <= datamap_size * 8; ++i) {
+        TFS_Driver_SetDataBlockOccupied(driver, i, i > 1200 || i % 2 == 0);
+    }
+
+    const int blocks = 300;
+    const int file_size = blocks * TFS_SECTOR_SIZE - 7;
+    char* file_content = malloc(file_size);
+    for (int i = 0; i < file_size; ++i) {
+        file_content[i] = i * 31 % 241;
+    }
+    TFS_Driver_GetFreeInode(driver, inode);
+    assert(TFS_Driver_WriteFile(driver, inode, file_content, file_size) == file_size);
+    assert(inode->file.extent_cnt == blocks);
+    assert(inode->file.index_cnt == (blocks + TFS_LEAF_EXTENTS - 1) / TFS_LEAF_EXTENTS);
+
+    TFS_Driver_GetInode(driver, inode->inode_idx, inode);
+    int run;
+    int data_idx = TFS_Driver_MapFileBlock(driver, inode, 200, &run);
+    assert(run == 1 && data_idx % 2 == 1);
+
+    char* read_content = malloc(file_size);
+    assert(TFS_Driver_ReadFile(driver, inode, read_content) == file_size);
+    assert(memcmp(file_content, read_content, file_size) == 0);
+    assert(TFS_Driver_ReadFileRange(driver, inode, 150 * TFS_SECTOR_SIZE - 10, 20, read_content) == 20);
+    assert(memcmp(file_content + 150 * TFS_SECTOR_SIZE - 10, read_content, 20) == 0);
+
+    // all data and leaf blocks are released
+    TFS_Driver_RmFileInode(driver, inode);
+    TFS_FragStats stats;
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == 600);
+
+    free(read_content);
+    free(file_content);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestFormatVersion() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_SuperBlock* super_block = malloc(TFS_SECTOR_SIZE);
+    TFS_Driver_ReadBlock(driver, 0, super_block);
+    super_block->version = 0;
+    TFS_Driver_WriteBlock(driver, 0, super_block);
+    TFS_Test_Finish(driver);
+
+    TFS_Backend backend;
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", false) == TFS_ESUCC);
+    driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_EBADFS);
+
+    // layout must match bitmap sizes
+    driver = TFS_Test_Init();
+    TFS_Driver_ReadBlock(driver, 0, super_block);
+    super_block->data_start += 1;
+    TFS_Driver_WriteBlock(driver, 0, super_block);
+    TFS_Test_Finish(driver);
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", false) == TFS_ESUCC);
+    driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_EBADFS);
+    free(driver);
+    free(super_block);
+}
+
 void TFS_TestUnevenFileSize() {
     TFS_Driver* driver = TFS_Test_Init();
     TFS_Inode* inode = malloc(sizeof(TFS_Inode));
@@ -173,6 +344,110 @@ void TFS_TestUnevenFileSize() {
     TFS_Test_Finish(driver);
 }
 
+void TFS_TestReadFileRange() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+
+    const int file_size = TFS_SECTOR_SIZE * 3 + 100;
+    char* file_content = malloc(file_size);
+    for (int i = 0; i < file_size; ++i) {
+        file_content[i] = i * 7 % 251;
+    }
+    TFS_Driver_GetFreeInode(driver, inode);
+    TFS_Driver_WriteFile(driver, inode, file_content, file_size);
+
+    char* read_content = malloc(file_size);
+    // within one block
+    assert(TFS_Driver_ReadFileRange(driver, inode, 10, 100, read_content) == 100);
+    assert(memcmp(file_content + 10, read_content, 100) == 0);
+    // across block boundaries, including a whole middle block
+    assert(TFS_Driver_ReadFileRange(driver, inode, 2000, 2 * TFS_SECTOR_SIZE, read_content) == 2 * TFS_SECTOR_SIZE);
+    assert(memcmp(file_content + 2000, read_content, 2 * TFS_SECTOR_SIZE) == 0);
+    // clamped at EOF
+    assert(TFS_Driver_ReadFileRange(driver, inode, file_size - 50, 1000, read_content) == 50);
+    assert(memcmp(file_content + file_size - 50, read_content, 50) == 0);
+    assert(TFS_Driver_ReadFileRange(driver, inode, file_size, 1000, read_content) == 0);
+
+    free(read_content);
+    free(file_content);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestBlockCache() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Driver_SetCacheSize(driver, 4);
+    char* buf = malloc(TFS_SECTOR_SIZE);
+    char* raw = malloc(TFS_SECTOR_SIZE);
+    int block_idx = TFS_Driver_GetDataBlockIdx(driver, 1);
+
+    // write stays in memory until sync
+    memset(buf, 'x', TFS_SECTOR_SIZE);
+    TFS_Driver_WriteBlock(driver, block_idx, buf);
+    driver->backend.ops->read_block(&driver->backend, block_idx, raw);
+    assert(raw[0] == 0);
+
+    long hits = driver->cache.hits;
+    TFS_Driver_ReadBlock(driver, block_idx, raw);
+    assert(driver->cache.hits == hits + 1);
+    assert(memcmp(buf, raw, TFS_SECTOR_SIZE) == 0);
+
+    TFS_Driver_Sync(driver);
+    driver->backend.ops->read_block(&driver->backend, block_idx, raw);
+    assert(memcmp(buf, raw, TFS_SECTOR_SIZE) == 0);
+
+    // dirty blocks survive eviction; until they are committed, cache grows instead
+    for (int i = 0; i < 8; ++i) {
+        buf[0] = 'a' + i;
+        TFS_Driver_WriteBlock(driver, block_idx + i, buf);
+    }
+    assert(driver->cache.size > 4);
+    TFS_Driver_Commit(driver);
+    assert(driver->cache.size == 4);
+    long misses = driver->cache.misses;
+    TFS_Driver_ReadBlock(driver, block_idx, raw);
+    assert(driver->cache.misses == misses + 1);
+    assert(raw[0] == 'a');
+
+    free(raw);
+    free(buf);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestMmapBackend() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Driver_CreateIdxByRawPath(driver, "/foo", TFS_INODE_FILE);
+    TFS_Driver_WriteFileByRawPath(driver, "/foo", "mapped", 6);
+    TFS_Test_Finish(driver);
+
+    TFS_Backend backend;
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_MMAP, "tupofs_test.bin", false) == TFS_ESUCC);
+    driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_ESUCC);
+
+    char buf[16] = {};
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/foo", buf) == 6);
+    assert(memcmp(buf, "mapped", 6) == 0);
+
+    int foo_idx = TFS_Driver_GetInodeIdxByRawPath(driver, "/foo");
+    const TFS_Inode* mapped = TFS_Driver_MapInode(driver, foo_idx);
+    assert(mapped != NULL);
+    assert(mapped->type == TFS_INODE_FILE && mapped->file.file_size == 6);
+    assert(TFS_Inode_File_IsInline(&mapped->file) && memcmp(mapped->file.data, "mapped", 6) == 0);
+
+    TFS_Driver_CreateIdxByRawPath(driver, "/bar", TFS_INODE_FILE);
+    TFS_Driver_WriteFileByRawPath(driver, "/bar", "written via mmap", 16);
+    TFS_Test_Finish(driver);
+
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", false) == TFS_ESUCC);
+    driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_ESUCC);
+    assert(TFS_Driver_MapInode(driver, foo_idx) == NULL);
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/bar", buf) == 16);
+    assert(memcmp(buf, "written via mmap", 16) == 0);
+    TFS_Test_Finish(driver);
+}
+
 void TFS_TestPath() {
     TFS_Path path;
     TFS_Path_Init(&path, "/usr/lib/baka/bakalib.so.7");
@@ -275,9 +550,10 @@ void TFS_TestBasicFileOps() {
     assert(TFS_Driver_DeleteByRawPath(driver, "/foo/bar") == idx_bar);
     assert(TFS_Driver_DeleteByRawPath(driver, "/foo") == idx_foo);
 
-    TFS_Driver_ReadBlock(driver, TFS_INODEMAP_BLOCK_IDX, buf);
+    TFS_Driver_Sync(driver);
+    TFS_Driver_ReadBlock(driver, driver->super_block.inode_map_start, buf);
     assert(buf[0] == 1);
-    TFS_Driver_ReadBlock(driver, TFS_DATAMAP_BLOCK_IDX, buf);
+    TFS_Driver_ReadBlock(driver, driver->super_block.data_map_start, buf);
     assert(buf[0] == 0);
 
     free(buf);
@@ -285,16 +561,1067 @@ void TFS_TestBasicFileOps() {
     TFS_Test_Finish(driver);
 }
 
+void TFS_TestHashedDir() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_FragStats stats_before, stats;
+    TFS_Driver_GetFragStats(driver, &stats_before);
+
+    const int files = 3000;
+    char path[64];
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/big", TFS_INODE_DIR) > 0);
+    int* idxes = malloc(sizeof(int) * files);
+    for (int i = 0; i < files; ++i) {
+        sprintf(path, "/big/file_%d", i);
+        idxes[i] = TFS_Driver_CreateIdxByRawPath(driver, path, TFS_INODE_FILE);
+        assert(idxes[i] > 0);
+    }
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/big/file_42", TFS_INODE_FILE) == TFS_EEXISTS);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/big/name_that_does_not_fit_into_dirent", TFS_INODE_FILE) == TFS_ENAMETOOLONG);
+
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/big", inode) > 0);
+    assert(inode->dir.children_cnt == files);
+    assert(inode->dir.bucket_cnt > files / TFS_DIR_BUCKET_ENTRIES);
+    for (int i = 0; i < files; ++i) {
+        sprintf(path, "/big/file_%d", i);
+        assert(TFS_Driver_GetInodeIdxByRawPath(driver, path) == idxes[i]);
+    }
+
+    // every entry is streamed exactly once, in small batches
+    char* seen = malloc(files);
+    memset(seen, 0, files);
+    TFS_Inode_DirEnt entries[7];
+    int64_t cookie = 0;
+    int cnt, total = 0;
+    while ((cnt = TFS_Driver_ReadDirEntries(driver, inode, &cookie, entries, 7)) > 0) {
+        for (int i = 0; i < cnt; ++i) {
+            int file_i = atoi(entries[i].name + strlen("file_"));
+            assert(entries[i].inode_idx == idxes[file_i] && !seen[file_i]);
+            seen[file_i] = 1;
+        }
+        total += cnt;
+    }
+    assert(total == files);
+
+    for (int i = 0; i < files; i += 2) {
+        sprintf(path, "/big/file_%d", i);
+        assert(TFS_Driver_DeleteByRawPath(driver, path) == idxes[i]);
+    }
+    assert(TFS_Driver_MvRawPath(driver, "/big/file_1", "/big/renamed") == idxes[1]);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/big/renamed") == idxes[1]);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/big/file_1") == TFS_ENOENT);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/big/file_2") == TFS_ENOENT);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/big/file_2999") == idxes[2999]);
+
+    // emptied dir returns its buckets
+    assert(TFS_Driver_DeleteByRawPath(driver, "/big/renamed") == idxes[1]);
+    for (int i = 3; i < files; i += 2) {
+        sprintf(path, "/big/file_%d", i);
+        assert(TFS_Driver_DeleteByRawPath(driver, path) == idxes[i]);
+    }
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/big", inode) > 0);
+    assert(inode->dir.children_cnt == 0 && inode->dir.bucket_cnt == 0);
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == stats_before.free_blocks);
+
+    free(seen);
+    free(idxes);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestDentryCache() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/a", TFS_INODE_DIR) > 0);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/a/b", TFS_INODE_DIR) > 0);
+    int c_idx = TFS_Driver_CreateIdxByRawPath(driver, "/a/b/c", TFS_INODE_DIR);
+    int file_idx = TFS_Driver_CreateIdxByRawPath(driver, "/a/b/c/file", TFS_INODE_FILE);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/file") == file_idx);
+
+    // warm lookups only read the last inode, and that one is in block cache
+    long misses = driver->cache.misses;
+    long hits = driver->dentries.hits;
+    for (int i = 0; i < 10; ++i) {
+        assert(TFS_Driver_GetInodeByRawPath(driver, "/a/b/c/file", inode) == file_idx);
+    }
+    assert(driver->cache.misses == misses);
+    assert(driver->dentries.hits == hits + 40);
+
+    // negative entries are cached and replaced on create
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/new") == TFS_ENOENT);
+    hits = driver->dentries.hits;
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/new") == TFS_ENOENT);
+    assert(driver->dentries.hits == hits + 4);
+    int new_idx = TFS_Driver_CreateIdxByRawPath(driver, "/a/b/c/new", TFS_INODE_FILE);
+    assert(new_idx > 0);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/new") == new_idx);
+
+    assert(TFS_Driver_MvRawPath(driver, "/a/b/c/new", "/a/b/c/moved") == new_idx);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/new") == TFS_ENOENT);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/moved") == new_idx);
+
+    assert(TFS_Driver_DeleteByRawPath(driver, "/a/b/c/moved") == new_idx);
+    assert(TFS_Driver_DeleteByRawPath(driver, "/a/b/c/file") == file_idx);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/file") == TFS_ENOENT);
+
+    // recreated dir gets the same idx, but none of the old entries
+    assert(TFS_Driver_DeleteByRawPath(driver, "/a/b/c") == c_idx);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/a/b/c", TFS_INODE_DIR) == c_idx);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/a/b/c/file", TFS_INODE_FILE) > 0);
+
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+#define TFS_TEST_THREADS 4
+#define TFS_TEST_THREAD_FILE_SIZE (37 * TFS_SECTOR_SIZE + 100)
+
+typedef struct TFS_TestThreadArg {
+    TFS_Driver* driver;
+    int thread_i;
+} TFS_TestThreadArg;
+
+static void* TFS_TestConcurrentReader(void* raw_arg) {
+    TFS_TestThreadArg* arg = raw_arg;
+    char path[32];
+    sprintf(path, "/dir/file_%d", arg->thread_i);
+    char* buf = malloc(TFS_SECTOR_SIZE * 3);
+    for (int iter = 0; iter < 300; ++iter) {
+        int offset = iter * 997 % (TFS_TEST_THREAD_FILE_SIZE - TFS_SECTOR_SIZE * 3);
+        int size = TFS_SECTOR_SIZE * 3;
+        assert(TFS_Driver_ReadFileRangeByRawPath(arg->driver, path, offset, size, buf) == size);
+        for (int i = 0; i < size; ++i) {
+            assert(buf[i] == (char)((offset + i) * 7 + arg->thread_i));
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void* TFS_TestConcurrentWriter(void* raw_arg) {
+    TFS_TestThreadArg* arg = raw_arg;
+    char path[32];
+    char content[5000];
+    for (int iter = 0; iter < 100; ++iter) {
+        sprintf(path, "/dir/tmp_%d", iter);
+        assert(TFS_Driver_CreateIdxByRawPath(arg->driver, path, TFS_INODE_FILE) > 0);
+        memset(content, iter, sizeof(content));
+        assert(TFS_Driver_WriteFileByRawPath(arg->driver, path, content, sizeof(content)) == sizeof(content));
+        if (iter % 2 == 0) {
+            assert(TFS_Driver_DeleteByRawPath(arg->driver, path) > 0);
+        }
+    }
+    return NULL;
+}
+
+void TFS_TestConcurrency() {
+    TFS_Driver* driver = TFS_Test_Init();
+    // small cache so threads keep evicting each other's blocks
+    TFS_Driver_SetCacheSize(driver, 16);
+
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/dir", TFS_INODE_DIR) > 0);
+    char* content = malloc(TFS_TEST_THREAD_FILE_SIZE);
+    char path[32];
+    for (int t = 0; t < TFS_TEST_THREADS; ++t) {
+        sprintf(path, "/dir/file_%d", t);
+        assert(TFS_Driver_CreateIdxByRawPath(driver, path, TFS_INODE_FILE) > 0);
+        for (int i = 0; i < TFS_TEST_THREAD_FILE_SIZE; ++i) {
+            content[i] = i * 7 + t;
+        }
+        assert(TFS_Driver_WriteFileByRawPath(driver, path, content, TFS_TEST_THREAD_FILE_SIZE) == TFS_TEST_THREAD_FILE_SIZE);
+    }
+    free(content);
+
+    pthread_t threads[TFS_TEST_THREADS + 1];
+    TFS_TestThreadArg args[TFS_TEST_THREADS + 1];
+    for (int t = 0; t <= TFS_TEST_THREADS; ++t) {
+        args[t].driver = driver;
+        args[t].thread_i = t;
+        pthread_create(&threads[t], NULL, t < TFS_TEST_THREADS ? TFS_TestConcurrentReader : TFS_TestConcurrentWriter, &args[t]);
+    }
+    for (int t = 0; t <= TFS_TEST_THREADS; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    char buf[5000];
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/dir/tmp_99", buf) == sizeof(buf));
+    assert(buf[0] == 99 && buf[sizeof(buf) - 1] == 99);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/dir/tmp_98") == TFS_ENOENT);
+
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestWriteFileRange() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_FragStats stats_before, stats;
+    TFS_Driver_GetFragStats(driver, &stats_before);
+
+    // reference copy of the file kept in memory
+    const int max_size = 40 * TFS_SECTOR_SIZE;
+    char* expected = calloc(max_size, 1);
+    char* actual = malloc(max_size);
+    char* chunk = malloc(max_size);
+    int size = 0;
+
+    int idx = TFS_Driver_CreateByRawPath(driver, inode, "/file", TFS_INODE_FILE);
+    assert(idx > 0);
+    const int writes[][2] = {
+        { 0, 100 },                                      // inside first block
+        { 50, 3 * TFS_SECTOR_SIZE },                     // overwrite and append
+        { 10 * TFS_SECTOR_SIZE + 7, 2 * TFS_SECTOR_SIZE }, // past EOF, leaves a hole
+        { TFS_SECTOR_SIZE, 4 * TFS_SECTOR_SIZE },        // whole blocks, partly in the hole
+        { 12 * TFS_SECTOR_SIZE + 7, 1 },                 // one byte past EOF
+    };
+    for (int w = 0; w < (int)(sizeof(writes) / sizeof(writes[0])); ++w) {
+        int offset = writes[w][0], len = writes[w][1];
+        for (int i = 0; i < len; ++i) {
+            chunk[i] = (i + w * 13) % 251 + 1;
+        }
+        memcpy(expected + offset, chunk, len);
+        size = offset + len > size ? offset + len : size;
+
+        assert(TFS_Driver_WriteFileRange(driver, inode, offset, len, chunk) == len);
+        TFS_Driver_GetInode(driver, idx, inode);
+        assert(inode->file.file_size == size);
+        assert(TFS_Driver_ReadFile(driver, inode, actual) == size);
+        assert(memcmp(expected, actual, size) == 0);
+    }
+    // only blocks that grow the file were allocated
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == stats_before.free_blocks - (size + TFS_SECTOR_SIZE - 1) / TFS_SECTOR_SIZE);
+
+    // shrink to the middle of a block, then grow back: the cut part reads as zeroes
+    assert(TFS_Driver_Truncate(driver, inode, 2 * TFS_SECTOR_SIZE + 5) == TFS_ESUCC);
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == stats_before.free_blocks - 3);
+    assert(TFS_Driver_Truncate(driver, inode, 20 * TFS_SECTOR_SIZE) == TFS_ESUCC);
+    memset(expected + 2 * TFS_SECTOR_SIZE + 5, 0, max_size - 2 * TFS_SECTOR_SIZE - 5);
+    TFS_Driver_GetInode(driver, idx, inode);
+    assert(TFS_Driver_ReadFile(driver, inode, actual) == 20 * TFS_SECTOR_SIZE);
+    assert(memcmp(expected, actual, 20 * TFS_SECTOR_SIZE) == 0);
+
+    assert(TFS_Driver_WriteFileRangeByRawPath(driver, "/file", 3, 4, "abcd") == 4);
+    assert(TFS_Driver_ReadFileRangeByRawPath(driver, "/file", 2, 6, actual) == 6);
+    assert(memcmp(actual + 1, "abcd", 4) == 0 && actual[5] == expected[7]);
+    assert(TFS_Driver_TruncateByRawPath(driver, "/file", 0) == TFS_ESUCC);
+    TFS_Driver_GetFragStats(driver, &stats);
+    assert(stats.free_blocks == stats_before.free_blocks);
+
+    free(chunk);
+    free(actual);
+    free(expected);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestMvAcrossDirs() {
+    TFS_Driver* driver = TFS_Test_Init();
+
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/a", TFS_INODE_DIR) > 0);
+    int b_idx = TFS_Driver_CreateIdxByRawPath(driver, "/a/b", TFS_INODE_DIR);
+    int c_idx = TFS_Driver_CreateIdxByRawPath(driver, "/c", TFS_INODE_DIR);
+    int file_idx = TFS_Driver_CreateIdxByRawPath(driver, "/a/b/file", TFS_INODE_FILE);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/c/taken", TFS_INODE_FILE) > 0);
+
+    assert(TFS_Driver_MvRawPath(driver, "/a/b/file", "/c/file") == file_idx);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/file") == TFS_ENOENT);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/c/file") == file_idx);
+    assert(TFS_Driver_MvRawPath(driver, "/c/file", "/c/taken") == TFS_EEXISTS);
+
+    // dirs move with their contents, but not into themselves
+    assert(TFS_Driver_MvRawPath(driver, "/c", "/a/b/c") == c_idx);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b/c/file") == file_idx);
+    assert(TFS_Driver_MvRawPath(driver, "/a", "/a/b/c/a") == TFS_EINVAL);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/a/b") == b_idx);
+
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestOpenFile() {
+    TFS_Driver* driver = TFS_Test_Init();
+    const int size = 5 * TFS_SECTOR_SIZE + 11;
+    char* content = malloc(size);
+    char* buf = malloc(size);
+    for (int i = 0; i < size; ++i) {
+        content[i] = i % 113;
+    }
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/dir", TFS_INODE_DIR) > 0);
+    int idx = TFS_Driver_CreateIdxByRawPath(driver, "/dir/file", TFS_INODE_FILE);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/dir/file", content, size) == size);
+
+    TFS_File* file;
+    assert(TFS_Driver_OpenFile(driver, "/dir", &file) == TFS_ENOENT);
+    assert(TFS_Driver_OpenFile(driver, "/dir/file", &file) == idx);
+    assert(file->file_size == size && file->extent_cnt == 1);
+
+    // reads on an open file don't walk the path
+    long dentry_lookups = driver->dentries.hits + driver->dentries.misses;
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == size);
+    assert(memcmp(buf, content, size) == 0);
+    assert(TFS_Driver_FileRead(driver, file, size - 20, 100, buf) == 20);
+    assert(memcmp(buf, content + size - 20, 20) == 0);
+    assert(driver->dentries.hits + driver->dentries.misses == dentry_lookups);
+
+    // changes made by path are seen through the handle and vice versa
+    assert(TFS_Driver_WriteFileRangeByRawPath(driver, "/dir/file", size, 5, "tail!") == 5);
+    assert(TFS_Driver_FileRead(driver, file, size, 100, buf) == 5);
+    assert(memcmp(buf, "tail!", 5) == 0);
+    assert(TFS_Driver_FileWrite(driver, file, 1, 3, "xyz") == 3);
+    assert(TFS_Driver_ReadFileRangeByRawPath(driver, "/dir/file", 0, 5, buf) == 5);
+    assert(buf[0] == content[0] && memcmp(buf + 1, "xyz", 3) == 0 && buf[4] == content[4]);
+    assert(TFS_Driver_FileTruncate(driver, file, 10) == TFS_ESUCC);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == 10);
+
+    // handle of a deleted file reports it's gone
+    assert(TFS_Driver_DeleteByRawPath(driver, "/dir/file") == idx);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == TFS_ENOENT);
+    TFS_Driver_CloseFile(driver, file);
+
+    free(buf);
+    free(content);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestIdxOps() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+
+    int dir_idx = TFS_Driver_CreateAt(driver, TFS_ROOT_INODE_IDX, "dir", TFS_INODE_DIR, inode);
+    assert(dir_idx > 0 && inode->inode_idx == dir_idx && inode->type == TFS_INODE_DIR);
+    int file_idx = TFS_Driver_CreateAt(driver, dir_idx, "file", TFS_INODE_FILE, inode);
+    assert(file_idx > 0 && inode->type == TFS_INODE_FILE);
+    assert(TFS_Driver_CreateAt(driver, dir_idx, "file", TFS_INODE_FILE, inode) == TFS_EEXISTS);
+    assert(TFS_Driver_CreateAt(driver, file_idx, "x", TFS_INODE_FILE, inode) == TFS_ENOENT);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/dir/file") == file_idx);
+
+    assert(TFS_Driver_LookupAt(driver, dir_idx, "file", inode) == file_idx);
+    assert(inode->inode_idx == file_idx);
+    assert(TFS_Driver_LookupAt(driver, dir_idx, "nope", inode) == TFS_ENOENT);
+    assert(TFS_Driver_LookupAt(driver, 100500, "file", inode) == TFS_ENOENT);
+    assert(TFS_Driver_GetInodeByIdx(driver, dir_idx, inode) == dir_idx);
+    assert(inode->dir.children_cnt == 1);
+    assert(TFS_Driver_GetInodeByIdx(driver, 0, inode) == TFS_ENOENT);
+
+    TFS_File* file;
+    assert(TFS_Driver_OpenFileAt(driver, dir_idx, &file) == TFS_ENOENT);
+    assert(TFS_Driver_OpenFileAt(driver, file_idx, &file) == file_idx);
+    assert(TFS_Driver_FileWrite(driver, file, 0, 5, "hello") == 5);
+    TFS_Driver_CloseFile(driver, file);
+    assert(TFS_Driver_TruncateAt(driver, file_idx, 2) == TFS_ESUCC);
+    assert(TFS_Driver_TruncateAt(driver, dir_idx, 2) == TFS_ENOENT);
+
+    TFS_Inode_DirEnt entry;
+    int64_t cookie = 0;
+    assert(TFS_Driver_ReadDirAt(driver, dir_idx, &cookie, &entry, 1) == 1);
+    assert(entry.inode_idx == file_idx && strcmp(entry.name, "file") == 0);
+    assert(TFS_Driver_ReadDirAt(driver, dir_idx, &cookie, &entry, 1) == 0);
+    assert(TFS_Driver_ReadDirAt(driver, file_idx, &cookie, &entry, 1) == TFS_ENOENT);
+
+    assert(TFS_Driver_MvAt(driver, dir_idx, "file", TFS_ROOT_INODE_IDX, "moved") == file_idx);
+    assert(TFS_Driver_ReadFileRangeByRawPath(driver, "/moved", 0, 10, &entry) == 2);
+    assert(TFS_Driver_MvAt(driver, TFS_ROOT_INODE_IDX, "dir", dir_idx, "dir") == TFS_EINVAL);
+
+    int sub_idx = TFS_Driver_CreateAt(driver, dir_idx, "sub", TFS_INODE_DIR, inode);
+    assert(TFS_Driver_DeleteAt(driver, TFS_ROOT_INODE_IDX, "dir") == 0);
+    assert(TFS_Driver_DeleteAt(driver, dir_idx, "sub") == sub_idx);
+    assert(TFS_Driver_DeleteAt(driver, TFS_ROOT_INODE_IDX, "dir") == dir_idx);
+    assert(TFS_Driver_DeleteAt(driver, TFS_ROOT_INODE_IDX, "moved") == file_idx);
+    // freed inodes are gone for the idx ops too
+    assert(TFS_Driver_GetInodeByIdx(driver, file_idx, inode) == TFS_ENOENT);
+    assert(TFS_Driver_LookupAt(driver, dir_idx, "sub", inode) == TFS_ENOENT);
+
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+// reads runs straight from the image, like the kernel does for spliced FUSE reads
+static int TFS_Test_ReadRuns(TFS_Driver* driver, const TFS_ImageRun* runs, int cnt, char* buf) {
+    int total = 0;
+    for (int i = 0; i < cnt; ++i) {
+        assert(pread(driver->backend.fd, buf + total, runs[i].size, runs[i].offset) == runs[i].size);
+        total += runs[i].size;
+    }
+    return total;
+}
+
+void TFS_TestFileMapRange() {
+    TFS_Driver* driver = TFS_Test_Init();
+    const int size = 3 * TFS_SECTOR_SIZE + 100;
+    char* content = malloc(size);
+    char* buf = malloc(size);
+    for (int i = 0; i < size; ++i) {
+        content[i] = i % 89;
+    }
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/a", TFS_INODE_FILE) > 0);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/b", TFS_INODE_FILE) > 0);
+    TFS_File* file;
+    assert(TFS_Driver_OpenFile(driver, "/a", &file) > 0);
+
+    // partial writes stay dirty in cache, mapping must write them back
+    assert(TFS_Driver_FileWrite(driver, file, 0, size, content) == size);
+    TFS_ImageRun runs[8];
+    int cnt = TFS_Driver_FileMapRange(driver, file, 100, size, runs, 8);
+    assert(cnt == 1);
+    assert(TFS_Test_ReadRuns(driver, runs, cnt, buf) == size - 100);
+    assert(memcmp(buf, content + 100, size - 100) == 0);
+    assert(TFS_Driver_FileMapRange(driver, file, size, 10, runs, 8) == 0);
+
+    // another file in between splits /a into two extents
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/b", content, TFS_SECTOR_SIZE) == TFS_SECTOR_SIZE);
+    const int new_size = 4 * TFS_SECTOR_SIZE + 5;
+    assert(TFS_Driver_FileWrite(driver, file, 4 * TFS_SECTOR_SIZE, 5, "tail!") == 5);
+    char* new_buf = malloc(new_size);
+    cnt = TFS_Driver_FileMapRange(driver, file, 0, new_size, runs, 8);
+    assert(cnt == 2);
+    assert(TFS_Test_ReadRuns(driver, runs, cnt, new_buf) == new_size);
+    assert(memcmp(new_buf, content, size) == 0);
+    assert(memcmp(new_buf + 4 * TFS_SECTOR_SIZE, "tail!", 5) == 0);
+    // runs that don't fit are left out
+    assert(TFS_Driver_FileMapRange(driver, file, 0, new_size, runs, 1) == 1);
+    assert(runs[0].size == 4 * TFS_SECTOR_SIZE);
+    free(new_buf);
+
+    TFS_Driver_CloseFile(driver, file);
+    free(buf);
+    free(content);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestReadDirAttrs() {
+    TFS_Driver* driver = TFS_Test_Init();
+    const int file_cnt = 200; // hashed
+    char name[32];
+    for (int i = 0; i < file_cnt; ++i) {
+        sprintf(name, "/f%d", i);
+        assert(TFS_Driver_CreateIdxByRawPath(driver, name, TFS_INODE_FILE) > 0);
+        assert(TFS_Driver_WriteFileByRawPath(driver, name, name, i % 7) == i % 7);
+    }
+    int dir_idx = TFS_Driver_CreateIdxByRawPath(driver, "/dir", TFS_INODE_DIR);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/") == TFS_ROOT_INODE_IDX);
+
+    // small pages, every page resumed from the cookie of its' last entry
+    TFS_DirEntry entries[16];
+    int64_t cookie = 0;
+    int seen = 0;
+    bool dir_seen = false;
+    int cnt;
+    while ((cnt = TFS_Driver_ReadDirAttrsByRawPath(driver, "/", &cookie, entries, 16)) > 0) {
+        for (int i = 0; i < cnt; ++i) {
+            TFS_DirEntry* entry = &entries[i];
+            if (entry->ent.inode_idx == dir_idx) {
+                assert(entry->type == TFS_INODE_DIR && strcmp(entry->ent.name, "dir") == 0);
+                dir_seen = true;
+            } else {
+                assert(entry->type == TFS_INODE_FILE);
+                assert(entry->file_size == atoi(entry->ent.name + 1) % 7);
+            }
+            ++seen;
+        }
+        // restarting from a middle entry gives the entries after it
+        int64_t resume = entries[cnt / 2].next_cookie;
+        TFS_DirEntry next;
+        if (cnt / 2 + 1 < cnt) {
+            assert(TFS_Driver_ReadDirAttrsAt(driver, TFS_ROOT_INODE_IDX, &resume, &next, 1) == 1);
+            assert(next.ent.inode_idx == entries[cnt / 2 + 1].ent.inode_idx);
+        }
+    }
+    assert(seen == file_cnt + 1 && dir_seen);
+    cookie = 0;
+    assert(TFS_Driver_ReadDirAttrsAt(driver, dir_idx, &cookie, entries, 16) == 0);
+    assert(TFS_Driver_ReadDirAttrsByRawPath(driver, "/f1", &cookie, entries, 16) == TFS_ENOENT);
+
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestFileAppend() {
+    TFS_Driver* driver = TFS_Test_Init();
+    const int size = 5 * TFS_STREAM_CHUNK + 333;
+    char* content = malloc(size);
+    char* buf = malloc(TFS_STREAM_CHUNK);
+    for (int i = 0; i < size; ++i) {
+        content[i] = i % 101;
+    }
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/stream", TFS_INODE_FILE) > 0);
+    TFS_File* file;
+    assert(TFS_Driver_OpenFile(driver, "/stream", &file) > 0);
+
+    // uneven chunks, both partial and whole blocks
+    int chunks[] = {100, TFS_STREAM_CHUNK, TFS_SECTOR_SIZE - 100, TFS_STREAM_CHUNK};
+    int pos = 0;
+    for (int i = 0; pos < size; ++i) {
+        int chunk = chunks[i % 4] < size - pos ? chunks[i % 4] : size - pos;
+        assert(TFS_Driver_FileAppend(driver, file, chunk, content + pos) == chunk);
+        pos += chunk;
+    }
+
+    // appended blocks come from one growing extent
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/stream", inode) > 0);
+    assert(inode->file.file_size == size);
+    assert(TFS_Inode_File_GetExtentCnt(&inode->file) == 1);
+
+    int64_t offset = 0;
+    int read;
+    while ((read = TFS_Driver_FileRead(driver, file, offset, TFS_STREAM_CHUNK, buf)) > 0) {
+        assert(memcmp(buf, content + offset, read) == 0);
+        offset += read;
+    }
+    assert(read == 0 && offset == size);
+
+    TFS_Driver_CloseFile(driver, file);
+    free(inode);
+    free(buf);
+    free(content);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestMemBackendGeometry() {
+    TFS_Backend backend;
+    TFS_Driver* driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_MEM, "tupofs_test.bin", true) == TFS_ESUCC);
+    assert(TFS_Driver_Create(driver, &backend, 0, 100, 0) == TFS_EINVAL);
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_MEM, "tupofs_test.bin", true) == TFS_ESUCC);
+    assert(TFS_Driver_Create(driver, &backend, 10, 20, TFS_JOURNAL_MIN_BLOCKS - 1) == TFS_EINVAL);
+
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_MEM, "tupofs_test.bin", true) == TFS_ESUCC);
+    assert(TFS_Driver_Create(driver, &backend, 10, 20, TFS_JOURNAL_MIN_BLOCKS) == TFS_ESUCC);
+    assert(driver->super_block.inode_map_size == 10 && driver->super_block.data_map_size == 20);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/dir", TFS_INODE_DIR) == 2);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/dir/foo", TFS_INODE_FILE) == 3);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/dir/foo", "in memory", 9) == 9);
+    // 80 inodes, the last one is the 80th
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_GetInode(driver, 80, inode);
+    assert(inode->type == TFS_INODE_FREE);
+    TFS_Test_Finish(driver);
+
+    // nothing but the image file is left behind
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", false) == TFS_ESUCC);
+    driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_ESUCC);
+    char buf[16];
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/dir/foo", buf) == 9);
+    assert(memcmp(buf, "in memory", 9) == 0);
+    assert(lseek(driver->backend.fd, 0, SEEK_END) == (3 + TFS_JOURNAL_MIN_BLOCKS + 10 + 8 * 20) * TFS_SECTOR_SIZE);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestLargeGeometry() {
+    TFS_Backend backend;
+    TFS_Driver* driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", true) == TFS_ESUCC);
+    assert(TFS_Driver_Create(driver, &backend, 16, TFS_MAX_MAP_SIZE + 1, 0) == TFS_EINVAL);
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", true) == TFS_ESUCC);
+    assert(TFS_Driver_Create(driver, &backend, 0, 16, 0) == TFS_EINVAL);
+
+    // data map of 4 blocks, the last one partial, no journal; image is sparse
+    const int data_map_size = 3 * TFS_SECTOR_SIZE + 100;
+    const int data_blocks = 8 * data_map_size;
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", true) == TFS_ESUCC);
+    assert(TFS_Driver_Create(driver, &backend, 16, data_map_size, 0) == TFS_ESUCC);
+    TFS_SuperBlock* sb = &driver->super_block;
+    assert(sb->inode_map_start == 1 && sb->data_map_start == 2 && sb->inode_start == 6);
+    assert(sb->data_start == 6 + 16 && sb->block_cnt == sb->data_start + data_blocks);
+    assert(TFS_Driver_GetFreeInodeCnt(driver) == 127);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == data_blocks);
+
+    // one extent across two bitmap block boundaries
+    TFS_Extent extents[2];
+    assert(TFS_Driver_AllocExtents(driver, 2 * TFS_MAP_BLOCK_BITS + 10, extents, 2) == 1);
+    assert(extents[0].start == 1);
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/far", TFS_INODE_FILE) == 2);
+    // a whole block, so it is not inline
+    char* far = calloc(1, TFS_SECTOR_SIZE);
+    memcpy(far, "far away", 8);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/far", far, TFS_SECTOR_SIZE) == TFS_SECTOR_SIZE);
+    free(far);
+    TFS_Driver_FreeExtents(driver, extents, 1);
+    int free_cnt = data_blocks - 1;
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_cnt);
+
+    // everything but the tail of the last bitmap block is taken; allocation skips full blocks
+    int rest = free_cnt - 5;
+    TFS_Extent* many = malloc(sizeof(TFS_Extent) * 4);
+    int cnt = TFS_Driver_AllocExtents(driver, rest, many, 4);
+    assert(cnt == 2);
+    assert(TFS_Driver_AllocExtents(driver, 5, extents, 2) == 1);
+    assert(extents[0].start + extents[0].len - 1 == data_blocks);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == 0);
+    assert(TFS_Driver_AllocExtents(driver, 1, extents, 2) == TFS_ENOSPACE);
+    TFS_Driver_FreeExtents(driver, extents, 1);
+    TFS_Driver_FreeExtents(driver, many, cnt);
+    free(many);
+    TFS_Test_Finish(driver);
+
+    // summaries are rebuilt from the bitmaps on disk
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, "tupofs_test.bin", false) == TFS_ESUCC);
+    driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_ESUCC);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_cnt);
+    assert(TFS_Driver_GetFreeInodeCnt(driver) == 126);
+    char buf[16];
+    assert(TFS_Driver_ReadFileRangeByRawPath(driver, "/far", 0, 8, buf) == 8);
+    assert(memcmp(buf, "far away", 8) == 0);
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/far", inode) > 0);
+    int run;
+    int data_idx = TFS_Driver_MapFileBlock(driver, inode, 0, &run);
+    assert(data_idx == 2 * TFS_MAP_BLOCK_BITS + 11);
+    // its' bit is in the third bitmap block
+    char* map_block = malloc(TFS_SECTOR_SIZE);
+    TFS_Driver_ReadBlock(driver, driver->super_block.data_map_start + 2, map_block);
+    assert(TFS_Bitmap_GetBit(map_block, TFS_SECTOR_SIZE, data_idx - 1 - 2 * TFS_MAP_BLOCK_BITS));
+    assert(lseek(driver->backend.fd, 0, SEEK_END) == (off_t)driver->super_block.block_cnt * TFS_SECTOR_SIZE);
+    free(map_block);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+// image as it would be left by a crash right now: whatever reached the file
+static void TFS_Test_CopyImage(const char* to) {
+    FILE* src = fopen("tupofs_test.bin", "rb");
+    FILE* dst = fopen(to, "wb");
+    assert(src != NULL && dst != NULL);
+    char* buf = malloc(TFS_STREAM_CHUNK);
+    size_t read;
+    while ((read = fread(buf, 1, TFS_STREAM_CHUNK, src)) > 0) {
+        assert(fwrite(buf, 1, read, dst) == read);
+    }
+    free(buf);
+    fclose(src);
+    fclose(dst);
+}
+
+static TFS_Driver* TFS_Test_OpenImage(const char* path) {
+    TFS_Backend backend;
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_FD, path, false) == TFS_ESUCC);
+    TFS_Driver* driver = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(driver, &backend, false) == TFS_ESUCC);
+    return driver;
+}
+
+void TFS_TestInlineData() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    const int size = 3 * TFS_SECTOR_SIZE;
+    char* content = malloc(size);
+    char* buf = malloc(size);
+    for (int i = 0; i < size; ++i) {
+        content[i] = 'a' + i % 26;
+    }
+    int free_data = TFS_Driver_GetFreeDataCnt(driver);
+
+    // small file takes no data blocks
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/small", TFS_INODE_FILE) > 0);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/small", content, 30) == 30);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/small", inode) > 0);
+    assert(TFS_Inode_File_IsInline(&inode->file) && inode->file.extent_cnt == 0);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data);
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/small", buf) == 30);
+    assert(memcmp(buf, content, 30) == 0);
+
+    // a gap inside the inode reads as zeroes
+    assert(TFS_Driver_WriteFileRangeByRawPath(driver, "/small", 100, 10, content) == 10);
+    assert(TFS_Driver_ReadFileRangeByRawPath(driver, "/small", 28, 100, buf) == 82);
+    assert(buf[0] == content[28] && buf[2] == 0 && buf[71] == 0 && memcmp(buf + 72, content, 10) == 0);
+
+    // open file serves reads from its' copy, mapping points into the inode block
+    TFS_File* file;
+    assert(TFS_Driver_OpenFile(driver, "/small", &file) > 0);
+    assert(file->data != NULL && file->extent_cnt == 0);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == 110);
+    assert(memcmp(buf, content, 30) == 0);
+    TFS_ImageRun runs[4];
+    assert(TFS_Driver_FileMapRange(driver, file, 10, size, runs, 4) == 1);
+    assert(runs[0].size == 100);
+    assert(runs[0].offset / TFS_SECTOR_SIZE == TFS_Driver_GetInodeBlockIdx(driver, file->inode_idx));
+    assert(pread(driver->backend.fd, buf, 20, runs[0].offset) == 20);
+    assert(memcmp(buf, content + 10, 20) == 0);
+
+    // growing past the inode moves data into blocks
+    assert(TFS_Driver_FileWrite(driver, file, 110, size - 110, content + 110) == size - 110);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/small", inode) > 0);
+    assert(!TFS_Inode_File_IsInline(&inode->file) && inode->file.extent_cnt == 1);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data - 3);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == size);
+    assert(file->data == NULL);
+    assert(memcmp(buf, content, 30) == 0 && buf[50] == 0 && memcmp(buf + 100, content, 10) == 0);
+    assert(memcmp(buf + 110, content + 110, size - 110) == 0);
+
+    // and shrinking moves it back
+    assert(TFS_Driver_FileTruncate(driver, file, 20) == TFS_ESUCC);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/small", inode) > 0);
+    assert(TFS_Inode_File_IsInline(&inode->file));
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == 20);
+    assert(memcmp(buf, content, 20) == 0);
+    assert(TFS_Driver_FileTruncate(driver, file, 40) == TFS_ESUCC);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == 40);
+    assert(buf[20] == 0 && buf[39] == 0);
+    TFS_Driver_CloseFile(driver, file);
+
+    // replacing contents picks the format by size
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/small", content, TFS_INODE_INLINE_SIZE + 1) == TFS_INODE_INLINE_SIZE + 1);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data - 1);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/small", content, TFS_INODE_INLINE_SIZE) == TFS_INODE_INLINE_SIZE);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data);
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/small", buf) == TFS_INODE_INLINE_SIZE);
+    assert(memcmp(buf, content, TFS_INODE_INLINE_SIZE) == 0);
+    assert(TFS_Driver_DeleteByRawPath(driver, "/small") > 0);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data);
+
+    free(buf);
+    free(content);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+// counts blocks written to the image, on top of the fd backend
+static long TFS_Test_BlocksWritten;
+static long TFS_Test_WriteCalls;
+
+static void TFS_Test_CountingWriteBlock(TFS_Backend* self, int block_idx, const void* buf) {
+    ++TFS_Test_BlocksWritten;
+    ++TFS_Test_WriteCalls;
+    TFS_BACKEND_FD.write_block(self, block_idx, buf);
+}
+
+static void TFS_Test_CountingWriteBlocks(TFS_Backend* self, int block_idx, int cnt, const void* buf) {
+    TFS_Test_BlocksWritten += cnt;
+    ++TFS_Test_WriteCalls;
+    TFS_BACKEND_FD.write_blocks(self, block_idx, cnt, buf);
+}
+
+void TFS_TestOpBatching() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Driver_SetCacheSize(driver, 0); // every write goes to the image
+    TFS_BackendOps ops = TFS_BACKEND_FD;
+    ops.write_block = TFS_Test_CountingWriteBlock;
+    ops.write_blocks = TFS_Test_CountingWriteBlocks;
+    driver->backend.ops = &ops;
+
+    // child inode and root share an inode block, it is written once
+    TFS_Test_BlocksWritten = TFS_Test_WriteCalls = 0;
+    int file_idx = TFS_Driver_CreateIdxByRawPath(driver, "/file", TFS_INODE_FILE);
+    assert(file_idx == TFS_ROOT_INODE_IDX + 1);
+    assert(TFS_Test_BlocksWritten == 1 && TFS_Test_WriteCalls == 1);
+
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/file", "batched", 7) == 7);
+    char buf[8];
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/file", buf) == 7);
+    assert(memcmp(buf, "batched", 7) == 0);
+
+    // freed inode is written once, not twice; root goes separately, after the file's lock is released
+    TFS_Test_BlocksWritten = 0;
+    assert(TFS_Driver_DeleteByRawPath(driver, "/file") == file_idx);
+    assert(TFS_Test_BlocksWritten == 2);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/file") == TFS_ENOENT);
+
+    // rewrites of a block within an operation end up as one write (the dir is converted to hashed here)
+    char name[32];
+    for (int i = 0; i < TFS_MAX_DIR_INODE_CHILDREN; ++i) {
+        sprintf(name, "/f%d", i);
+        assert(TFS_Driver_CreateIdxByRawPath(driver, name, TFS_INODE_FILE) > 0);
+    }
+    TFS_Test_BlocksWritten = 0;
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/last", TFS_INODE_FILE) > 0);
+    assert(TFS_Test_BlocksWritten == 4); // child (next inode block), root, bucket table, bucket
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/f0") > 0);
+    assert(TFS_Driver_GetInodeIdxByRawPath(driver, "/last") > 0);
+
+    driver->backend.ops = &TFS_BACKEND_FD;
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestJournal() {
+    TFS_Driver* driver = TFS_Test_Init();
+    assert(driver->journaling);
+    TFS_Driver_Commit(driver);
+    int head = driver->journal.head;
+
+    // operations are group committed: one transaction for all of them
+    long commits = driver->journal.commits;
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/dir", TFS_INODE_DIR) == 2);
+    for (int i = 0; i < 20; ++i) {
+        char path[32];
+        sprintf(path, "/dir/file_%d", i);
+        assert(TFS_Driver_CreateIdxByRawPath(driver, path, TFS_INODE_FILE) > 0);
+    }
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/dir/file_0", "journaled", 9) == 9);
+    TFS_Driver_Commit(driver);
+    assert(driver->journal.commits - commits < 5); // background commits may split it
+    assert(driver->journal.head > head);
+
+    // crash: blocks are in the log only, their places are untouched
+    TFS_Test_CopyImage("tupofs_crash.bin");
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode) * TFS_INODES_PER_BLOCK);
+    int dir_block = TFS_Driver_GetInodeBlockIdx(driver, 2);
+    FILE* crashed = fopen("tupofs_crash.bin", "rb");
+    assert(fseek(crashed, (long)dir_block * TFS_SECTOR_SIZE, SEEK_SET) == 0);
+    assert(fread(inode, TFS_SECTOR_SIZE, 1, crashed) == 1);
+    fclose(crashed);
+    // root shares the block with it
+    assert(inode[1].inode_idx == 2 && inode[1].type == TFS_INODE_FREE);
+
+    // torn log: nothing from the broken transaction on is replayed
+    rename("tupofs_crash.bin", "tupofs_torn.bin");
+    TFS_Test_CopyImage("tupofs_crash.bin");
+    FILE* torn = fopen("tupofs_torn.bin", "r+b");
+    assert(fseek(torn, ((long)driver->super_block.journal_start + head + 1) * TFS_SECTOR_SIZE + 7, SEEK_SET) == 0);
+    fputc('#', torn);
+    fclose(torn);
+    TFS_Driver* replayed = TFS_Test_OpenImage("tupofs_torn.bin");
+    assert(replayed->journal.replayed >= 1); // root
+    assert(TFS_Driver_GetInodeIdxByRawPath(replayed, "/dir") == TFS_ENOENT);
+    TFS_Test_Finish(replayed);
+
+    replayed = TFS_Test_OpenImage("tupofs_crash.bin");
+    assert(replayed->journal.replayed >= 2);
+    char buf[16];
+    assert(TFS_Driver_ReadFileByRawPath(replayed, "/dir/file_0", buf) == 9);
+    assert(memcmp(buf, "journaled", 9) == 0);
+    assert(TFS_Driver_GetInodeIdxByRawPath(replayed, "/dir/file_19") > 0);
+    assert(TFS_Driver_GetFreeInodeCnt(replayed) == TFS_Driver_GetFreeInodeCnt(driver));
+    TFS_Test_Finish(replayed);
+    // replay is done once
+    replayed = TFS_Test_OpenImage("tupofs_crash.bin");
+    assert(replayed->journal.replayed == 0);
+    TFS_Test_Finish(replayed);
+
+    // logged copy of a block written in place later is revoked, not replayed over it
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/revoked", TFS_INODE_FILE) > 0);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/revoked", "old", 3) == 3);
+    TFS_Driver_Commit(driver);
+    char* content = malloc(3 * TFS_SECTOR_SIZE);
+    memset(content, 'n', 3 * TFS_SECTOR_SIZE);
+    assert(TFS_Driver_WriteFileRangeByRawPath(driver, "/revoked", 0, 3 * TFS_SECTOR_SIZE, content) == 3 * TFS_SECTOR_SIZE);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/revoked", inode) > 0);
+    assert(inode->file.extent_cnt == 1); // so it is one in-place write
+    TFS_Driver_Commit(driver);
+    TFS_Test_CopyImage("tupofs_crash.bin");
+    replayed = TFS_Test_OpenImage("tupofs_crash.bin");
+    assert(TFS_Driver_ReadFileRangeByRawPath(replayed, "/revoked", 0, 4, buf) == 4);
+    assert(memcmp(buf, "nnnn", 4) == 0);
+    TFS_Test_Finish(replayed);
+
+    // sync checkpoints: log is empty, everything is in place
+    TFS_Driver_Sync(driver);
+    assert(driver->journal.head == 1);
+    TFS_Test_CopyImage("tupofs_crash.bin");
+    replayed = TFS_Test_OpenImage("tupofs_crash.bin");
+    assert(replayed->journal.replayed == 0);
+    assert(TFS_Driver_ReadFileByRawPath(replayed, "/dir/file_0", buf) == 9);
+    TFS_Test_Finish(replayed);
+
+    unlink("tupofs_crash.bin");
+    unlink("tupofs_torn.bin");
+    free(content);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
+void TFS_TestLz() {
+    const int size = 100000;
+    char* text = malloc(size);
+    char* packed = malloc(TFS_LZ_BOUND(size));
+    char* unpacked = malloc(size);
+    for (int pos = 0, line = 0; pos < size; ++line) {
+        char buf[64];
+        int len = sprintf(buf, "line %d: the quick brown fox\n", line * 7 % 1000);
+        memcpy(text + pos, buf, len < size - pos ? len : size - pos);
+        pos += len;
+    }
+    int packed_size = TFS_Lz_Compress(text, size, packed, TFS_LZ_BOUND(size));
+    assert(packed_size > 0 && packed_size < size / 3);
+    assert(TFS_Lz_Decompress(packed, packed_size, unpacked, size) == size);
+    assert(memcmp(unpacked, text, size) == 0);
+    // output that doesn't fit is an error both ways
+    assert(TFS_Lz_Compress(text, size, packed, packed_size - 1) == 0);
+    assert(TFS_Lz_Decompress(packed, packed_size, unpacked, size - 1) == -1);
+
+    // long runs need length extensions, noise doesn't shrink but stays within bound
+    memset(text, 'z', size);
+    packed_size = TFS_Lz_Compress(text, size, packed, TFS_LZ_BOUND(size));
+    assert(packed_size > 0 && packed_size < 1000);
+    assert(TFS_Lz_Decompress(packed, packed_size, unpacked, size) == size && memcmp(unpacked, text, size) == 0);
+    uint32_t seed = 1;
+    for (int i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = seed >> 16;
+    }
+    packed_size = TFS_Lz_Compress(text, size, packed, TFS_LZ_BOUND(size));
+    assert(packed_size >= size && packed_size <= TFS_LZ_BOUND(size));
+    assert(TFS_Lz_Decompress(packed, packed_size, unpacked, size) == size && memcmp(unpacked, text, size) == 0);
+
+    // inputs too short for a match are literals only
+    for (int len = 0; len <= 13; ++len) {
+        packed_size = TFS_Lz_Compress("aaaaaaaaaaaaa", len, packed, TFS_LZ_BOUND(len));
+        assert(packed_size == len + 1);
+        assert(TFS_Lz_Decompress(packed, packed_size, unpacked, size) == len);
+    }
+    assert(TFS_Lz_Compress("aaaaaaaaaaaaaaaaaaaa", 20, packed, 64) < 20);
+
+    // match before the start of output
+    const char bad_offset[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+    assert(TFS_Lz_Decompress(bad_offset, sizeof(bad_offset), unpacked, size) == -1);
+    // literals past the end of input
+    const char bad_literals[] = { 0x50, 'a', 'b' };
+    assert(TFS_Lz_Decompress(bad_literals, sizeof(bad_literals), unpacked, size) == -1);
+
+    free(unpacked);
+    free(packed);
+    free(text);
+}
+
+void TFS_TestCompression() {
+    TFS_Driver* driver = TFS_Test_Init();
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    const int frame_bytes = TFS_COMPRESS_FRAME_BLOCKS * TFS_SECTOR_SIZE;
+    // 5 frames and a bit, the third one is noise
+    const int size = 5 * frame_bytes + 1000;
+    const int blocks = (size + TFS_SECTOR_SIZE - 1) / TFS_SECTOR_SIZE;
+    char* content = malloc(size);
+    char* buf = malloc(size);
+    for (int pos = 0, line = 0; pos < size; ++line) {
+        char text[64];
+        int len = sprintf(text, "#include \"file_%d.h\"\n", line % 300);
+        memcpy(content + pos, text, len < size - pos ? len : size - pos);
+        pos += len;
+    }
+    uint32_t seed = 1;
+    for (int i = 2 * frame_bytes; i < 3 * frame_bytes; ++i) {
+        seed = seed * 1103515245 + 12345;
+        content[i] = seed >> 16;
+    }
+    int free_data = TFS_Driver_GetFreeDataCnt(driver);
+
+    // off by default
+    assert(TFS_Driver_CreateIdxByRawPath(driver, "/src", TFS_INODE_FILE) > 0);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/src", content, size) == size);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data - blocks);
+
+    TFS_Driver_SetCompression(driver, true);
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/src", content, size) == size);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/src", inode) > 0);
+    assert(inode->flags & TFS_INODE_COMPRESSED);
+    assert(inode->file.file_size == size && TFS_Inode_File_GetBlockCnt(&inode->file) == blocks);
+    // noise and the single block tail stay as is, text takes a fraction of its' blocks
+    int used = free_data - TFS_Driver_GetFreeDataCnt(driver);
+    assert(used < TFS_COMPRESS_FRAME_BLOCKS + 1 + blocks / 8);
+    TFS_FileExtent* extents;
+    int cnt = TFS_Driver_LoadFileMap(driver, inode, &extents);
+    assert(cnt == 5 || cnt == 6);
+    assert(extents[0].clen > 0 && extents[0].len == (extents[0].clen + TFS_SECTOR_SIZE - 1) / TFS_SECTOR_SIZE);
+    assert(extents[1].logical == TFS_COMPRESS_FRAME_BLOCKS && extents[1].clen > 0);
+    assert(extents[2].logical == 2 * TFS_COMPRESS_FRAME_BLOCKS && extents[2].clen == 0);
+    assert(extents[cnt - 1].logical == blocks - 1 && extents[cnt - 1].clen == 0);
+    free(extents);
+
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/src", buf) == size);
+    assert(memcmp(buf, content, size) == 0);
+    // ranges across frames, plain and compressed ones
+    int64_t offsets[] = { frame_bytes - 100, 2 * frame_bytes - 10, 3 * frame_bytes - 5000, size - 1500 };
+    for (int i = 0; i < 4; ++i) {
+        int expected = size - offsets[i] < 3000 ? size - offsets[i] : 3000;
+        memset(buf, 0, size);
+        assert(TFS_Driver_ReadFileRangeByRawPath(driver, "/src", offsets[i], 3000, buf) == expected);
+        assert(memcmp(buf, content + offsets[i], expected) == 0);
+    }
+
+    // open file reads from its' map, but there is nothing to map
+    TFS_File* file;
+    assert(TFS_Driver_OpenFile(driver, "/src", &file) > 0);
+    assert(file->compressed);
+    assert(TFS_Driver_FileRead(driver, file, 1000, size, buf) == size - 1000);
+    assert(memcmp(buf, content + 1000, size - 1000) == 0);
+    TFS_ImageRun runs[4];
+    assert(TFS_Driver_FileMapRange(driver, file, 0, size, runs, 4) == TFS_EINVAL);
+
+    // survives reopening, mapped image is read in place
+    TFS_Driver_Sync(driver);
+    TFS_Test_CopyImage("tupofs_copy.bin");
+    TFS_Backend backend;
+    assert(TFS_Backend_Open(&backend, &TFS_BACKEND_MMAP, "tupofs_copy.bin", false) == TFS_ESUCC);
+    TFS_Driver* reopened = malloc(sizeof(TFS_Driver));
+    assert(TFS_Driver_Init(reopened, &backend, false) == TFS_ESUCC);
+    memset(buf, 0, size);
+    assert(TFS_Driver_ReadFileByRawPath(reopened, "/src", buf) == size);
+    assert(memcmp(buf, content, size) == 0);
+    TFS_Test_Finish(reopened);
+    unlink("tupofs_copy.bin");
+
+    // writing in place turns it into plain blocks
+    assert(TFS_Driver_FileWrite(driver, file, 10, 5, "XXXXX") == 5);
+    memcpy(content + 10, "XXXXX", 5);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/src", inode) > 0);
+    assert(!(inode->flags & TFS_INODE_COMPRESSED));
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data - blocks);
+    assert(TFS_Driver_FileRead(driver, file, 0, size, buf) == size);
+    assert(!file->compressed && memcmp(buf, content, size) == 0);
+    assert(TFS_Driver_FileMapRange(driver, file, 0, size, runs, 4) > 0);
+    TFS_Driver_CloseFile(driver, file);
+
+    // and so does truncating
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/src", content, size) == size);
+    assert(TFS_Driver_TruncateByRawPath(driver, "/src", frame_bytes + 5) == TFS_ESUCC);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/src", inode) > 0);
+    assert(!(inode->flags & TFS_INODE_COMPRESSED));
+    assert(TFS_Driver_ReadFileByRawPath(driver, "/src", buf) == frame_bytes + 5);
+    assert(memcmp(buf, content, frame_bytes + 5) == 0);
+
+    // noise alone is not compressed at all
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/src", content + 2 * frame_bytes, frame_bytes) == frame_bytes);
+    assert(TFS_Driver_GetInodeByRawPath(driver, "/src", inode) > 0);
+    assert(!(inode->flags & TFS_INODE_COMPRESSED) && inode->file.extent_cnt == 1);
+
+    assert(TFS_Driver_WriteFileByRawPath(driver, "/src", content, size) == size);
+    assert(TFS_Driver_DeleteByRawPath(driver, "/src") > 0);
+    assert(TFS_Driver_GetFreeDataCnt(driver) == free_data);
+
+    free(buf);
+    free(content);
+    free(inode);
+    TFS_Test_Finish(driver);
+}
+
 int main() {
     TFS_TestBitmap();
     TFS_TestDataNodesManagement();
     TFS_TestMultiblock();
+    TFS_TestExtentAllocator();
+    TFS_TestLargeFile();
+    TFS_TestExtentLeaves();
+    TFS_TestFormatVersion();
     TFS_TestUnevenFileSize();
+    TFS_TestReadFileRange();
+    TFS_TestBlockCache();
+    TFS_TestMmapBackend();
     TFS_TestPath();
     TFS_TestCreateChildInode();
     TFS_TestPathWalk();
     TFS_TestCreateByPath();
     TFS_TestBasicFileOps();
+    TFS_TestHashedDir();
+    TFS_TestDentryCache();
+    TFS_TestConcurrency();
+    TFS_TestWriteFileRange();
+    TFS_TestMvAcrossDirs();
+    TFS_TestOpenFile();
+    TFS_TestIdxOps();
+    TFS_TestFileMapRange();
+    TFS_TestReadDirAttrs();
+    TFS_TestFileAppend();
+    TFS_TestMemBackendGeometry();
+    TFS_TestLargeGeometry();
+    TFS_TestJournal();
+    TFS_TestOpBatching();
+    TFS_TestInlineData();
+    TFS_TestLz();
+    TFS_TestCompression();
     // TODO: error handling
     // create child for non-dir
 
@@ -0,0 +1,217 @@
+#include "tfs_backend.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+
+#include "tupofs.h"
+#include "tfs_errs.h"
+
+int TFS_Backend_Open(TFS_Backend* self, const TFS_BackendOps* ops, const char* path, bool create) {
+    self->ops = ops;
+    self->fd = -1;
+    self->map = NULL;
+    self->map_size = 0;
+    return ops->open(self, path, create);
+}
+
+static int TFS_FdBackend_Open(TFS_Backend* self, const char* path, bool create) {
+    int flags = create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+    self->fd = open(path, flags, 0644);
+    return self->fd != -1 ? TFS_ESUCC : TFS_ENOENT;
+}
+
+static void TFS_FdBackend_ReadBlocks(TFS_Backend* self, int block_idx, int cnt, void* buf) {
+    off_t offset = (off_t)block_idx * TFS_SECTOR_SIZE;
+    size_t size = (size_t)cnt * TFS_SECTOR_SIZE;
+    // pread may return less than asked for large requests
+    for (size_t done = 0; done < size;) {
+        ssize_t read = pread(self->fd, (char*)buf + done, size - done, offset + done);
+        assert(read > 0);
+        done += read;
+    }
+}
+
+static void TFS_FdBackend_WriteBlocks(TFS_Backend* self, int block_idx, int cnt, const void* buf) {
+    off_t offset = (off_t)block_idx * TFS_SECTOR_SIZE;
+    size_t size = (size_t)cnt * TFS_SECTOR_SIZE;
+    for (size_t done = 0; done < size;) {
+        ssize_t written = pwrite(self->fd, (const char*)buf + done, size - done, offset + done);
+        assert(written > 0);
+        done += written;
+    }
+}
+
+static void TFS_FdBackend_ReadBlock(TFS_Backend* self, int block_idx, void* buf) {
+    TFS_FdBackend_ReadBlocks(self, block_idx, 1, buf);
+}
+
+static void TFS_FdBackend_WriteBlock(TFS_Backend* self, int block_idx, const void* buf) {
+    TFS_FdBackend_WriteBlocks(self, block_idx, 1, buf);
+}
+
+static void TFS_FdBackend_Sync(TFS_Backend* self) {
+    fdatasync(self->fd);
+}
+
+static void TFS_FdBackend_Close(TFS_Backend* self) {
+    close(self->fd);
+    self->fd = -1;
+}
+
+static void TFS_FdBackend_Resize(TFS_Backend* self, int block_cnt) {
+    int truncated = ftruncate(self->fd, (off_t)block_cnt * TFS_SECTOR_SIZE);
+    assert(truncated == 0);
+    (void)truncated;
+}
+
+const TFS_BackendOps TFS_BACKEND_FD = {
+    .open = TFS_FdBackend_Open,
+    .read_block = TFS_FdBackend_ReadBlock,
+    .write_block = TFS_FdBackend_WriteBlock,
+    .read_blocks = TFS_FdBackend_ReadBlocks,
+    .write_blocks = TFS_FdBackend_WriteBlocks,
+    .sync = TFS_FdBackend_Sync,
+    .close = TFS_FdBackend_Close,
+    .resize = TFS_FdBackend_Resize,
+    .map_block = NULL,
+};
+
+static void TFS_MmapBackend_Map(TFS_Backend* self, size_t size) {
+    if (self->map != NULL) {
+        munmap(self->map, self->map_size);
+        self->map = NULL;
+    }
+    self->map_size = size;
+    if (size == 0) {
+        return;
+    }
+    self->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    assert(self->map != MAP_FAILED);
+}
+
+static int TFS_MmapBackend_Open(TFS_Backend* self, const char* path, bool create) {
+    int code = TFS_FdBackend_Open(self, path, create);
+    if (code <= 0) {
+        return code;
+    }
+    struct stat st;
+    fstat(self->fd, &st);
+    TFS_MmapBackend_Map(self, st.st_size);
+    return TFS_ESUCC;
+}
+
+static void* TFS_MmapBackend_MapBlock(TFS_Backend* self, int block_idx) {
+    size_t offset = (size_t)block_idx * TFS_SECTOR_SIZE;
+    assert(offset + TFS_SECTOR_SIZE <= self->map_size);
+    return self->map + offset;
+}
+
+static void TFS_MmapBackend_ReadBlocks(TFS_Backend* self, int block_idx, int cnt, void* buf) {
+    assert((size_t)(block_idx + cnt) * TFS_SECTOR_SIZE <= self->map_size);
+    memcpy(buf, TFS_MmapBackend_MapBlock(self, block_idx), (size_t)cnt * TFS_SECTOR_SIZE);
+}
+
+static void TFS_MmapBackend_WriteBlocks(TFS_Backend* self, int block_idx, int cnt, const void* buf) {
+    assert((size_t)(block_idx + cnt) * TFS_SECTOR_SIZE <= self->map_size);
+    memcpy(TFS_MmapBackend_MapBlock(self, block_idx), buf, (size_t)cnt * TFS_SECTOR_SIZE);
+}
+
+static void TFS_MmapBackend_ReadBlock(TFS_Backend* self, int block_idx, void* buf) {
+    TFS_MmapBackend_ReadBlocks(self, block_idx, 1, buf);
+}
+
+static void TFS_MmapBackend_WriteBlock(TFS_Backend* self, int block_idx, const void* buf) {
+    TFS_MmapBackend_WriteBlocks(self, block_idx, 1, buf);
+}
+
+static void TFS_MmapBackend_Sync(TFS_Backend* self) {
+    if (self->map != NULL) {
+        msync(self->map, self->map_size, MS_SYNC);
+    }
+}
+
+static void TFS_MmapBackend_Close(TFS_Backend* self) {
+    TFS_MmapBackend_Map(self, 0);
+    TFS_FdBackend_Close(self);
+}
+
+static void TFS_MmapBackend_Resize(TFS_Backend* self, int block_cnt) {
+    TFS_FdBackend_Resize(self, block_cnt);
+    TFS_MmapBackend_Map(self, (size_t)block_cnt * TFS_SECTOR_SIZE);
+}
+
+const TFS_BackendOps TFS_BACKEND_MMAP = {
+    .open = TFS_MmapBackend_Open,
+    .read_block = TFS_MmapBackend_ReadBlock,
+    .write_block = TFS_MmapBackend_WriteBlock,
+    .read_blocks = TFS_MmapBackend_ReadBlocks,
+    .write_blocks = TFS_MmapBackend_WriteBlocks,
+    .sync = TFS_MmapBackend_Sync,
+    .close = TFS_MmapBackend_Close,
+    .resize = TFS_MmapBackend_Resize,
+    .map_block = TFS_MmapBackend_MapBlock,
+};
+
+// whole image in malloc'd memory (map/map_size), the file is only touched on open and sync
+
+static int TFS_MemBackend_Open(TFS_Backend* self, const char* path, bool create) {
+    int code = TFS_FdBackend_Open(self, path, create);
+    if (code <= 0) {
+        return code;
+    }
+    struct stat st;
+    fstat(self->fd, &st);
+    self->map_size = st.st_size;
+    self->map = malloc(self->map_size + 1);
+    for (size_t done = 0; done < self->map_size;) {
+        ssize_t read = pread(self->fd, self->map + done, self->map_size - done, done);
+        assert(read > 0);
+        done += read;
+    }
+    return TFS_ESUCC;
+}
+
+// one sequential pass over the whole image
+static void TFS_MemBackend_Sync(TFS_Backend* self) {
+    for (size_t done = 0; done < self->map_size;) {
+        ssize_t written = pwrite(self->fd, self->map + done, self->map_size - done, done);
+        assert(written > 0);
+        done += written;
+    }
+    fdatasync(self->fd);
+}
+
+static void TFS_MemBackend_Close(TFS_Backend* self) {
+    free(self->map);
+    self->map = NULL;
+    self->map_size = 0;
+    TFS_FdBackend_Close(self);
+}
+
+static void TFS_MemBackend_Resize(TFS_Backend* self, int block_cnt) {
+    size_t size = (size_t)block_cnt * TFS_SECTOR_SIZE;
+    self->map = realloc(self->map, size + 1);
+    if (size > self->map_size) {
+        memset(self->map + self->map_size, 0, size - self->map_size);
+    }
+    self->map_size = size;
+    TFS_FdBackend_Resize(self, block_cnt);
+}
+
+const TFS_BackendOps TFS_BACKEND_MEM = {
+    .open = TFS_MemBackend_Open,
+    .read_block = TFS_MmapBackend_ReadBlock,
+    .write_block = TFS_MmapBackend_WriteBlock,
+    .read_blocks = TFS_MmapBackend_ReadBlocks,
+    .write_blocks = TFS_MmapBackend_WriteBlocks,
+    .sync = TFS_MemBackend_Sync,
+    .close = TFS_MemBackend_Close,
+    .resize = TFS_MemBackend_Resize,
+    .map_block = TFS_MmapBackend_MapBlock,
+};
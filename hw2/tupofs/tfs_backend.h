@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// storage the driver's block layer runs on top of
+
+typedef struct TFS_Backend TFS_Backend;
+
+typedef struct TFS_BackendOps {
+    // returns TFS_ESUCC or error code, errno is preserved for perror
+    int (*open)(TFS_Backend* self, const char* path, bool create);
+    void (*read_block)(TFS_Backend* self, int block_idx, void* buf);
+    void (*write_block)(TFS_Backend* self, int block_idx, const void* buf);
+    // cnt consecutive blocks in a single I/O
+    void (*read_blocks)(TFS_Backend* self, int block_idx, int cnt, void* buf);
+    void (*write_blocks)(TFS_Backend* self, int block_idx, int cnt, const void* buf);
+    void (*sync)(TFS_Backend* self);
+    void (*close)(TFS_Backend* self);
+    // sets image size in blocks, new space reads as zeroes
+    void (*resize)(TFS_Backend* self, int block_cnt);
+    // pointer to the block inside backend's memory, NULL if backend is not memory-mapped
+    void* (*map_block)(TFS_Backend* self, int block_idx);
+} TFS_BackendOps;
+
+struct TFS_Backend {
+    const TFS_BackendOps* ops;
+    int fd;
+
+    // used by TFS_BACKEND_MMAP only
+    char* map;
+    size_t map_size;
+};
+
+// raw file descriptor with positioned pread/pwrite, no stdio buffering
+extern const TFS_BackendOps TFS_BACKEND_FD;
+
+// whole image mapped with mmap, durability through msync
+extern const TFS_BackendOps TFS_BACKEND_MMAP;
+
+// whole image in memory, written back to the file in one sequential pass by sync;
+// for building images offline (fd is stale until then, nothing else may use the file)
+extern const TFS_BackendOps TFS_BACKEND_MEM;
+
+int TFS_Backend_Open(TFS_Backend* self, const TFS_BackendOps* ops, const char* path, bool create);
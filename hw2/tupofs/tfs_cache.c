@@ -0,0 +1,185 @@
+#include "tfs_cache.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "tupofs.h"
+
+static void TFS_BlockCache_LruUnlink(TFS_CacheEntry* entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void TFS_BlockCache_LruPushFront(TFS_BlockCache* self, TFS_CacheEntry* entry) {
+    entry->lru_prev = &self->lru;
+    entry->lru_next = self->lru.lru_next;
+    self->lru.lru_next->lru_prev = entry;
+    self->lru.lru_next = entry;
+}
+
+static TFS_CacheEntry** TFS_BlockCache_Bucket(TFS_BlockCache* self, int block_idx) {
+    unsigned hash = (unsigned)block_idx * 2654435761u;
+    return &self->buckets[hash & (self->bucket_cnt - 1)];
+}
+
+static void TFS_BlockCache_HashRemove(TFS_BlockCache* self, TFS_CacheEntry* entry) {
+    TFS_CacheEntry** link = TFS_BlockCache_Bucket(self, entry->block_idx);
+    while (*link != entry) {
+        assert(*link != NULL);
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+}
+
+void TFS_BlockCache_Init(TFS_BlockCache* self, int capacity, TFS_BlockCache_WriteBackFn write_back, void* ctx) {
+    assert(capacity >= 0);
+    self->capacity = capacity;
+    self->size = 0;
+    self->held_cnt = 0;
+    self->write_back = write_back;
+    self->ctx = ctx;
+    self->hits = self->misses = self->write_backs = 0;
+    self->lru.lru_prev = self->lru.lru_next = &self->lru;
+
+    self->bucket_cnt = 1;
+    while (self->bucket_cnt < 2 * capacity) {
+        self->bucket_cnt *= 2;
+    }
+    self->buckets = calloc(self->bucket_cnt, sizeof(TFS_CacheEntry*));
+}
+
+void TFS_BlockCache_Destruct(TFS_BlockCache* self) {
+    TFS_CacheEntry* entry = self->lru.lru_next;
+    while (entry != &self->lru) {
+        TFS_CacheEntry* next = entry->lru_next;
+        free(entry->data);
+        free(entry);
+        entry = next;
+    }
+    free(self->buckets);
+}
+
+void TFS_BlockCache_SetHeld(TFS_BlockCache* self, TFS_CacheEntry* entry, bool held) {
+    self->held_cnt += held - entry->held;
+    entry->held = held;
+}
+
+// unlinks least recently used entry that is not held, writing it back if needed; NULL if all are held
+static TFS_CacheEntry* TFS_BlockCache_Evict(TFS_BlockCache* self) {
+    TFS_CacheEntry* victim = self->lru.lru_prev;
+    while (victim != &self->lru && victim->held) {
+        victim = victim->lru_prev;
+    }
+    if (victim == &self->lru) {
+        return NULL;
+    }
+    if (victim->dirty) {
+        self->write_back(self->ctx, victim->block_idx, victim->data);
+        ++self->write_backs;
+    }
+    TFS_BlockCache_HashRemove(self, victim);
+    TFS_BlockCache_LruUnlink(victim);
+    return victim;
+}
+
+void TFS_BlockCache_Trim(TFS_BlockCache* self) {
+    while (self->size > self->capacity) {
+        TFS_CacheEntry* entry = TFS_BlockCache_Evict(self);
+        if (entry == NULL) {
+            return;
+        }
+        free(entry->data);
+        free(entry);
+        --self->size;
+    }
+}
+
+TFS_CacheEntry* TFS_BlockCache_Peek(TFS_BlockCache* self, int block_idx) {
+    if (self->capacity == 0) {
+        return NULL;
+    }
+    for (TFS_CacheEntry* entry = *TFS_BlockCache_Bucket(self, block_idx); entry != NULL; entry = entry->hash_next) {
+        if (entry->block_idx == block_idx) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+TFS_CacheEntry* TFS_BlockCache_Lookup(TFS_BlockCache* self, int block_idx) {
+    TFS_CacheEntry* entry = TFS_BlockCache_Peek(self, block_idx);
+    if (entry != NULL) {
+        TFS_BlockCache_LruUnlink(entry);
+        TFS_BlockCache_LruPushFront(self, entry);
+    }
+    return entry;
+}
+
+TFS_CacheEntry* TFS_BlockCache_Insert(TFS_BlockCache* self, int block_idx) {
+    assert(self->capacity > 0);
+    TFS_CacheEntry* entry = self->size >= self->capacity ? TFS_BlockCache_Evict(self) : NULL;
+    if (entry == NULL) {
+        entry = malloc(sizeof(TFS_CacheEntry));
+        entry->data = malloc(TFS_SECTOR_SIZE);
+        ++self->size;
+    }
+
+    entry->block_idx = block_idx;
+    entry->dirty = false;
+    entry->held = false;
+    TFS_CacheEntry** bucket = TFS_BlockCache_Bucket(self, block_idx);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+
+    TFS_BlockCache_LruPushFront(self, entry);
+    return entry;
+}
+
+static int TFS_BlockCache_CmpByBlock(const void* a, const void* b) {
+    int lhs = (*(TFS_CacheEntry* const*)a)->block_idx;
+    int rhs = (*(TFS_CacheEntry* const*)b)->block_idx;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+void TFS_BlockCache_GetHeld(TFS_BlockCache* self, TFS_CacheEntry** held) {
+    int held_cnt = 0;
+    for (TFS_CacheEntry* entry = self->lru.lru_next; entry != &self->lru; entry = entry->lru_next) {
+        if (entry->held) {
+            held[held_cnt++] = entry;
+        }
+    }
+    assert(held_cnt == self->held_cnt);
+    qsort(held, held_cnt, sizeof(TFS_CacheEntry*), TFS_BlockCache_CmpByBlock);
+}
+
+void TFS_BlockCache_Flush(TFS_BlockCache* self) {
+    TFS_CacheEntry** dirty = malloc(sizeof(TFS_CacheEntry*) * (self->size + 1));
+    int dirty_cnt = 0;
+    for (TFS_CacheEntry* entry = self->lru.lru_next; entry != &self->lru; entry = entry->lru_next) {
+        if (entry->dirty && !entry->held) {
+            dirty[dirty_cnt++] = entry;
+        }
+    }
+    qsort(dirty, dirty_cnt, sizeof(TFS_CacheEntry*), TFS_BlockCache_CmpByBlock);
+    for (int i = 0; i < dirty_cnt; ++i) {
+        self->write_back(self->ctx, dirty[i]->block_idx, dirty[i]->data);
+        dirty[i]->dirty = false;
+        ++self->write_backs;
+    }
+    free(dirty);
+}
+
+void TFS_BlockCache_FlushRange(TFS_BlockCache* self, int begin, int cnt) {
+    if (self->capacity == 0) {
+        return;
+    }
+    for (int block_idx = begin; block_idx < begin + cnt; ++block_idx) {
+        TFS_CacheEntry* entry = TFS_BlockCache_Peek(self, block_idx);
+        if (entry != NULL && entry->dirty) {
+            self->write_back(self->ctx, block_idx, entry->data);
+            entry->dirty = false;
+            ++self->write_backs;
+        }
+    }
+}
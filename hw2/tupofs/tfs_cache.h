@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+
+// LRU cache of whole blocks with write-back of dirty entries
+// held entries (changed since the last journal commit) are never written back on eviction:
+// while every entry is held the cache grows past capacity, TFS_BlockCache_Trim shrinks it back
+
+typedef void (*TFS_BlockCache_WriteBackFn)(void* ctx, int block_idx, const void* buf);
+
+typedef struct TFS_CacheEntry {
+    int block_idx;
+    bool dirty;
+    bool held; // see TFS_BlockCache_SetHeld
+    char* data;
+
+    struct TFS_CacheEntry* lru_prev;
+    struct TFS_CacheEntry* lru_next;
+    struct TFS_CacheEntry* hash_next;
+} TFS_CacheEntry;
+
+typedef struct TFS_BlockCache {
+    int capacity; // in blocks; 0 disables caching
+    int size; // entries in use, over capacity only while they are held
+    int held_cnt;
+    int bucket_cnt; // power of 2
+    TFS_CacheEntry** buckets;
+
+    // sentinel; lru.lru_next is the most recently used entry
+    TFS_CacheEntry lru;
+
+    TFS_BlockCache_WriteBackFn write_back;
+    void* ctx;
+
+    long hits;
+    long misses;
+    long write_backs;
+} TFS_BlockCache;
+
+void TFS_BlockCache_Init(TFS_BlockCache* self, int capacity, TFS_BlockCache_WriteBackFn write_back, void* ctx);
+
+// does not flush, call TFS_BlockCache_Flush first
+void TFS_BlockCache_Destruct(TFS_BlockCache* self);
+
+// held entry must not be written back: its' contents are not in the journal yet
+void TFS_BlockCache_SetHeld(TFS_BlockCache* self, TFS_CacheEntry* entry, bool held);
+
+// evicts least recently used entries that are not held until size is back to capacity
+void TFS_BlockCache_Trim(TFS_BlockCache* self);
+
+// fills held with all held entries (held_cnt of them) in ascending block order
+void TFS_BlockCache_GetHeld(TFS_BlockCache* self, TFS_CacheEntry** held);
+
+// returns entry and marks it most recently used, or NULL
+TFS_CacheEntry* TFS_BlockCache_Lookup(TFS_BlockCache* self, int block_idx);
+
+// same as Lookup but doesn't touch LRU order
+TFS_CacheEntry* TFS_BlockCache_Peek(TFS_BlockCache* self, int block_idx);
+
+// takes a slot for block_idx (must not be cached yet), evicting the least recently used one
+// that is not held; returned entry is clean and its data is uninitialized
+TFS_CacheEntry* TFS_BlockCache_Insert(TFS_BlockCache* self, int block_idx);
+
+// writes back all dirty entries that are not held in ascending block order
+void TFS_BlockCache_Flush(TFS_BlockCache* self);
+
+// writes back dirty entries of blocks [begin, begin + cnt), held ones too; they stay cached (and held)
+void TFS_BlockCache_FlushRange(TFS_BlockCache* self, int begin, int cnt);
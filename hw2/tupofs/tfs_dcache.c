@@ -0,0 +1,127 @@
+#include "tfs_dcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+static void TFS_DentryCache_LruUnlink(TFS_DentryEntry* entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void TFS_DentryCache_LruPushFront(TFS_DentryCache* self, TFS_DentryEntry* entry) {
+    entry->lru_prev = &self->lru;
+    entry->lru_next = self->lru.lru_next;
+    self->lru.lru_next->lru_prev = entry;
+    self->lru.lru_next = entry;
+}
+
+static void TFS_DentryCache_LruPushBack(TFS_DentryCache* self, TFS_DentryEntry* entry) {
+    entry->lru_next = &self->lru;
+    entry->lru_prev = self->lru.lru_prev;
+    self->lru.lru_prev->lru_next = entry;
+    self->lru.lru_prev = entry;
+}
+
+// FNV-1a over parent idx and name
+static TFS_DentryEntry** TFS_DentryCache_Bucket(TFS_DentryCache* self, int parent_idx, const char* name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 4; ++i) {
+        hash = (hash ^ (((uint32_t)parent_idx >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return &self->buckets[hash & (self->bucket_cnt - 1)];
+}
+
+static void TFS_DentryCache_HashRemove(TFS_DentryCache* self, TFS_DentryEntry* entry) {
+    TFS_DentryEntry** link = TFS_DentryCache_Bucket(self, entry->parent_idx, entry->name);
+    while (*link != entry) {
+        assert(*link != NULL);
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+}
+
+static TFS_DentryEntry* TFS_DentryCache_Find(TFS_DentryCache* self, int parent_idx, const char* name) {
+    if (self->capacity == 0 || strlen(name) >= TFS_DENTRY_NAME_SIZE) {
+        return NULL;
+    }
+    for (TFS_DentryEntry* entry = *TFS_DentryCache_Bucket(self, parent_idx, name); entry != NULL; entry = entry->hash_next) {
+        if (entry->parent_idx == parent_idx && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void TFS_DentryCache_Init(TFS_DentryCache* self, int capacity) {
+    assert(capacity >= 0);
+    self->capacity = capacity;
+    self->hits = self->misses = 0;
+    self->lru.lru_prev = self->lru.lru_next = &self->lru;
+
+    self->bucket_cnt = 1;
+    while (self->bucket_cnt < 2 * capacity) {
+        self->bucket_cnt *= 2;
+    }
+    self->buckets = calloc(self->bucket_cnt, sizeof(TFS_DentryEntry*));
+    self->entries = calloc(capacity, sizeof(TFS_DentryEntry));
+    for (int i = 0; i < capacity; ++i) {
+        TFS_DentryCache_LruPushFront(self, &self->entries[i]);
+    }
+}
+
+void TFS_DentryCache_Destruct(TFS_DentryCache* self) {
+    free(self->buckets);
+    free(self->entries);
+}
+
+bool TFS_DentryCache_Lookup(TFS_DentryCache* self, int parent_idx, const char* name, int* child_idx) {
+    TFS_DentryEntry* entry = TFS_DentryCache_Find(self, parent_idx, name);
+    if (entry == NULL) {
+        ++self->misses;
+        return false;
+    }
+    ++self->hits;
+    TFS_DentryCache_LruUnlink(entry);
+    TFS_DentryCache_LruPushFront(self, entry);
+    *child_idx = entry->child_idx;
+    return true;
+}
+
+void TFS_DentryCache_Set(TFS_DentryCache* self, int parent_idx, const char* name, int child_idx) {
+    if (self->capacity == 0 || strlen(name) >= TFS_DENTRY_NAME_SIZE) {
+        return;
+    }
+    TFS_DentryEntry* entry = TFS_DentryCache_Find(self, parent_idx, name);
+    if (entry == NULL) {
+        entry = self->lru.lru_prev;
+        if (entry->parent_idx != 0) {
+            TFS_DentryCache_HashRemove(self, entry);
+        }
+        entry->parent_idx = parent_idx;
+        strcpy(entry->name, name);
+        TFS_DentryEntry** bucket = TFS_DentryCache_Bucket(self, parent_idx, name);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+    }
+    entry->child_idx = child_idx;
+    TFS_DentryCache_LruUnlink(entry);
+    TFS_DentryCache_LruPushFront(self, entry);
+}
+
+void TFS_DentryCache_InvalidateParent(TFS_DentryCache* self, int parent_idx) {
+    for (int i = 0; i < self->capacity; ++i) {
+        TFS_DentryEntry* entry = &self->entries[i];
+        if (entry->parent_idx == parent_idx) {
+            TFS_DentryCache_HashRemove(self, entry);
+            entry->parent_idx = 0;
+            TFS_DentryCache_LruUnlink(entry);
+            TFS_DentryCache_LruPushBack(self, entry);
+        }
+    }
+}
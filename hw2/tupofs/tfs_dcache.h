@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+
+// LRU cache of name lookups: (parent inode idx, name) -> child inode idx, 0 for "no such entry"
+
+#define TFS_DENTRY_NAME_SIZE 28 // same as TFS_Inode_DirEnt.name
+
+typedef struct TFS_DentryEntry {
+    int parent_idx; // 0 if slot is unused
+    int child_idx; // 0 - negative entry
+    char name[TFS_DENTRY_NAME_SIZE];
+
+    struct TFS_DentryEntry* lru_prev;
+    struct TFS_DentryEntry* lru_next;
+    struct TFS_DentryEntry* hash_next;
+} TFS_DentryEntry;
+
+typedef struct TFS_DentryCache {
+    int capacity; // 0 disables caching
+    int bucket_cnt; // power of 2
+    TFS_DentryEntry* entries;
+    TFS_DentryEntry** buckets;
+
+    // sentinel; lru.lru_next is the most recently used entry
+    TFS_DentryEntry lru;
+
+    long hits;
+    long misses;
+} TFS_DentryCache;
+
+void TFS_DentryCache_Init(TFS_DentryCache* self, int capacity);
+void TFS_DentryCache_Destruct(TFS_DentryCache* self);
+
+// true if lookup is cached; *child_idx is 0 for a cached miss
+bool TFS_DentryCache_Lookup(TFS_DentryCache* self, int parent_idx, const char* name, int* child_idx);
+
+// adds or replaces entry, evicting the least recently used one; names too long for a dirent are not cached
+void TFS_DentryCache_Set(TFS_DentryCache* self, int parent_idx, const char* name, int child_idx);
+
+// drops all entries of parent, e.g. when its' inode is freed
+void TFS_DentryCache_InvalidateParent(TFS_DentryCache* self, int parent_idx);
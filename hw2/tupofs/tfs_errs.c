@@ -4,7 +4,7 @@ const char* TFS_GetError(int code) {
     if (code > 0) {
         return "success";
     }
-    static char buf[128];
+    static _Thread_local char buf[128];
     switch (code) {
         case TFS_ENOENT:
             return "does not exist";
@@ -12,6 +12,12 @@ const char* TFS_GetError(int code) {
             return "no space left";
         case TFS_EEXISTS:
             return "already exists";
+        case TFS_EBADFS:
+            return "not a TupoFS image or unsupported version";
+        case TFS_ENAMETOOLONG:
+            return "name too long";
+        case TFS_EINVAL:
+            return "invalid argument";
         default:
             sprintf(buf, "unknown error code %d", code);
             return buf;
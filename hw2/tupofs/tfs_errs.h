@@ -8,5 +8,8 @@
 #define TFS_ENOENT -2
 #define TFS_ENOSPACE -3
 #define TFS_EEXISTS -4
+#define TFS_EBADFS -5
+#define TFS_ENAMETOOLONG -6
+#define TFS_EINVAL -7
 
 const char* TFS_GetError(int code);
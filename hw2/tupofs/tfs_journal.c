@@ -0,0 +1,303 @@
+#include "tfs_journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tupofs.h"
+#include "tfs_errs.h"
+
+_Static_assert(sizeof(struct TFS_JournalDesc) == TFS_SECTOR_SIZE, "");
+
+static const char TFS_JOURNAL_MAGIC[16] = "\0\x13\x37\0TupoFS-log";
+#define TFS_JOURNAL_DESC_MAGIC 0x4a534654u // "TFSJ"
+
+// FNV-1a
+static uint32_t TFS_Journal_Hash(uint32_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t TFS_Journal_DescChecksum(const TFS_JournalDesc* desc, const char* blocks) {
+    TFS_JournalDesc copy = *desc;
+    copy.checksum = 0;
+    uint32_t hash = TFS_Journal_Hash(2166136261u, &copy, sizeof(copy));
+    return TFS_Journal_Hash(hash, blocks, (size_t)desc->block_cnt * TFS_SECTOR_SIZE);
+}
+
+static void TFS_Journal_WriteHeader(TFS_Backend* backend, int start, int64_t seq) {
+    char* block = calloc(1, TFS_SECTOR_SIZE);
+    TFS_JournalHeader* header = (TFS_JournalHeader*)block;
+    memcpy(header->magic, TFS_JOURNAL_MAGIC, 16);
+    header->seq = seq;
+    backend->ops->write_block(backend, start, block);
+    free(block);
+}
+
+void TFS_Journal_Format(TFS_Backend* backend, int start, int blocks) {
+    assert(blocks >= TFS_JOURNAL_MIN_BLOCKS);
+    TFS_Journal_WriteHeader(backend, start, 1);
+}
+
+// logged set
+
+static int TFS_Journal_Slot(const TFS_Journal* self, int home) {
+    unsigned slot = (unsigned)home * 2654435761u;
+    for (;; ++slot) {
+        slot &= self->logged_capacity - 1;
+        if (self->logged[slot] == home || self->logged[slot] == -1) {
+            return slot;
+        }
+    }
+}
+
+static void TFS_Journal_ClearLogged(TFS_Journal* self) {
+    memset(self->logged, 0xff, sizeof(int) * self->logged_capacity);
+    memset(self->revoked, 0, sizeof(bool) * self->logged_capacity);
+    self->logged_cnt = 0;
+    self->revoke_cnt = 0;
+}
+
+static void TFS_Journal_RevokeSlot(TFS_Journal* self, int slot) {
+    if (!self->revoked[slot]) {
+        self->revoked[slot] = true;
+        self->revokes[self->revoke_cnt++] = self->logged[slot];
+    }
+}
+
+void TFS_Journal_Revoke(TFS_Journal* self, int begin, int cnt) {
+    pthread_mutex_lock(&self->lock);
+    if (self->logged_cnt > 0) {
+        if (cnt <= self->logged_capacity) {
+            for (int home = begin; home < begin + cnt; ++home) {
+                int slot = TFS_Journal_Slot(self, home);
+                if (self->logged[slot] == home) {
+                    TFS_Journal_RevokeSlot(self, slot);
+                }
+            }
+        } else {
+            for (int slot = 0; slot < self->logged_capacity; ++slot) {
+                if (begin <= self->logged[slot] && self->logged[slot] < begin + cnt) {
+                    TFS_Journal_RevokeSlot(self, slot);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+// replay
+
+typedef struct TFS_JournalCopy {
+    int home;
+    int64_t seq;
+    const char* data;
+} TFS_JournalCopy;
+
+static int TFS_Journal_CmpCopies(const void* a, const void* b) {
+    const TFS_JournalCopy* lhs = a;
+    const TFS_JournalCopy* rhs = b;
+    if (lhs->home != rhs->home) {
+        return (lhs->home > rhs->home) - (lhs->home < rhs->home);
+    }
+    return (lhs->seq > rhs->seq) - (lhs->seq < rhs->seq);
+}
+
+// applies complete transactions found in the first log_blocks blocks of the log;
+// revokes pending in memory are newer than anything logged
+// returns number of transactions, *homes (malloc'd, ascending) gets places written
+static int TFS_Journal_Apply(TFS_Journal* self, int log_blocks, int* home_cnt, int** homes) {
+    char* log = malloc((size_t)(log_blocks + 1) * TFS_SECTOR_SIZE);
+    if (log_blocks > 0) {
+        self->backend->ops->read_blocks(self->backend, self->start + 1, log_blocks, log);
+    }
+
+    // every copy takes a block of the log, revokes are counted first
+    TFS_JournalCopy* copies = malloc(sizeof(TFS_JournalCopy) * (log_blocks + 1));
+    int revoke_capacity = self->revoke_cnt + 1;
+    TFS_JournalCopy* revokes = malloc(sizeof(TFS_JournalCopy) * revoke_capacity);
+    int copy_cnt = 0, revoke_cnt = 0;
+    int done_copies = 0, done_revokes = 0, txn_cnt = 0;
+    int64_t seq = self->first_seq;
+    for (int pos = 0; pos < log_blocks;) {
+        const TFS_JournalDesc* desc = (const TFS_JournalDesc*)(log + (size_t)pos * TFS_SECTOR_SIZE);
+        const char* blocks = (const char*)(desc + 1);
+        if (desc->magic != TFS_JOURNAL_DESC_MAGIC || desc->seq != seq
+            || desc->block_cnt < 0 || desc->revoke_cnt < 0
+            || desc->block_cnt + desc->revoke_cnt > TFS_JOURNAL_DESC_ENTRIES
+            || pos + 1 + desc->block_cnt > log_blocks
+            || TFS_Journal_DescChecksum(desc, blocks) != desc->checksum) {
+            break;
+        }
+        for (int i = 0; i < desc->block_cnt; ++i) {
+            copies[copy_cnt++] = (TFS_JournalCopy){ desc->entries[i], seq, blocks + (size_t)i * TFS_SECTOR_SIZE };
+        }
+        if (revoke_cnt + desc->revoke_cnt + self->revoke_cnt > revoke_capacity) {
+            revoke_capacity = 2 * (revoke_cnt + desc->revoke_cnt + self->revoke_cnt);
+            revokes = realloc(revokes, sizeof(TFS_JournalCopy) * revoke_capacity);
+        }
+        for (int i = 0; i < desc->revoke_cnt; ++i) {
+            revokes[revoke_cnt++] = (TFS_JournalCopy){ desc->entries[desc->block_cnt + i], seq, NULL };
+        }
+        pos += 1 + desc->block_cnt;
+        if (desc->last) {
+            done_copies = copy_cnt;
+            done_revokes = revoke_cnt;
+            ++txn_cnt;
+            ++seq;
+        }
+    }
+    // the rest is a transaction that was never committed
+    copy_cnt = done_copies;
+    revoke_cnt = done_revokes;
+    for (int i = 0; i < self->revoke_cnt; ++i) {
+        revokes[revoke_cnt++] = (TFS_JournalCopy){ self->revokes[i], INT64_MAX, NULL };
+    }
+
+    // newest copy of every place unless it was revoked later
+    qsort(copies, copy_cnt, sizeof(TFS_JournalCopy), TFS_Journal_CmpCopies);
+    qsort(revokes, revoke_cnt, sizeof(TFS_JournalCopy), TFS_Journal_CmpCopies);
+    *homes = malloc(sizeof(int) * (copy_cnt + 1));
+    *home_cnt = 0;
+    for (int i = 0, r = 0; i < copy_cnt; ++i) {
+        if (i + 1 < copy_cnt && copies[i + 1].home == copies[i].home) {
+            continue;
+        }
+        while (r < revoke_cnt && revokes[r].home < copies[i].home) {
+            ++r;
+        }
+        int64_t revoke_seq = 0;
+        for (int j = r; j < revoke_cnt && revokes[j].home == copies[i].home; ++j) {
+            revoke_seq = revokes[j].seq;
+        }
+        if (revoke_seq > copies[i].seq) {
+            continue;
+        }
+        self->backend->ops->write_block(self->backend, copies[i].home, copies[i].data);
+        (*homes)[(*home_cnt)++] = copies[i].home;
+    }
+
+    if (txn_cnt > 0) {
+        // places first, then the log may forget them
+        self->backend->ops->sync(self->backend);
+        TFS_Journal_WriteHeader(self->backend, self->start, seq);
+        self->backend->ops->sync(self->backend);
+    }
+    assert(self->head == 1 || seq == self->seq); // checkpoint finds every commit
+    self->first_seq = self->seq = seq;
+    self->head = 1;
+    TFS_Journal_ClearLogged(self);
+
+    free(revokes);
+    free(copies);
+    free(log);
+    return txn_cnt;
+}
+
+int TFS_Journal_Open(TFS_Journal* self, TFS_Backend* backend, int start, int blocks) {
+    char* block = malloc(TFS_SECTOR_SIZE);
+    backend->ops->read_block(backend, start, block);
+    TFS_JournalHeader header;
+    memcpy(&header, block, sizeof(header));
+    free(block);
+    if (blocks < TFS_JOURNAL_MIN_BLOCKS || memcmp(header.magic, TFS_JOURNAL_MAGIC, 16) != 0) {
+        return TFS_EBADFS;
+    }
+
+    self->backend = backend;
+    self->start = start;
+    self->blocks = blocks;
+    self->first_seq = self->seq = header.seq;
+    self->head = 1;
+    // every logged block takes a block of the log
+    self->logged_capacity = 1;
+    while (self->logged_capacity < 2 * blocks) {
+        self->logged_capacity *= 2;
+    }
+    self->logged = malloc(sizeof(int) * self->logged_capacity);
+    self->revoked = malloc(sizeof(bool) * self->logged_capacity);
+    self->revokes = malloc(sizeof(int) * blocks);
+    TFS_Journal_ClearLogged(self);
+    pthread_mutex_init(&self->lock, NULL);
+    self->commits = self->logged_blocks = self->checkpoints = 0;
+
+    int* homes;
+    int home_cnt;
+    self->replayed = TFS_Journal_Apply(self, blocks - 1, &home_cnt, &homes);
+    free(homes);
+    return TFS_ESUCC;
+}
+
+void TFS_Journal_Destruct(TFS_Journal* self) {
+    pthread_mutex_destroy(&self->lock);
+    free(self->logged);
+    free(self->revoked);
+    free(self->revokes);
+}
+
+static int TFS_Journal_DescCnt(const TFS_Journal* self, int cnt) {
+    int entry_cnt = cnt + self->revoke_cnt;
+    return entry_cnt == 0 ? 1 : (entry_cnt + TFS_JOURNAL_DESC_ENTRIES - 1) / TFS_JOURNAL_DESC_ENTRIES;
+}
+
+bool TFS_Journal_Fits(const TFS_Journal* self, int cnt) {
+    return self->head + TFS_Journal_DescCnt(self, cnt) + cnt <= self->blocks;
+}
+
+void TFS_Journal_Commit(TFS_Journal* self, const int* homes, const char* data, int cnt) {
+    assert(TFS_Journal_Fits(self, cnt));
+    int desc_cnt = TFS_Journal_DescCnt(self, cnt);
+    char* buf = calloc(desc_cnt + cnt, TFS_SECTOR_SIZE);
+    int pos = 0;
+    int block_i = 0;
+    int revoke_i = 0;
+    for (int d = 0; d < desc_cnt; ++d) {
+        TFS_JournalDesc* desc = (TFS_JournalDesc*)(buf + (size_t)pos * TFS_SECTOR_SIZE);
+        char* blocks = (char*)(desc + 1);
+        desc->magic = TFS_JOURNAL_DESC_MAGIC;
+        desc->seq = self->seq;
+        desc->block_cnt = cnt - block_i < TFS_JOURNAL_DESC_ENTRIES ? cnt - block_i : TFS_JOURNAL_DESC_ENTRIES;
+        int revoke_room = TFS_JOURNAL_DESC_ENTRIES - desc->block_cnt;
+        desc->revoke_cnt = self->revoke_cnt - revoke_i < revoke_room ? self->revoke_cnt - revoke_i : revoke_room;
+        desc->last = d == desc_cnt - 1;
+        memcpy(desc->entries, homes + block_i, sizeof(int) * desc->block_cnt);
+        memcpy(blocks, data + (size_t)block_i * TFS_SECTOR_SIZE, (size_t)desc->block_cnt * TFS_SECTOR_SIZE);
+        memcpy(desc->entries + desc->block_cnt, self->revokes + revoke_i, sizeof(int) * desc->revoke_cnt);
+        desc->checksum = TFS_Journal_DescChecksum(desc, blocks);
+        block_i += desc->block_cnt;
+        revoke_i += desc->revoke_cnt;
+        pos += 1 + desc->block_cnt;
+    }
+    assert(block_i == cnt && revoke_i == self->revoke_cnt);
+
+    self->backend->ops->write_blocks(self->backend, self->start + self->head, pos, buf);
+    self->backend->ops->sync(self->backend);
+    free(buf);
+
+    self->head += pos;
+    ++self->seq;
+    ++self->commits;
+    self->logged_blocks += cnt;
+    // revokes are in the log now; logged blocks may need them again later
+    for (int i = 0; i < self->revoke_cnt; ++i) {
+        self->revoked[TFS_Journal_Slot(self, self->revokes[i])] = false;
+    }
+    self->revoke_cnt = 0;
+    for (int i = 0; i < cnt; ++i) {
+        int slot = TFS_Journal_Slot(self, homes[i]);
+        if (self->logged[slot] == -1) {
+            self->logged[slot] = homes[i];
+            ++self->logged_cnt;
+        }
+    }
+}
+
+int TFS_Journal_Checkpoint(TFS_Journal* self, int** homes) {
+    int home_cnt;
+    TFS_Journal_Apply(self, self->head - 1, &home_cnt, homes);
+    ++self->checkpoints;
+    return home_cnt;
+}
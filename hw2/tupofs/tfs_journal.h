@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "tfs_backend.h"
+
+// write-ahead log of whole blocks in a region of the image
+//
+// block 0 of the region is the header, transactions follow it back to back. A transaction is one
+// or more descriptors, each followed by the blocks it lists; it is replayed only if all of its'
+// descriptors are intact and the last one is flagged, so a torn commit is simply not there.
+// Checkpoint copies the newest logged version of every block to its' place and empties the log
+
+#define TFS_JOURNAL_MIN_BLOCKS 16
+#define TFS_JOURNAL_MAX_BLOCKS 16384 // 32 MB
+#define TFS_JOURNAL_DESC_ENTRIES 504 // (TFS_SECTOR_SIZE - 32) / sizeof(int)
+
+typedef struct TFS_JournalHeader {
+    char magic[16];
+    int64_t seq; // first transaction in the log, older ones are checkpointed
+} TFS_JournalHeader;
+
+typedef struct TFS_JournalDesc {
+    uint32_t magic;
+    uint32_t checksum; // of the descriptor (with checksum = 0) and its' blocks
+    int64_t seq;
+    int block_cnt;
+    int revoke_cnt;
+    int last; // 1 if the transaction ends with this descriptor
+    int reserved;
+    // places of block_cnt blocks that follow the descriptor, then revoke_cnt revoked places:
+    // their copies from earlier transactions are stale and never applied
+    int entries[TFS_JOURNAL_DESC_ENTRIES];
+} TFS_JournalDesc;
+
+typedef struct TFS_Journal {
+    TFS_Backend* backend;
+    int start;
+    int blocks;
+    int64_t first_seq; // of the first transaction in the log
+    int64_t seq; // of the next transaction
+    int head; // next free block of the region, 1 while the log is empty
+
+    // places of blocks logged since the last checkpoint (open addressing, -1 - empty slot)
+    int* logged;
+    bool* revoked; // revoke of the slot is pending
+    int logged_capacity; // power of 2
+    int logged_cnt;
+    // revokes for the next commit
+    int* revokes;
+    int revoke_cnt;
+
+    pthread_mutex_t lock;
+
+    int replayed; // transactions applied by TFS_Journal_Open
+    long commits;
+    long logged_blocks;
+    long checkpoints;
+} TFS_Journal;
+
+// writes header of an empty log; region must be zero-filled
+void TFS_Journal_Format(TFS_Backend* backend, int start, int blocks);
+
+// applies transactions committed before a crash and empties the log
+// returns TFS_ESUCC or TFS_EBADFS if there is no journal header
+int TFS_Journal_Open(TFS_Journal* self, TFS_Backend* backend, int start, int blocks);
+void TFS_Journal_Destruct(TFS_Journal* self);
+
+// the rest expect self->lock to be held, except TFS_Journal_Revoke
+
+// whether cnt blocks and pending revokes fit into the rest of the log
+bool TFS_Journal_Fits(const TFS_Journal* self, int cnt);
+
+// logs blocks with their places and pending revokes as one transaction: one write and one sync
+void TFS_Journal_Commit(TFS_Journal* self, const int* homes, const char* data, int cnt);
+
+// writes newest logged copies to their places, then empties the log
+// returns number of places written, ascending, in malloc'd *homes
+int TFS_Journal_Checkpoint(TFS_Journal* self, int** homes);
+
+// blocks [begin, begin + cnt) are about to be written in place bypassing the log or reused,
+// so their logged copies must never be applied again
+void TFS_Journal_Revoke(TFS_Journal* self, int begin, int cnt);
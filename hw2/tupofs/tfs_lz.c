@@ -0,0 +1,166 @@
+#include "tfs_lz.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#define TFS_LZ_MIN_MATCH 4
+#define TFS_LZ_HASH_BITS 12
+#define TFS_LZ_MAX_OFFSET 65535
+// as in LZ4: the last bytes are always literals, so the decoder never copies a match past the end
+#define TFS_LZ_LAST_LITERALS 5
+#define TFS_LZ_MF_LIMIT 12 // no match starts closer than this to the end
+
+static uint32_t TFS_Lz_Read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static int TFS_Lz_Hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - TFS_LZ_HASH_BITS);
+}
+
+// length past the 15 that fit into the token: 255s and the remainder
+static uint8_t* TFS_Lz_PutLength(uint8_t* op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// literals, then the match if match_len >= TFS_LZ_MIN_MATCH; NULL if it doesn't fit
+static uint8_t* TFS_Lz_PutSequence(uint8_t* op, const uint8_t* op_end, const uint8_t* literals, int lit_len,
+                                   int offset, int match_len) {
+    int extra = match_len - TFS_LZ_MIN_MATCH;
+    // worst case: token, both length extensions, offset
+    if (op_end - op < 1 + lit_len / 255 + 1 + lit_len + 2 + extra / 255 + 1) {
+        return NULL;
+    }
+    uint8_t* token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15) {
+        op = TFS_Lz_PutLength(op, lit_len - 15);
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+    if (match_len < TFS_LZ_MIN_MATCH) {
+        return op; // the last sequence
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= extra < 15 ? extra : 15;
+    if (extra >= 15) {
+        op = TFS_Lz_PutLength(op, extra - 15);
+    }
+    return op;
+}
+
+int TFS_Lz_Compress(const void* src, int size, void* dst, int dst_cap) {
+    const uint8_t* base = src;
+    const uint8_t* end = base + size;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    uint8_t* op = dst;
+    const uint8_t* op_end = op + dst_cap;
+
+    // positions of the last 4-byte sequences seen, by hash
+    int table[1 << TFS_LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    if (size >= TFS_LZ_MF_LIMIT) {
+        const uint8_t* match_limit = end - TFS_LZ_LAST_LITERALS;
+        while (ip < end - TFS_LZ_MF_LIMIT) {
+            uint32_t sequence = TFS_Lz_Read32(ip);
+            int hash = TFS_Lz_Hash(sequence);
+            int candidate = table[hash];
+            table[hash] = ip - base;
+            if (candidate < 0 || ip - base - candidate > TFS_LZ_MAX_OFFSET || TFS_Lz_Read32(base + candidate) != sequence) {
+                ++ip;
+                continue;
+            }
+            const uint8_t* match = base + candidate;
+            while (ip > anchor && match > base && ip[-1] == match[-1]) {
+                --ip;
+                --match;
+            }
+            const uint8_t* match_end = ip + TFS_LZ_MIN_MATCH;
+            while (match_end < match_limit && *match_end == match[match_end - ip]) {
+                ++match_end;
+            }
+            op = TFS_Lz_PutSequence(op, op_end, anchor, ip - anchor, ip - match, match_end - ip);
+            if (op == NULL) {
+                return 0;
+            }
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+    op = TFS_Lz_PutSequence(op, op_end, anchor, end - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (uint8_t*)dst;
+}
+
+// length extension after a token nibble of 15; -1 if input ends first
+static int TFS_Lz_GetLength(const uint8_t** ip, const uint8_t* end, int len) {
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        len += byte;
+    } while (byte == 255);
+    return len;
+}
+
+int TFS_Lz_Decompress(const void* src, int size, void* dst, int dst_cap) {
+    const uint8_t* ip = src;
+    const uint8_t* end = ip + size;
+    uint8_t* out = dst;
+    uint8_t* op = out;
+    const uint8_t* op_end = op + dst_cap;
+
+    while (ip < end) {
+        int token = *ip++;
+        int lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = TFS_Lz_GetLength(&ip, end, lit_len)) < 0) {
+            return -1;
+        }
+        if (lit_len > end - ip || lit_len > op_end - op) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == end) {
+            break; // the last sequence has no match
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - out) {
+            return -1;
+        }
+        int match_len = token & 15;
+        if (match_len == 15 && (match_len = TFS_Lz_GetLength(&ip, end, match_len)) < 0) {
+            return -1;
+        }
+        match_len += TFS_LZ_MIN_MATCH;
+        if (match_len > op_end - op) {
+            return -1;
+        }
+        // byte by byte: the match may overlap the bytes being written
+        const uint8_t* match = op - offset;
+        for (int i = 0; i < match_len; ++i) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+    return op - out;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// LZ4-style block codec: sequences of (token, literals, 16-bit offset, match length),
+// no external dependencies, no state between blocks
+
+// compressed size of size bytes never exceeds this
+#define TFS_LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+// returns compressed size, 0 if it would exceed dst_cap
+int TFS_Lz_Compress(const void* src, int size, void* dst, int dst_cap);
+
+// returns decompressed size, -1 if src is corrupt or doesn't fit into dst_cap
+int TFS_Lz_Decompress(const void* src, int size, void* dst, int dst_cap);
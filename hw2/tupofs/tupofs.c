@@ -2,9 +2,14 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
 #include <assert.h>
 
 #include "tfs_errs.h"
+#include "tfs_lz.h"
 
 int TFS_CeilDiv(int a, int b) {
     return a / b + !!(a % b);
@@ -14,8 +19,23 @@ int TFS_Min(int a, int b) {
     return a < b ? a : b;
 }
 
+bool TFS_Inode_File_IsInline(const TFS_Inode_File* self) {
+    return self->index_cnt == TFS_FILE_INLINE;
+}
+
 int TFS_Inode_File_GetBlockCnt(const TFS_Inode_File* self) {
-    return TFS_CeilDiv(self->file_size, TFS_SECTOR_SIZE);
+    if (TFS_Inode_File_IsInline(self)) {
+        return 0;
+    }
+    return (self->file_size + TFS_SECTOR_SIZE - 1) / TFS_SECTOR_SIZE;
+}
+
+// empty inline file
+static void TFS_Inode_File_InitInline(TFS_Inode_File* self) {
+    self->file_size = 0;
+    self->extent_cnt = 0;
+    self->index_cnt = TFS_FILE_INLINE;
+    memset(self->data, 0, TFS_INODE_INLINE_SIZE);
 }
 
 TFS_Inode_DirEnt* TFS_Inode_Dir_AppendChild(TFS_Inode_Dir* self, TFS_Inode* child, const char* name) {
@@ -38,7 +58,7 @@ bool TFS_Inode_Dir_DeleteChildAt(TFS_Inode_Dir* self, int idx) {
     return true;
 }
 
-int TFS_Inode_Dir_FindChildIdx(TFS_Inode_Dir* self, const char* name) {
+int TFS_Inode_Dir_FindChildIdx(const TFS_Inode_Dir* self, const char* name) {
     for (int i = 0; i < self->children_cnt; ++i) {
         if (strcmp(self->entries[i].name, name) == 0) {
             return i;
@@ -52,46 +72,67 @@ TFS_Inode_DirEnt* TFS_Inode_Dir_FindChild(TFS_Inode_Dir* self, const char* name)
     return idx != -1 ? &self->entries[idx] : NULL;
 }
 
+// bitmaps are processed a 64-bit word at a time; bit i lives in byte i / 8, bit i % 8
+static uint64_t TFS_Bitmap_LoadWord(const char* bitmap, int size, int word_i, uint8_t tail_fill) {
+    uint64_t word;
+    int offset = word_i * 8;
+    if (offset + 8 <= size) {
+        memcpy(&word, bitmap + offset, 8);
+    } else {
+        uint8_t bytes[8];
+        memset(bytes, tail_fill, 8);
+        memcpy(bytes, bitmap + offset, size - offset);
+        memcpy(&word, bytes, 8);
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
 void TFS_Bitmap_FindFree(const char* bitmap, int size, int* free_idxes, int cnt) {
     int found = 0;
-    for (int i = 0; i < size; ++i) {
-        int byte = bitmap[i];
-        for (int bit_idx = 0; bit_idx < 8; ++bit_idx) {
-            if (!(byte & (1 << bit_idx))) {
-                free_idxes[found++] = i * 8 + bit_idx;
-                if (found == cnt) {
-                    return;
-                }
-            }
+    int words = TFS_CeilDiv(size, 8);
+    for (int i = 0; i < words && found < cnt; ++i) {
+        // bytes past the end count as occupied
+        uint64_t free_bits = ~TFS_Bitmap_LoadWord(bitmap, size, i, 0xff);
+        while (free_bits != 0 && found < cnt) {
+            free_idxes[found++] = i * 64 + __builtin_ctzll(free_bits);
+            free_bits &= free_bits - 1;
         }
     }
     assert(found == cnt);
 }
 
 void TFS_Bitmap_SetBits(char* bitmap, int size, const int* idxes, int cnt, bool bit) {
-    int j = 0;
-    for (int i = 0; i < size && j < cnt; ++i) {
-        int byte = bitmap[i];
-        for (int bit_idx = 0; bit_idx < 8; ++bit_idx) {
-            if (i * 8 + bit_idx == idxes[j]) {
-                if (bit) {
-                    byte |= 1 << bit_idx;
-                } else {
-                    byte &= ~(1 << bit_idx);
-                }
-                ++j;
-                if (j == cnt) {
-                    break;
-                }
-            }
-        }
-        bitmap[i] = byte;
+    for (int j = 0; j < cnt; ++j) {
+        assert(j == 0 || idxes[j - 1] < idxes[j]);
+        TFS_Bitmap_SetBit(bitmap, size, idxes[j], bit);
     }
-    assert(j == cnt);
 }
 
 void TFS_Bitmap_SetBit(char* bitmap, int size, int idx, bool bit) {
-    TFS_Bitmap_SetBits(bitmap, size, &idx, 1, bit);
+    assert(0 <= idx && idx < size * 8);
+    if (bit) {
+        bitmap[idx / 8] |= 1 << (idx % 8);
+    } else {
+        bitmap[idx / 8] &= ~(1 << (idx % 8));
+    }
+}
+
+void TFS_Bitmap_SetRange(char* bitmap, int size, int begin, int cnt, bool bit) {
+    assert(0 <= begin && cnt >= 0 && begin + cnt <= size * 8);
+    int end = begin + cnt;
+    // partial bytes at both ends, whole bytes in between with memset
+    while (begin < end && begin % 8 != 0) {
+        TFS_Bitmap_SetBit(bitmap, size, begin++, bit);
+    }
+    int whole_bytes = (end - begin) / 8;
+    memset(bitmap + begin / 8, bit ? 0xff : 0, whole_bytes);
+    begin += whole_bytes * 8;
+    while (begin < end) {
+        TFS_Bitmap_SetBit(bitmap, size, begin++, bit);
+    }
 }
 
 bool TFS_Bitmap_GetBit(const char* bitmap, int size, int idx) {
@@ -100,90 +141,953 @@ bool TFS_Bitmap_GetBit(const char* bitmap, int size, int idx) {
     return !!(bitmap[byte_idx] & (1 << (idx - byte_idx * 8)));
 }
 
+int TFS_Bitmap_CountSet(const char* bitmap, int size) {
+    int result = 0;
+    int words = TFS_CeilDiv(size, 8);
+    for (int i = 0; i < words; ++i) {
+        result += __builtin_popcountll(TFS_Bitmap_LoadWord(bitmap, size, i, 0));
+    }
+    return result;
+}
+
+int TFS_Bitmap_CountRange(const char* bitmap, int size, int begin, int cnt) {
+    assert(0 <= begin && cnt >= 0 && begin + cnt <= size * 8);
+    int end = begin + cnt;
+    int result = 0;
+    while (begin < end && begin % 8 != 0) {
+        result += TFS_Bitmap_GetBit(bitmap, size, begin++);
+    }
+    for (; begin + 8 <= end; begin += 8) {
+        result += __builtin_popcount((uint8_t)bitmap[begin / 8]);
+    }
+    while (begin < end) {
+        result += TFS_Bitmap_GetBit(bitmap, size, begin++);
+    }
+    return result;
+}
+
+int TFS_Bitmap_FindNext(const char* bitmap, int size, int from, bool bit) {
+    int bits = size * 8;
+    if (from >= bits) {
+        return bits;
+    }
+    int words = TFS_CeilDiv(size, 8);
+    int word_i = from / 64;
+    // bits past the end read as set, result is clamped anyway
+    uint64_t word = TFS_Bitmap_LoadWord(bitmap, size, word_i, 0xff);
+    if (!bit) {
+        word = ~word;
+    }
+    word &= ~0ULL << (from % 64);
+    while (word == 0) {
+        if (++word_i == words) {
+            return bits;
+        }
+        word = TFS_Bitmap_LoadWord(bitmap, size, word_i, 0xff);
+        if (!bit) {
+            word = ~word;
+        }
+    }
+    return TFS_Min(word_i * 64 + __builtin_ctzll(word), bits);
+}
+
+// space maps: bitmap block b holds bits [b * TFS_MAP_BLOCK_BITS, (b + 1) * TFS_MAP_BLOCK_BITS)
+
+static void TFS_SpaceMap_Init(TFS_SpaceMap* self, int first_block, int size) {
+    self->size = size;
+    self->first_block = first_block;
+    self->blocks = TFS_CeilDiv(size, TFS_SECTOR_SIZE);
+    self->bits = calloc(self->blocks, TFS_SECTOR_SIZE);
+    self->free_cnt = calloc(self->blocks, sizeof(int));
+    self->free_total = 0;
+    self->dirty = calloc(self->blocks, sizeof(bool));
+}
+
+static void TFS_SpaceMap_Destruct(TFS_SpaceMap* self) {
+    free(self->bits);
+    free(self->free_cnt);
+    free(self->dirty);
+}
+
+// rebuilds the summary from bits
+static void TFS_SpaceMap_Recount(TFS_SpaceMap* self) {
+    self->free_total = 0;
+    for (int b = 0; b < self->blocks; ++b) {
+        int bytes = TFS_Min(TFS_SECTOR_SIZE, self->size - b * TFS_SECTOR_SIZE);
+        self->free_cnt[b] = bytes * 8 - TFS_Bitmap_CountSet(self->bits + (size_t)b * TFS_SECTOR_SIZE, bytes);
+        self->free_total += self->free_cnt[b];
+    }
+}
+
+// bits[begin, begin + cnt) = bit, one bitmap block at a time to keep the summary right
+static void TFS_SpaceMap_SetRange(TFS_SpaceMap* self, int begin, int cnt, bool bit) {
+    assert(0 <= begin && cnt >= 0 && begin + cnt <= self->size * 8);
+    int end = begin + cnt;
+    while (begin < end) {
+        int b = begin / TFS_MAP_BLOCK_BITS;
+        int chunk = TFS_Min(end, (b + 1) * TFS_MAP_BLOCK_BITS) - begin;
+        int was_set = TFS_Bitmap_CountRange(self->bits, self->size, begin, chunk);
+        TFS_Bitmap_SetRange(self->bits, self->size, begin, chunk, bit);
+        int freed = bit ? was_set - chunk : was_set;
+        self->free_cnt[b] += freed;
+        self->free_total += freed;
+        self->dirty[b] = true;
+        begin += chunk;
+    }
+}
+
+// TFS_Bitmap_FindNext that skips whole bitmap blocks without such bit
+static int TFS_SpaceMap_FindNext(const TFS_SpaceMap* self, int from, bool bit) {
+    int bits = self->size * 8;
+    while (from < bits) {
+        int b = from / TFS_MAP_BLOCK_BITS;
+        int block_end = TFS_Min(bits, (b + 1) * TFS_MAP_BLOCK_BITS);
+        bool has_bit = bit ? self->free_cnt[b] < block_end - b * TFS_MAP_BLOCK_BITS : self->free_cnt[b] > 0;
+        if (has_bit) {
+            // search only up to the block end
+            int found = TFS_Bitmap_FindNext(self->bits, block_end / 8, from, bit);
+            if (found < block_end) {
+                return found;
+            }
+        }
+        from = block_end;
+    }
+    return bits;
+}
+
 const char TFS_MAGIC[16] = "\0\x13\x37\0TupoFS";
-static char block_buf[TFS_SECTOR_SIZE];
 
-void TFS_Driver_Init(TFS_Driver* self, FILE* file, bool create) {
-    self->file = file;
+// fills region layout of superblock for given bitmap and journal sizes, false if they are out of range
+static bool TFS_SuperBlock_SetLayout(TFS_SuperBlock* self, int inode_map_size, int data_map_size, int journal_blocks) {
+    if (inode_map_size < 1 || inode_map_size > TFS_MAX_MAP_SIZE || data_map_size < 1 || data_map_size > TFS_MAX_MAP_SIZE) {
+        return false;
+    }
+    if (journal_blocks != 0 && (journal_blocks < TFS_JOURNAL_MIN_BLOCKS || journal_blocks > TFS_JOURNAL_MAX_BLOCKS)) {
+        return false;
+    }
+    int64_t data_map_start = 1 + (int64_t)TFS_CeilDiv(inode_map_size, TFS_SECTOR_SIZE);
+    int64_t journal_start = data_map_start + TFS_CeilDiv(data_map_size, TFS_SECTOR_SIZE);
+    int64_t inode_start = journal_start + journal_blocks;
+    // 8 inodes per bitmap byte and 8 inodes per block
+    int64_t data_start = inode_start + inode_map_size;
+    int64_t block_cnt = data_start + 8 * (int64_t)data_map_size;
+    if (block_cnt > INT_MAX) {
+        return false;
+    }
+    self->inode_map_size = inode_map_size;
+    self->data_map_size = data_map_size;
+    self->inode_map_start = 1;
+    self->data_map_start = data_map_start;
+    self->inode_start = inode_start;
+    self->data_start = data_start;
+    self->block_cnt = block_cnt;
+    self->journal_start = journal_start;
+    self->journal_blocks = journal_blocks;
+    return true;
+}
+
+// superblock as read from disk: magic, version and a layout matching bitmap sizes
+static bool TFS_SuperBlock_IsValid(const TFS_SuperBlock* self) {
+    if (memcmp(self->magic, TFS_MAGIC, 16) != 0 || self->version != TFS_FORMAT_VERSION) {
+        return false;
+    }
+    TFS_SuperBlock expected = *self;
+    return TFS_SuperBlock_SetLayout(&expected, self->inode_map_size, self->data_map_size, self->journal_blocks)
+        && memcmp(&expected, self, sizeof(TFS_SuperBlock)) == 0;
+}
+
+static void TFS_Driver_ReadBlockRaw(TFS_Driver* self, int block_idx, void* buf) {
+    self->backend.ops->read_block(&self->backend, block_idx, buf);
+}
+
+static void TFS_Driver_WriteBlockRaw(TFS_Driver* self, int block_idx, const void* buf) {
+    self->backend.ops->write_block(&self->backend, block_idx, buf);
+}
+
+static void TFS_Driver_CacheWriteBack(void* ctx, int block_idx, const void* buf) {
+    TFS_Driver_WriteBlockRaw(ctx, block_idx, buf);
+}
+
+static void TFS_Driver_InitLocks(TFS_Driver* self) {
+    pthread_rwlock_init(&self->txn_lock, NULL);
+    pthread_rwlock_init(&self->ns_lock, NULL);
+    for (int i = 0; i < TFS_INODE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_init(&self->inode_locks[i], NULL);
+    }
+    pthread_mutex_init(&self->map_lock, NULL);
+    pthread_mutex_init(&self->inode_table_lock, NULL);
+    pthread_mutex_init(&self->cache_lock, NULL);
+    pthread_mutex_init(&self->dentry_lock, NULL);
+}
+
+static void TFS_Driver_DestroyLocks(TFS_Driver* self) {
+    pthread_rwlock_destroy(&self->txn_lock);
+    pthread_rwlock_destroy(&self->ns_lock);
+    for (int i = 0; i < TFS_INODE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_destroy(&self->inode_locks[i]);
+    }
+    pthread_mutex_destroy(&self->map_lock);
+    pthread_mutex_destroy(&self->inode_table_lock);
+    pthread_mutex_destroy(&self->cache_lock);
+    pthread_mutex_destroy(&self->dentry_lock);
+}
+
+// blocks are held in cache until commit, so no cache - no journal; mapped image has no cache,
+// in-memory one is only written out as a whole
+static void TFS_Driver_UpdateJournaling(TFS_Driver* self) {
+    self->journaling = self->super_block.journal_blocks > 0 && self->cache.capacity > 0
+        && self->backend.ops != &TFS_BACKEND_MEM;
+}
+
+static void* TFS_Driver_CommitterMain(void* arg);
+
+// create: format the image with given bitmap and journal sizes first
+static int TFS_Driver_Open(TFS_Driver* self, const TFS_Backend* backend, bool create, int inode_map_size, int data_map_size, int journal_blocks) {
+    self->backend = *backend;
+    TFS_Driver_InitLocks(self);
+    char* block_buf = malloc(TFS_SECTOR_SIZE);
+    // mapped image already is a cache, don't keep a second copy of blocks
+    int cache_blocks = backend->ops->map_block != NULL ? 0 : TFS_DEFAULT_CACHE_BLOCKS;
+    TFS_BlockCache_Init(&self->cache, cache_blocks, TFS_Driver_CacheWriteBack, self);
     if (create) {
         // prepare clean superblock
         memset(&self->super_block, 0, sizeof(TFS_SuperBlock));
         memcpy(self->super_block.magic, TFS_MAGIC, 16);
-        self->super_block.inode_map_size = TFS_SECTOR_SIZE;
-        self->super_block.data_map_size = TFS_SECTOR_SIZE;
+        self->super_block.version = TFS_FORMAT_VERSION;
+        bool layout_ok = TFS_SuperBlock_SetLayout(&self->super_block, inode_map_size, data_map_size, journal_blocks);
+        assert(layout_ok); // checked by TFS_Driver_Create
+        (void)layout_ok;
 
-        // create and write file
-        fseek(file, 0, SEEK_SET);
+        // size the file, it's 0-filled
+        self->backend.ops->resize(&self->backend, self->super_block.block_cnt);
 
         // write superblock
-        memcpy(block_buf, &self->super_block, sizeof(TFS_SuperBlock));
-        fwrite(block_buf, TFS_SECTOR_SIZE, 1, file);
-
-        // write rest of file 0-filled
         memset(block_buf, 0, TFS_SECTOR_SIZE);
-        for (int i = 0; i < 2 + 8 * self->super_block.inode_map_size + 8 * self->super_block.data_map_size; ++i) {
-            fwrite(block_buf, TFS_SECTOR_SIZE, 1, file);
+        memcpy(block_buf, &self->super_block, sizeof(TFS_SuperBlock));
+        TFS_Driver_WriteBlockRaw(self, 0, block_buf);
+        if (journal_blocks > 0) {
+            TFS_Journal_Format(&self->backend, self->super_block.journal_start, journal_blocks);
         }
+    }
+    TFS_Driver_ReadBlock(self, 0, block_buf);
+    memcpy(&self->super_block, block_buf, sizeof(TFS_SuperBlock));
+    // committed transactions are replayed before anything else is read
+    const TFS_SuperBlock* sb = &self->super_block;
+    if (!TFS_SuperBlock_IsValid(sb)
+        || (sb->journal_blocks > 0 && TFS_Journal_Open(&self->journal, &self->backend, sb->journal_start, sb->journal_blocks) <= 0)) {
+        TFS_BlockCache_Destruct(&self->cache);
+        TFS_Driver_DestroyLocks(self);
+        self->backend.ops->close(&self->backend);
+        free(block_buf);
+        return TFS_EBADFS;
+    }
 
-        // fill inode indices
-        for (int i = 1; i <= 8 * self->super_block.inode_map_size; ++i) {
-            TFS_Inode* inode = (TFS_Inode*)block_buf;
-            int block_idx = TFS_Driver_GetInodeBlockIdx(self, i);
+    // bitmaps stay resident, written back by TFS_Driver_Sync
+    TFS_SpaceMap_Init(&self->inode_map, self->super_block.inode_map_start, self->super_block.inode_map_size);
+    TFS_SpaceMap_Init(&self->data_map, self->super_block.data_map_start, self->super_block.data_map_size);
+    TFS_Driver_ReadBlocks(self, self->inode_map.first_block, self->inode_map.blocks, self->inode_map.bits);
+    TFS_Driver_ReadBlocks(self, self->data_map.first_block, self->data_map.blocks, self->data_map.bits);
+    TFS_SpaceMap_Recount(&self->inode_map);
+    TFS_SpaceMap_Recount(&self->data_map);
+    self->alloc_cursor = 0;
+    self->compress = false;
+    self->inode_gens = calloc(8 * self->super_block.inode_map_size + 1, sizeof(uint32_t));
+    TFS_DentryCache_Init(&self->dentries, TFS_DEFAULT_DENTRY_CACHE);
+    TFS_Driver_UpdateJournaling(self);
 
-            TFS_Driver_ReadBlock(self, block_idx, inode);
-            inode->inode_idx = i;
-            TFS_Driver_PutInode(self, i, inode);
-            TFS_Driver_GetInode(self, i, inode);
+    if (create) {
+        // fill inode indices; image is zero-filled, so free inodes are just written in batches of blocks
+        int inode_cnt = 8 * self->super_block.inode_map_size;
+        const int batch_inodes = TFS_FORMAT_BATCH * TFS_INODES_PER_BLOCK;
+        TFS_Inode* batch = calloc(batch_inodes, sizeof(TFS_Inode));
+        for (int first = 1; first <= inode_cnt; first += batch_inodes) {
+            int cnt = TFS_Min(batch_inodes, inode_cnt - first + 1);
+            for (int i = 0; i < cnt; ++i) {
+                batch[i].inode_idx = first + i;
+            }
+            TFS_Driver_WriteBlocks(self, TFS_Driver_GetInodeBlockIdx(self, first), cnt / TFS_INODES_PER_BLOCK, batch);
         }
+        free(batch);
 
         // create root inode
         TFS_Inode* inode = (TFS_Inode*)block_buf;
         TFS_Driver_CreateInode(self, inode, TFS_INODE_DIR);
         assert(inode->inode_idx == TFS_ROOT_INODE_IDX);
     }
-    fseek(file, 0, SEEK_SET);
-    fread(&self->super_block, sizeof(TFS_SuperBlock), 1, file);
+    free(block_buf);
+
+    if (self->super_block.journal_blocks > 0) {
+        pthread_mutex_init(&self->committer_lock, NULL);
+        pthread_cond_init(&self->committer_cond, NULL);
+        self->committer_stop = false;
+        pthread_create(&self->committer, NULL, TFS_Driver_CommitterMain, self);
+    }
+    return TFS_ESUCC;
+}
+
+int TFS_Driver_Init(TFS_Driver* self, const TFS_Backend* backend, bool create) {
+    return TFS_Driver_Open(self, backend, create, TFS_DEFAULT_MAP_SIZE, TFS_DEFAULT_MAP_SIZE, TFS_DEFAULT_JOURNAL_BLOCKS);
+}
+
+int TFS_Driver_Create(TFS_Driver* self, const TFS_Backend* backend, int inode_map_size, int data_map_size, int journal_blocks) {
+    TFS_SuperBlock layout;
+    if (!TFS_SuperBlock_SetLayout(&layout, inode_map_size, data_map_size, journal_blocks)) {
+        self->backend = *backend;
+        self->backend.ops->close(&self->backend);
+        return TFS_EINVAL;
+    }
+    return TFS_Driver_Open(self, backend, true, inode_map_size, data_map_size, journal_blocks);
 }
 
 void TFS_Driver_Destruct(TFS_Driver* self) {
-    fclose(self->file);
+    bool has_journal = self->super_block.journal_blocks > 0;
+    if (has_journal) {
+        pthread_mutex_lock(&self->committer_lock);
+        self->committer_stop = true;
+        pthread_cond_signal(&self->committer_cond);
+        pthread_mutex_unlock(&self->committer_lock);
+        pthread_join(self->committer, NULL);
+        pthread_mutex_destroy(&self->committer_lock);
+        pthread_cond_destroy(&self->committer_cond);
+    }
+    TFS_Driver_Sync(self);
+    if (has_journal) {
+        TFS_Journal_Destruct(&self->journal);
+    }
+    TFS_BlockCache_Destruct(&self->cache);
+    TFS_DentryCache_Destruct(&self->dentries);
+    TFS_Driver_DestroyLocks(self);
+    self->backend.ops->close(&self->backend);
+    TFS_SpaceMap_Destruct(&self->inode_map);
+    TFS_SpaceMap_Destruct(&self->data_map);
+    free(self->inode_gens);
+}
+
+// per-operation write batch: single blocks written by an operation are kept here and written once
+// each, sorted, before the operation releases the locks that protect them
+
+typedef struct TFS_Txn {
+    TFS_Driver* driver;
+    int cnt;
+    int capacity;
+    int* blocks; // block idx of every copy, in order of first write
+    // parts of the copy written by the operation, TFS_INODE_SIZE each: inode blocks are shared
+    // with other threads' inodes, so only the inodes put by this one are taken from the copy
+    uint8_t* parts;
+    char* data;
+} TFS_Txn;
+
+#define TFS_TXN_WHOLE_BLOCK 0xff
+
+_Static_assert(TFS_INODES_PER_BLOCK == 8, "parts of a block must fit into uint8_t");
+
+typedef struct TFS_TxnSlot {
+    int block_idx;
+    int slot;
+} TFS_TxnSlot;
+
+// operation in progress on this thread, see TFS_Driver_BeginOp
+static _Thread_local TFS_Txn* TFS_current_txn = NULL;
+
+static TFS_Txn* TFS_Driver_GetTxn(TFS_Driver* self) {
+    TFS_Txn* txn = TFS_current_txn;
+    return txn != NULL && txn->driver == self ? txn : NULL;
+}
+
+// slot of the block's copy or -1; operations write few blocks, so it is a plain scan
+static int TFS_Txn_Find(TFS_Txn* self, int block_idx) {
+    for (int i = self->cnt - 1; i >= 0; --i) {
+        if (self->blocks[i] == block_idx) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// new copy with nothing written yet
+static int TFS_Txn_Add(TFS_Txn* self, int block_idx) {
+    if (self->cnt == self->capacity) {
+        self->capacity = self->capacity == 0 ? 8 : 2 * self->capacity;
+        self->blocks = realloc(self->blocks, sizeof(int) * self->capacity);
+        self->parts = realloc(self->parts, self->capacity);
+        self->data = realloc(self->data, (size_t)self->capacity * TFS_SECTOR_SIZE);
+    }
+    self->blocks[self->cnt] = block_idx;
+    self->parts[self->cnt] = 0;
+    return self->cnt++;
+}
+
+static char* TFS_Txn_Data(TFS_Txn* self, int slot) {
+    return self->data + (size_t)slot * TFS_SECTOR_SIZE;
+}
+
+// copies parts written by the operation over buf
+static void TFS_Txn_Overlay(TFS_Txn* self, int slot, char* buf) {
+    const char* copy = TFS_Txn_Data(self, slot);
+    if (self->parts[slot] == TFS_TXN_WHOLE_BLOCK) {
+        memcpy(buf, copy, TFS_SECTOR_SIZE);
+        return;
+    }
+    for (int part = 0; part < TFS_INODES_PER_BLOCK; ++part) {
+        if (self->parts[slot] & (1u << part)) {
+            memcpy(buf + part * TFS_INODE_SIZE, copy + part * TFS_INODE_SIZE, TFS_INODE_SIZE);
+        }
+    }
+}
+
+static int TFS_TxnSlot_CmpByBlock(const void* a, const void* b) {
+    int lhs = ((const TFS_TxnSlot*)a)->block_idx;
+    int rhs = ((const TFS_TxnSlot*)b)->block_idx;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+// whole block into cache, cache_lock must be held
+static void TFS_Driver_CacheWriteLocked(TFS_Driver* self, int block_idx, const void* buf) {
+    // whole-block writes never need the old contents
+    TFS_CacheEntry* entry = TFS_BlockCache_Lookup(&self->cache, block_idx);
+    if (entry == NULL) {
+        entry = TFS_BlockCache_Insert(&self->cache, block_idx);
+    }
+    memcpy(entry->data, buf, TFS_SECTOR_SIZE);
+    entry->dirty = true;
+    if (self->journaling) {
+        // stays in cache until it is logged
+        TFS_BlockCache_SetHeld(&self->cache, entry, true);
+    }
+}
+
+static void TFS_Driver_ReadBlockShared(TFS_Driver* self, int block_idx, void* buf);
+
+// writes batched blocks in ascending order: into cache under one lock, or in place a run per I/O;
+// partly written inode blocks are merged with their current contents under inode_table_lock
+static void TFS_Driver_FlushTxn(TFS_Driver* self, TFS_Txn* txn) {
+    if (txn->cnt == 0) {
+        return;
+    }
+    TFS_TxnSlot* order = malloc(sizeof(TFS_TxnSlot) * txn->cnt);
+    bool merge = false;
+    for (int i = 0; i < txn->cnt; ++i) {
+        order[i] = (TFS_TxnSlot){ txn->blocks[i], i };
+        merge |= txn->parts[i] != TFS_TXN_WHOLE_BLOCK;
+    }
+    qsort(order, txn->cnt, sizeof(TFS_TxnSlot), TFS_TxnSlot_CmpByBlock);
+    if (merge) {
+        pthread_mutex_lock(&self->inode_table_lock);
+    }
+    char* sorted = malloc((size_t)txn->cnt * TFS_SECTOR_SIZE);
+    for (int i = 0; i < txn->cnt; ++i) {
+        char* dst = sorted + (size_t)i * TFS_SECTOR_SIZE;
+        if (txn->parts[order[i].slot] != TFS_TXN_WHOLE_BLOCK) {
+            TFS_Driver_ReadBlockShared(self, order[i].block_idx, dst);
+        }
+        TFS_Txn_Overlay(txn, order[i].slot, dst);
+    }
+    if (self->cache.capacity != 0) {
+        pthread_mutex_lock(&self->cache_lock);
+        for (int i = 0; i < txn->cnt; ++i) {
+            TFS_Driver_CacheWriteLocked(self, order[i].block_idx, sorted + (size_t)i * TFS_SECTOR_SIZE);
+        }
+        pthread_mutex_unlock(&self->cache_lock);
+    } else {
+        for (int i = 0; i < txn->cnt;) {
+            int end = i + 1;
+            while (end < txn->cnt && order[end].block_idx == order[end - 1].block_idx + 1) {
+                ++end;
+            }
+            self->backend.ops->write_blocks(&self->backend, order[i].block_idx, end - i, sorted + (size_t)i * TFS_SECTOR_SIZE);
+            i = end;
+        }
+    }
+    if (merge) {
+        pthread_mutex_unlock(&self->inode_table_lock);
+    }
+    free(sorted);
+    free(order);
+    txn->cnt = 0;
+}
+
+// batched blocks become visible before the lock that guards them is released
+static void TFS_Driver_FlushOp(TFS_Driver* self) {
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    if (txn != NULL) {
+        TFS_Driver_FlushTxn(self, txn);
+    }
+}
+
+void TFS_Driver_LockNamespace(TFS_Driver* self, bool exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&self->ns_lock);
+    } else {
+        pthread_rwlock_rdlock(&self->ns_lock);
+    }
+}
+
+void TFS_Driver_UnlockNamespace(TFS_Driver* self) {
+    TFS_Driver_FlushOp(self);
+    pthread_rwlock_unlock(&self->ns_lock);
+}
+
+void TFS_Driver_LockInode(TFS_Driver* self, int inode_idx, bool exclusive) {
+    pthread_rwlock_t* lock = &self->inode_locks[inode_idx % TFS_INODE_LOCK_STRIPES];
+    if (exclusive) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+}
+
+void TFS_Driver_UnlockInode(TFS_Driver* self, int inode_idx) {
+    TFS_Driver_FlushOp(self);
+    pthread_rwlock_unlock(&self->inode_locks[inode_idx % TFS_INODE_LOCK_STRIPES]);
+}
+
+// dentry cache is shared by concurrent path walks
+
+static bool TFS_Driver_DentryLookup(TFS_Driver* self, int parent_idx, const char* name, int* child_idx) {
+    pthread_mutex_lock(&self->dentry_lock);
+    bool found = TFS_DentryCache_Lookup(&self->dentries, parent_idx, name, child_idx);
+    pthread_mutex_unlock(&self->dentry_lock);
+    return found;
+}
+
+static void TFS_Driver_DentrySet(TFS_Driver* self, int parent_idx, const char* name, int child_idx) {
+    pthread_mutex_lock(&self->dentry_lock);
+    TFS_DentryCache_Set(&self->dentries, parent_idx, name, child_idx);
+    pthread_mutex_unlock(&self->dentry_lock);
+}
+
+static void TFS_Driver_DentryInvalidateParent(TFS_Driver* self, int parent_idx) {
+    pthread_mutex_lock(&self->dentry_lock);
+    TFS_DentryCache_InvalidateParent(&self->dentries, parent_idx);
+    pthread_mutex_unlock(&self->dentry_lock);
+}
+
+// writes changed bitmap blocks, consecutive ones in one I/O
+static void TFS_Driver_WriteBackMap(TFS_Driver* self, TFS_SpaceMap* map) {
+    for (int b = 0; b < map->blocks;) {
+        if (!map->dirty[b]) {
+            ++b;
+            continue;
+        }
+        int end = b;
+        while (end < map->blocks && map->dirty[end]) {
+            map->dirty[end++] = false;
+        }
+        TFS_Driver_WriteBlocks(self, map->first_block + b, end - b, map->bits + (size_t)b * TFS_SECTOR_SIZE);
+        b = end;
+    }
+}
+
+// journal
+
+// copies newest logged blocks to their places and empties the log, journal.lock must be held
+static void TFS_Driver_CheckpointLocked(TFS_Driver* self) {
+    int* homes;
+    int home_cnt = TFS_Journal_Checkpoint(&self->journal, &homes);
+    // committed cached copies that didn't change since are on their places now
+    pthread_mutex_lock(&self->cache_lock);
+    for (int i = 0; i < home_cnt; ++i) {
+        TFS_CacheEntry* entry = TFS_BlockCache_Peek(&self->cache, homes[i]);
+        if (entry != NULL && entry->dirty && !entry->held) {
+            entry->dirty = false;
+        }
+    }
+    pthread_mutex_unlock(&self->cache_lock);
+    free(homes);
+}
+
+// txn_lock must be held exclusively, so no operation is halfway through
+static void TFS_Driver_CommitLocked(TFS_Driver* self) {
+    if (!self->journaling) {
+        return;
+    }
+    TFS_SpaceMap* maps[2] = { &self->inode_map, &self->data_map };
+
+    // snapshot of changed bitmap blocks and held cached blocks, ascending
+    pthread_mutex_lock(&self->map_lock);
+    pthread_mutex_lock(&self->cache_lock);
+    int cnt = self->cache.held_cnt;
+    for (int m = 0; m < 2; ++m) {
+        for (int b = 0; b < maps[m]->blocks; ++b) {
+            cnt += maps[m]->dirty[b];
+        }
+    }
+    int* homes = malloc(sizeof(int) * (cnt + 1));
+    char* data = malloc((size_t)(cnt + 1) * TFS_SECTOR_SIZE);
+    TFS_CacheEntry** held = malloc(sizeof(TFS_CacheEntry*) * (self->cache.held_cnt + 1));
+    int held_cnt = self->cache.held_cnt;
+    int pos = 0;
+    for (int m = 0; m < 2; ++m) {
+        for (int b = 0; b < maps[m]->blocks; ++b) {
+            if (maps[m]->dirty[b]) {
+                maps[m]->dirty[b] = false;
+                homes[pos] = maps[m]->first_block + b;
+                memcpy(data + (size_t)pos * TFS_SECTOR_SIZE, maps[m]->bits + (size_t)b * TFS_SECTOR_SIZE, TFS_SECTOR_SIZE);
+                // bitmap block read through the cache must not go stale
+                TFS_CacheEntry* entry = TFS_BlockCache_Peek(&self->cache, homes[pos]);
+                if (entry != NULL) {
+                    memcpy(entry->data, data + (size_t)pos * TFS_SECTOR_SIZE, TFS_SECTOR_SIZE);
+                }
+                ++pos;
+            }
+        }
+    }
+    TFS_BlockCache_GetHeld(&self->cache, held);
+    for (int i = 0; i < held_cnt; ++i) {
+        homes[pos] = held[i]->block_idx;
+        memcpy(data + (size_t)pos++ * TFS_SECTOR_SIZE, held[i]->data, TFS_SECTOR_SIZE);
+    }
+    pthread_mutex_unlock(&self->cache_lock);
+    pthread_mutex_unlock(&self->map_lock);
+
+    bool logged = true;
+    pthread_mutex_lock(&self->journal.lock);
+    if (cnt > 0 || self->journal.revoke_cnt > 0) {
+        if (!TFS_Journal_Fits(&self->journal, cnt)) {
+            TFS_Driver_CheckpointLocked(self);
+        }
+        if (TFS_Journal_Fits(&self->journal, cnt)) {
+            TFS_Journal_Commit(&self->journal, homes, data, cnt);
+        } else {
+            // larger than the whole log: written in place, not atomically
+            logged = false;
+            for (int i = 0; i < cnt;) {
+                int end = i + 1;
+                while (end < cnt && homes[end] == homes[end - 1] + 1) {
+                    ++end;
+                }
+                self->backend.ops->write_blocks(&self->backend, homes[i], end - i, data + (size_t)i * TFS_SECTOR_SIZE);
+                i = end;
+            }
+            self->backend.ops->sync(&self->backend);
+        }
+    }
+    pthread_mutex_unlock(&self->journal.lock);
+
+    // logged blocks may be written back to their places from now on
+    pthread_mutex_lock(&self->cache_lock);
+    for (int i = 0; i < held_cnt; ++i) {
+        TFS_BlockCache_SetHeld(&self->cache, held[i], false);
+        held[i]->dirty = logged;
+    }
+    TFS_BlockCache_Trim(&self->cache);
+    pthread_mutex_unlock(&self->cache_lock);
+    free(held);
+    free(data);
+    free(homes);
+}
+
+void TFS_Driver_Commit(TFS_Driver* self) {
+    pthread_rwlock_wrlock(&self->txn_lock);
+    TFS_Driver_CommitLocked(self);
+    pthread_rwlock_unlock(&self->txn_lock);
+}
+
+void TFS_Driver_BeginOp(TFS_Driver* self) {
+    assert(TFS_current_txn == NULL); // operations don't nest
+    pthread_rwlock_rdlock(&self->txn_lock);
+    TFS_Txn* txn = calloc(1, sizeof(TFS_Txn));
+    txn->driver = self;
+    TFS_current_txn = txn;
+}
+
+void TFS_Driver_EndOp(TFS_Driver* self) {
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    assert(txn != NULL);
+    // normally flushed already by unlocking
+    TFS_Driver_FlushTxn(self, txn);
+    TFS_current_txn = NULL;
+    free(txn->blocks);
+    free(txn->parts);
+    free(txn->data);
+    free(txn);
+    pthread_rwlock_unlock(&self->txn_lock);
+    if (!self->journaling) {
+        return;
+    }
+    // held blocks can't be evicted, don't let them take over the cache
+    pthread_mutex_lock(&self->cache_lock);
+    bool full = self->cache.held_cnt >= self->cache.capacity / 2;
+    pthread_mutex_unlock(&self->cache_lock);
+    if (full) {
+        TFS_Driver_Commit(self);
+    }
+}
+
+// commits every TFS_COMMIT_INTERVAL_MS, checkpoints once the log is half full
+static void* TFS_Driver_CommitterMain(void* arg) {
+    TFS_Driver* self = arg;
+    pthread_mutex_lock(&self->committer_lock);
+    while (!self->committer_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TFS_COMMIT_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (long)(TFS_COMMIT_INTERVAL_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&self->committer_cond, &self->committer_lock, &deadline);
+        if (self->committer_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&self->committer_lock);
+
+        pthread_rwlock_wrlock(&self->txn_lock);
+        if (self->journaling) {
+            TFS_Driver_CommitLocked(self);
+            pthread_mutex_lock(&self->journal.lock);
+            if (self->journal.head > self->journal.blocks / 2) {
+                TFS_Driver_CheckpointLocked(self);
+            }
+            pthread_mutex_unlock(&self->journal.lock);
+        }
+        pthread_rwlock_unlock(&self->txn_lock);
+
+        pthread_mutex_lock(&self->committer_lock);
+    }
+    pthread_mutex_unlock(&self->committer_lock);
+    return NULL;
+}
+
+// txn_lock must be held exclusively
+static void TFS_Driver_SyncLocked(TFS_Driver* self) {
+    if (self->journaling) {
+        // bitmaps go to their places through the log
+        TFS_Driver_CommitLocked(self);
+        pthread_mutex_lock(&self->journal.lock);
+        TFS_Driver_CheckpointLocked(self);
+        pthread_mutex_unlock(&self->journal.lock);
+    } else {
+        pthread_mutex_lock(&self->map_lock);
+        TFS_Driver_WriteBackMap(self, &self->inode_map);
+        TFS_Driver_WriteBackMap(self, &self->data_map);
+        pthread_mutex_unlock(&self->map_lock);
+    }
+    pthread_mutex_lock(&self->cache_lock);
+    TFS_BlockCache_Flush(&self->cache);
+    pthread_mutex_unlock(&self->cache_lock);
+    self->backend.ops->sync(&self->backend);
+}
+
+void TFS_Driver_Sync(TFS_Driver* self) {
+    pthread_rwlock_wrlock(&self->txn_lock);
+    TFS_Driver_SyncLocked(self);
+    pthread_rwlock_unlock(&self->txn_lock);
+}
+
+void TFS_Driver_SetCacheSize(TFS_Driver* self, int blocks) {
+    pthread_rwlock_wrlock(&self->txn_lock);
+    TFS_Driver_SyncLocked(self);
+    pthread_mutex_lock(&self->cache_lock);
+    TFS_BlockCache_Flush(&self->cache);
+    TFS_BlockCache_Destruct(&self->cache);
+    TFS_BlockCache_Init(&self->cache, blocks, TFS_Driver_CacheWriteBack, self);
+    pthread_mutex_unlock(&self->cache_lock);
+    TFS_Driver_UpdateJournaling(self);
+    pthread_rwlock_unlock(&self->txn_lock);
+}
+
+void TFS_Driver_SetCompression(TFS_Driver* self, bool enabled) {
+    // operations in progress finish with the old setting
+    pthread_rwlock_wrlock(&self->txn_lock);
+    self->compress = enabled;
+    pthread_rwlock_unlock(&self->txn_lock);
 }
 
 void TFS_Driver_ReadBlock(TFS_Driver* self, int block_idx, void* buf) {
-    int offset = block_idx * TFS_SECTOR_SIZE;
-    fseek(self->file, offset, SEEK_SET);
-    int read = fread(buf, TFS_SECTOR_SIZE, 1, self->file);
-    assert(read == 1);
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    int slot = txn != NULL ? TFS_Txn_Find(txn, block_idx) : -1;
+    if (slot == -1 || txn->parts[slot] != TFS_TXN_WHOLE_BLOCK) {
+        TFS_Driver_ReadBlockShared(self, block_idx, buf);
+    }
+    if (slot != -1) {
+        TFS_Txn_Overlay(txn, slot, buf);
+    }
+}
+
+// block as other threads see it: from cache or image, ignoring the operation's batch
+static void TFS_Driver_ReadBlockShared(TFS_Driver* self, int block_idx, void* buf) {
+    if (self->cache.capacity == 0) {
+        TFS_Driver_ReadBlockRaw(self, block_idx, buf);
+        return;
+    }
+    pthread_mutex_lock(&self->cache_lock);
+    TFS_CacheEntry* entry = TFS_BlockCache_Lookup(&self->cache, block_idx);
+    if (entry != NULL) {
+        ++self->cache.hits;
+        memcpy(buf, entry->data, TFS_SECTOR_SIZE);
+        pthread_mutex_unlock(&self->cache_lock);
+        return;
+    }
+    ++self->cache.misses;
+    pthread_mutex_unlock(&self->cache_lock);
+
+    // miss is read without holding the cache, so readers of other blocks don't wait for it
+    TFS_Driver_ReadBlockRaw(self, block_idx, buf);
+
+    pthread_mutex_lock(&self->cache_lock);
+    entry = TFS_BlockCache_Peek(&self->cache, block_idx);
+    if (entry != NULL) {
+        // cached meanwhile, that copy is at least as new
+        memcpy(buf, entry->data, TFS_SECTOR_SIZE);
+    } else {
+        entry = TFS_BlockCache_Insert(&self->cache, block_idx);
+        memcpy(entry->data, buf, TFS_SECTOR_SIZE);
+    }
+    pthread_mutex_unlock(&self->cache_lock);
 }
 
 void TFS_Driver_WriteBlock(TFS_Driver* self, int block_idx, const void* buf) {
-    int offset = block_idx * TFS_SECTOR_SIZE;
-    fseek(self->file, offset, SEEK_SET);
-    int written = fwrite(buf, TFS_SECTOR_SIZE, 1, self->file);
-    assert(written == 1);
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    if (txn != NULL) {
+        // rewrites within the operation only replace the batched copy
+        int slot = TFS_Txn_Find(txn, block_idx);
+        if (slot == -1) {
+            slot = TFS_Txn_Add(txn, block_idx);
+        }
+        memcpy(TFS_Txn_Data(txn, slot), buf, TFS_SECTOR_SIZE);
+        txn->parts[slot] = TFS_TXN_WHOLE_BLOCK;
+        return;
+    }
+    if (self->cache.capacity == 0) {
+        TFS_Driver_WriteBlockRaw(self, block_idx, buf);
+        return;
+    }
+    pthread_mutex_lock(&self->cache_lock);
+    TFS_Driver_CacheWriteLocked(self, block_idx, buf);
+    pthread_mutex_unlock(&self->cache_lock);
+}
+
+// batched copies are newer than anything in cache or on disk
+static void TFS_Driver_OverlayTxn(TFS_Driver* self, int block_idx, int cnt, char* buf) {
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    for (int i = 0; txn != NULL && i < txn->cnt; ++i) {
+        if (block_idx <= txn->blocks[i] && txn->blocks[i] < block_idx + cnt) {
+            TFS_Txn_Overlay(txn, i, buf + (size_t)(txn->blocks[i] - block_idx) * TFS_SECTOR_SIZE);
+        }
+    }
+}
+
+void TFS_Driver_ReadBlocks(TFS_Driver* self, int block_idx, int cnt, void* buf) {
+    if (cnt == 1) {
+        TFS_Driver_ReadBlock(self, block_idx, buf);
+        return;
+    }
+    // one I/O for the whole run, then overlay blocks that are newer in cache
+    // (don't populate cache: large runs are file data read once)
+    self->backend.ops->read_blocks(&self->backend, block_idx, cnt, buf);
+    if (self->cache.capacity != 0) {
+        pthread_mutex_lock(&self->cache_lock);
+        for (int i = 0; i < cnt; ++i) {
+            TFS_CacheEntry* entry = TFS_BlockCache_Peek(&self->cache, block_idx + i);
+            if (entry != NULL && entry->dirty) {
+                memcpy((char*)buf + (size_t)i * TFS_SECTOR_SIZE, entry->data, TFS_SECTOR_SIZE);
+            }
+        }
+        pthread_mutex_unlock(&self->cache_lock);
+    }
+    TFS_Driver_OverlayTxn(self, block_idx, cnt, buf);
+}
+
+void TFS_Driver_WriteBlocks(TFS_Driver* self, int block_idx, int cnt, const void* buf) {
+    if (cnt == 1) {
+        TFS_Driver_WriteBlock(self, block_idx, buf);
+        return;
+    }
+    if (self->journaling) {
+        // written in place, older copies in the log must not be replayed over it
+        TFS_Journal_Revoke(&self->journal, block_idx, cnt);
+    }
+    self->backend.ops->write_blocks(&self->backend, block_idx, cnt, buf);
+    // batched copies in range would overwrite it when the operation is flushed
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    for (int i = 0; txn != NULL && i < txn->cnt; ++i) {
+        if (block_idx <= txn->blocks[i] && txn->blocks[i] < block_idx + cnt) {
+            memcpy(TFS_Txn_Data(txn, i), (const char*)buf + (size_t)(txn->blocks[i] - block_idx) * TFS_SECTOR_SIZE, TFS_SECTOR_SIZE);
+        }
+    }
+    if (self->cache.capacity == 0) {
+        return;
+    }
+    // keep cached copies in sync, they are on disk now
+    pthread_mutex_lock(&self->cache_lock);
+    for (int i = 0; i < cnt; ++i) {
+        TFS_CacheEntry* entry = TFS_BlockCache_Peek(&self->cache, block_idx + i);
+        if (entry != NULL) {
+            memcpy(entry->data, (const char*)buf + (size_t)i * TFS_SECTOR_SIZE, TFS_SECTOR_SIZE);
+            entry->dirty = false;
+            TFS_BlockCache_SetHeld(&self->cache, entry, false);
+        }
+    }
+    pthread_mutex_unlock(&self->cache_lock);
+}
+
+const void* TFS_Driver_MapBlock(TFS_Driver* self, int block_idx) {
+    // blocks batched by the operation in progress are newer than the mapping
+    if (self->backend.ops->map_block == NULL || self->cache.capacity != 0 || TFS_Driver_GetTxn(self) != NULL) {
+        return NULL;
+    }
+    return self->backend.ops->map_block(&self->backend, block_idx);
 }
 
 int TFS_Driver_GetInodeBlockIdx(TFS_Driver* self, int inode_idx) {
-    (void)self; // unused
     assert(inode_idx);
-    return 3 + inode_idx - 1;
+    return self->super_block.inode_start + (inode_idx - 1) / TFS_INODES_PER_BLOCK;
+}
+
+// position of the inode inside its' block
+static int TFS_Inode_GetPart(int inode_idx) {
+    return (inode_idx - 1) % TFS_INODES_PER_BLOCK;
 }
 
 void TFS_Driver_GetInode(TFS_Driver* self, int inode_idx, TFS_Inode* inode) {
     int block_idx = TFS_Driver_GetInodeBlockIdx(self, inode_idx);
-    TFS_Driver_ReadBlock(self, block_idx, inode);
+    TFS_Inode block[TFS_INODES_PER_BLOCK];
+    TFS_Driver_ReadBlock(self, block_idx, block);
+    *inode = block[TFS_Inode_GetPart(inode_idx)];
     assert(inode->inode_idx == inode_idx);
 }
 
+const TFS_Inode* TFS_Driver_MapInode(TFS_Driver* self, int inode_idx) {
+    const TFS_Inode* block = TFS_Driver_MapBlock(self, TFS_Driver_GetInodeBlockIdx(self, inode_idx));
+    const TFS_Inode* inode = block != NULL ? &block[TFS_Inode_GetPart(inode_idx)] : NULL;
+    assert(inode == NULL || inode->inode_idx == inode_idx);
+    return inode;
+}
+
 void TFS_Driver_PutInode(TFS_Driver* self, int inode_idx, const TFS_Inode* inode) {
     int block_idx = TFS_Driver_GetInodeBlockIdx(self, inode_idx);
-    TFS_Driver_WriteBlock(self, block_idx, inode);
+    int part = TFS_Inode_GetPart(inode_idx);
+    TFS_Txn* txn = TFS_Driver_GetTxn(self);
+    if (txn != NULL) {
+        // the rest of the block is merged in when the operation is flushed
+        int slot = TFS_Txn_Find(txn, block_idx);
+        if (slot == -1) {
+            slot = TFS_Txn_Add(txn, block_idx);
+        }
+        memcpy(TFS_Txn_Data(txn, slot) + part * TFS_INODE_SIZE, inode, TFS_INODE_SIZE);
+        txn->parts[slot] |= 1u << part;
+    } else {
+        TFS_Inode block[TFS_INODES_PER_BLOCK];
+        pthread_mutex_lock(&self->inode_table_lock);
+        TFS_Driver_ReadBlock(self, block_idx, block);
+        block[part] = *inode;
+        TFS_Driver_WriteBlock(self, block_idx, block);
+        pthread_mutex_unlock(&self->inode_table_lock);
+    }
+    __atomic_add_fetch(&self->inode_gens[inode_idx], 1, __ATOMIC_RELEASE);
+}
+
+uint32_t TFS_Driver_GetInodeGen(TFS_Driver* self, int inode_idx) {
+    return __atomic_load_n(&self->inode_gens[inode_idx], __ATOMIC_ACQUIRE);
 }
 
 int TFS_Driver_FindFreeInodeIdx(TFS_Driver* self) {
-    int result0;
-    TFS_Driver_ReadBlock(self, TFS_INODEMAP_BLOCK_IDX, block_buf);
-    TFS_Bitmap_FindFree(block_buf, self->super_block.inode_map_size, &result0, 1);
+    pthread_mutex_lock(&self->map_lock);
+    int result0 = TFS_SpaceMap_FindNext(&self->inode_map, 0, false);
+    pthread_mutex_unlock(&self->map_lock);
+    assert(result0 < self->inode_map.size * 8);
     ++result0;
     return result0;
 }
@@ -195,16 +1099,17 @@ void TFS_Driver_GetFreeInode(TFS_Driver* self, TFS_Inode* inode) {
 }
 
 void TFS_Driver_SetInodeOccupied(TFS_Driver* self, int inode_idx, bool occupied) {
-    char* inode_map = malloc(TFS_SECTOR_SIZE);
-    int inode_idx0 = inode_idx - 1;
-    TFS_Driver_ReadBlock(self, TFS_INODEMAP_BLOCK_IDX, inode_map);
-    TFS_Bitmap_SetBits(inode_map, self->super_block.inode_map_size, &inode_idx0, 1, occupied);
-    TFS_Driver_WriteBlock(self, TFS_INODEMAP_BLOCK_IDX, inode_map);
-    free(inode_map);
+    pthread_mutex_lock(&self->map_lock);
+    TFS_SpaceMap_SetRange(&self->inode_map, inode_idx - 1, 1, occupied);
+    pthread_mutex_unlock(&self->map_lock);
 }
 
 void TFS_Driver_FreeInode(TFS_Driver* self, TFS_Inode* inode) {
     TFS_Driver_SetInodeOccupied(self, inode->inode_idx, false);
+    if (inode->type == TFS_INODE_DIR) {
+        // idx may be reused by a new dir
+        TFS_Driver_DentryInvalidateParent(self, inode->inode_idx);
+    }
 
     inode->type = TFS_INODE_FREE;
     TFS_Driver_PutInode(self, inode->inode_idx, inode);
@@ -220,7 +1125,7 @@ void TFS_Driver_FreeInodeByIdx(TFS_Driver* self, int inode_idx) {
 
 int TFS_Driver_GetDataBlockIdx(TFS_Driver* self, int data_idx) {
     assert(data_idx);
-    return 3 + 8 * self->super_block.inode_map_size + data_idx - 1;
+    return self->super_block.data_start + data_idx - 1;
 }
 
 void TFS_Driver_GetData(TFS_Driver* self, int data_idx, void* data) {
@@ -228,20 +1133,172 @@ void TFS_Driver_GetData(TFS_Driver* self, int data_idx, void* data) {
     TFS_Driver_ReadBlock(self, block_idx, data);
 }
 
+const void* TFS_Driver_MapData(TFS_Driver* self, int data_idx) {
+    return TFS_Driver_MapBlock(self, TFS_Driver_GetDataBlockIdx(self, data_idx));
+}
+
 void TFS_Driver_PutData(TFS_Driver* self, int data_idx, const void* data) {
     int block_idx = TFS_Driver_GetDataBlockIdx(self, data_idx);
     TFS_Driver_WriteBlock(self, block_idx, data);
 }
 
-int TFS_Driver_CreateInode(TFS_Driver* self, TFS_Inode* inode, enum TFS_InodeType type) {
-    TFS_Driver_GetFreeInode(self, inode);
-    inode->type = type;
+void TFS_Driver_SetDataBlockOccupied(TFS_Driver* self, int data_idx, bool occupied) {
+    pthread_mutex_lock(&self->map_lock);
+    TFS_SpaceMap_SetRange(&self->data_map, data_idx - 1, 1, occupied);
+    pthread_mutex_unlock(&self->map_lock);
+}
+
+void TFS_Driver_FreeDataBlockByIdx(TFS_Driver* self, int data_idx) {
+    TFS_Driver_SetDataBlockOccupied(self, data_idx, false);
+}
+
+static int TFS_Driver_DataMapBits(TFS_Driver* self) {
+    return self->data_map.size * 8;
+}
+
+// finds free run at or after from, returns its start (0-based) or -1
+static int TFS_Driver_FindFreeRun(TFS_Driver* self, int from, int* run_len) {
+    int begin = TFS_SpaceMap_FindNext(&self->data_map, from, false);
+    if (begin == TFS_Driver_DataMapBits(self)) {
+        return -1;
+    }
+    *run_len = TFS_SpaceMap_FindNext(&self->data_map, begin, true) - begin;
+    return begin;
+}
+
+static void TFS_Driver_TakeExtent(TFS_Driver* self, int begin0, int len, TFS_Extent* extent) {
+    TFS_SpaceMap_SetRange(&self->data_map, begin0, len, true);
+    extent->start = begin0 + 1;
+    extent->len = len;
+}
+
+static void TFS_Driver_FreeExtentsLocked(TFS_Driver* self, const TFS_Extent* extents, int cnt) {
+    for (int i = 0; i < cnt; ++i) {
+        TFS_SpaceMap_SetRange(&self->data_map, extents[i].start - 1, extents[i].len, false);
+    }
+}
+
+static int TFS_Driver_AllocExtentsLocked(TFS_Driver* self, int blocks, TFS_Extent* extents, int max_extents) {
+    int bits = TFS_Driver_DataMapBits(self);
+    if (blocks == 0) {
+        return 0;
+    }
+    if (self->data_map.free_total < blocks) {
+        return TFS_ENOSPACE;
+    }
+
+    // next fit: first run large enough, starting from where the previous allocation ended
+    int cursor = self->alloc_cursor < bits ? self->alloc_cursor : 0;
+    for (int pos = cursor, wrapped = 0; !(wrapped && pos >= cursor);) {
+        int run_len;
+        int begin = TFS_Driver_FindFreeRun(self, pos, &run_len);
+        if (begin == -1) {
+            if (wrapped) {
+                break;
+            }
+            wrapped = 1;
+            pos = 0;
+            continue;
+        }
+        if (run_len >= blocks) {
+            TFS_Driver_TakeExtent(self, begin, blocks, &extents[0]);
+            self->alloc_cursor = begin + blocks;
+            return 1;
+        }
+        pos = begin + run_len;
+    }
+
+    // no single run fits: take the largest runs first to keep extent count low
+    int extent_cnt = 0;
+    while (blocks > 0) {
+        if (extent_cnt == max_extents) {
+            TFS_Driver_FreeExtentsLocked(self, extents, extent_cnt);
+            return TFS_ENOSPACE;
+        }
+        int best_begin = -1, best_len = 0;
+        for (int pos = 0;;) {
+            int run_len;
+            int begin = TFS_Driver_FindFreeRun(self, pos, &run_len);
+            if (begin == -1) {
+                break;
+            }
+            if (run_len > best_len) {
+                best_begin = begin;
+                best_len = run_len;
+            }
+            pos = begin + run_len;
+        }
+        assert(best_begin != -1);
+        int len = TFS_Min(best_len, blocks);
+        TFS_Driver_TakeExtent(self, best_begin, len, &extents[extent_cnt++]);
+        self->alloc_cursor = best_begin + len;
+        blocks -= len;
+    }
+    return extent_cnt;
+}
+
+int TFS_Driver_AllocExtents(TFS_Driver* self, int blocks, TFS_Extent* extents, int max_extents) {
+    pthread_mutex_lock(&self->map_lock);
+    int extent_cnt = TFS_Driver_AllocExtentsLocked(self, blocks, extents, max_extents);
+    pthread_mutex_unlock(&self->map_lock);
+    return extent_cnt;
+}
+
+void TFS_Driver_FreeExtents(TFS_Driver* self, const TFS_Extent* extents, int cnt) {
+    pthread_mutex_lock(&self->map_lock);
+    TFS_Driver_FreeExtentsLocked(self, extents, cnt);
+    pthread_mutex_unlock(&self->map_lock);
+}
+
+int TFS_Driver_GetFreeInodeCnt(TFS_Driver* self) {
+    pthread_mutex_lock(&self->map_lock);
+    int result = self->inode_map.free_total;
+    pthread_mutex_unlock(&self->map_lock);
+    return result;
+}
+
+int TFS_Driver_GetFreeDataCnt(TFS_Driver* self) {
+    pthread_mutex_lock(&self->map_lock);
+    int result = self->data_map.free_total;
+    pthread_mutex_unlock(&self->map_lock);
+    return result;
+}
+
+void TFS_Driver_GetFragStats(TFS_Driver* self, TFS_FragStats* stats) {
+    pthread_mutex_lock(&self->map_lock);
+    stats->free_blocks = 0;
+    stats->free_runs = 0;
+    stats->largest_free_run = 0;
+    for (int pos = 0;;) {
+        int run_len;
+        int begin = TFS_Driver_FindFreeRun(self, pos, &run_len);
+        if (begin == -1) {
+            break;
+        }
+        stats->free_blocks += run_len;
+        ++stats->free_runs;
+        if (run_len > stats->largest_free_run) {
+            stats->largest_free_run = run_len;
+        }
+        pos = begin + run_len;
+    }
+    pthread_mutex_unlock(&self->map_lock);
+    stats->fragmentation = stats->free_blocks == 0 ? 0 : 1 - (double)stats->largest_free_run / stats->free_blocks;
+}
+
+int TFS_Driver_CreateInode(TFS_Driver* self, TFS_Inode* inode, enum TFS_InodeType type) {
+    TFS_Driver_GetFreeInode(self, inode);
+    inode->type = type;
+    inode->flags = 0;
     switch (type) {
         case TFS_INODE_DIR:
             inode->dir.children_cnt = 0;
+            inode->dir.bucket_cnt = 0;
+            inode->dir.hash_level = 0;
+            inode->dir.split_idx = 0;
             break;
         case TFS_INODE_FILE:
-            inode->file.file_size = 0;
+            TFS_Inode_File_InitInline(&inode->file);
             break;
         default:
             assert(false);
@@ -255,17 +1312,398 @@ int TFS_Driver_CreateChildInode(TFS_Driver* self, TFS_Inode* parent, TFS_Inode*
     if (parent->type != TFS_INODE_DIR) {
         return TFS_ENOENT;
     }
-    TFS_Driver_CreateInode(self, child, type); // assign child
-    if (TFS_Inode_Dir_FindChildIdx(&parent->dir, name) != -1) {
-        return TFS_ENOENT;
+    if (TFS_Driver_DirLookup(self, parent, name) > 0) {
+        return TFS_EEXISTS;
     }
-    if (TFS_Inode_Dir_AppendChild(&parent->dir, child, name) == NULL) {
-        return TFS_ENOENT;
+    TFS_Driver_CreateInode(self, child, type); // assign child
+    int insert_code = TFS_Driver_DirInsert(self, parent, name, child->inode_idx);
+    if (insert_code <= 0) {
+        TFS_Driver_FreeInode(self, child);
+        return insert_code;
     }
     TFS_Driver_PutInode(self, parent->inode_idx, parent);
     return child->inode_idx;
 }
 
+// hashed directories
+
+_Static_assert(TFS_MAX_DIR_INODE_CHILDREN <= TFS_DIR_BUCKET_ENTRIES, "inline entries must fit into one bucket");
+
+// FNV-1a
+static uint32_t TFS_Dir_Hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+static int TFS_Dir_BucketOf(const TFS_Inode_Dir* dir, uint32_t hash) {
+    uint32_t bucket = hash & ((1u << dir->hash_level) - 1);
+    if ((int)bucket < dir->split_idx) {
+        bucket = hash & ((2u << dir->hash_level) - 1);
+    }
+    return bucket;
+}
+
+static int TFS_DirBucket_FindIdx(const TFS_DirBucket* bucket, const char* name) {
+    for (int i = 0; i < bucket->entry_cnt; ++i) {
+        if (strcmp(bucket->entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// bucket table of hashed dir, mapped or read into buf
+static const TFS_DirBucketTable* TFS_Driver_DirGetTable(TFS_Driver* self, const TFS_Inode_Dir* dir, TFS_DirBucketTable* buf) {
+    const TFS_DirBucketTable* table = TFS_Driver_MapData(self, dir->bucket_table);
+    if (table == NULL) {
+        TFS_Driver_GetData(self, dir->bucket_table, buf);
+        table = buf;
+    }
+    return table;
+}
+
+// data idx of bucket bucket_i
+static int TFS_Driver_DirGetBucket(TFS_Driver* self, const TFS_Inode_Dir* dir, int bucket_i) {
+    TFS_DirBucketTable* buf = malloc(sizeof(TFS_DirBucketTable));
+    int data_idx = TFS_Driver_DirGetTable(self, dir, buf)->buckets[bucket_i];
+    free(buf);
+    return data_idx;
+}
+
+static int TFS_Driver_DirLookupUncached(TFS_Driver* self, const TFS_Inode_Dir* dir, const char* name) {
+    if (dir->bucket_cnt == 0) {
+        int idx = TFS_Inode_Dir_FindChildIdx(dir, name);
+        return idx != -1 ? dir->entries[idx].inode_idx : TFS_ENOENT;
+    }
+
+    int data_idx = TFS_Driver_DirGetBucket(self, dir, TFS_Dir_BucketOf(dir, TFS_Dir_Hash(name)));
+    const TFS_DirBucket* bucket = TFS_Driver_MapData(self, data_idx);
+    TFS_DirBucket* copy = NULL;
+    if (bucket == NULL) {
+        copy = malloc(sizeof(TFS_DirBucket));
+        TFS_Driver_GetData(self, data_idx, copy);
+        bucket = copy;
+    }
+    int idx = TFS_DirBucket_FindIdx(bucket, name);
+    int result = idx != -1 ? bucket->entries[idx].inode_idx : TFS_ENOENT;
+    free(copy);
+    return result;
+}
+
+int TFS_Driver_DirLookup(TFS_Driver* self, const TFS_Inode* dir_inode, const char* name) {
+    int child_idx;
+    if (TFS_Driver_DentryLookup(self, dir_inode->inode_idx, name, &child_idx)) {
+        return child_idx > 0 ? child_idx : TFS_ENOENT;
+    }
+    child_idx = TFS_Driver_DirLookupUncached(self, &dir_inode->dir, name);
+    TFS_Driver_DentrySet(self, dir_inode->inode_idx, name, child_idx > 0 ? child_idx : 0);
+    return child_idx;
+}
+
+static int TFS_Driver_AllocDirBucket(TFS_Driver* self) {
+    TFS_Extent extent;
+    if (TFS_Driver_AllocExtents(self, 1, &extent, 1) != 1) {
+        return TFS_ENOSPACE;
+    }
+    return extent.start;
+}
+
+// moves inline entries into the first bucket, listed by a new bucket table
+static int TFS_Driver_DirMakeHashed(TFS_Driver* self, TFS_Inode_Dir* dir) {
+    int table_idx = TFS_Driver_AllocDirBucket(self);
+    if (table_idx <= 0) {
+        return table_idx;
+    }
+    int data_idx = TFS_Driver_AllocDirBucket(self);
+    if (data_idx <= 0) {
+        TFS_Driver_FreeDataBlockByIdx(self, table_idx);
+        return data_idx;
+    }
+    TFS_DirBucket* bucket = malloc(sizeof(TFS_DirBucket));
+    memset(bucket, 0, sizeof(TFS_DirBucket));
+    bucket->entry_cnt = dir->children_cnt;
+    memcpy(bucket->entries, dir->entries, sizeof(TFS_Inode_DirEnt) * dir->children_cnt);
+    TFS_Driver_PutData(self, data_idx, bucket);
+    free(bucket);
+    TFS_DirBucketTable* table = calloc(1, sizeof(TFS_DirBucketTable));
+    table->buckets[0] = data_idx;
+    TFS_Driver_PutData(self, table_idx, table);
+    free(table);
+
+    memset(dir->entries, 0, sizeof(dir->entries));
+    dir->bucket_table = table_idx;
+    dir->bucket_cnt = 1;
+    dir->hash_level = 0;
+    dir->split_idx = 0;
+    return TFS_ESUCC;
+}
+
+// splits bucket split_idx between itself and new bucket 2^hash_level + split_idx
+static int TFS_Driver_DirSplit(TFS_Driver* self, TFS_Inode_Dir* dir) {
+    if (dir->bucket_cnt == TFS_DIR_MAX_BUCKETS) {
+        return TFS_ENOSPACE;
+    }
+    int new_data_idx = TFS_Driver_AllocDirBucket(self);
+    if (new_data_idx <= 0) {
+        return new_data_idx;
+    }
+    int old_i = dir->split_idx;
+    int new_i = (1 << dir->hash_level) + old_i;
+    assert(new_i == dir->bucket_cnt);
+
+    TFS_DirBucketTable* table = malloc(sizeof(TFS_DirBucketTable));
+    TFS_Driver_GetData(self, dir->bucket_table, table);
+    TFS_DirBucket* buckets = malloc(sizeof(TFS_DirBucket) * 2);
+    TFS_DirBucket* old_bucket = buckets;
+    TFS_DirBucket* new_bucket = buckets + 1;
+    TFS_Driver_GetData(self, table->buckets[old_i], old_bucket);
+    memset(new_bucket, 0, sizeof(TFS_DirBucket));
+
+    uint32_t mask = (2u << dir->hash_level) - 1;
+    int kept = 0;
+    for (int i = 0; i < old_bucket->entry_cnt; ++i) {
+        TFS_Inode_DirEnt entry = old_bucket->entries[i];
+        if ((TFS_Dir_Hash(entry.name) & mask) == (uint32_t)old_i) {
+            old_bucket->entries[kept++] = entry;
+        } else {
+            new_bucket->entries[new_bucket->entry_cnt++] = entry;
+        }
+    }
+    memset(&old_bucket->entries[kept], 0, sizeof(TFS_Inode_DirEnt) * (old_bucket->entry_cnt - kept));
+    old_bucket->entry_cnt = kept;
+    TFS_Driver_PutData(self, table->buckets[old_i], old_bucket);
+    TFS_Driver_PutData(self, new_data_idx, new_bucket);
+    free(buckets);
+    table->buckets[new_i] = new_data_idx;
+    TFS_Driver_PutData(self, dir->bucket_table, table);
+    free(table);
+
+    ++dir->bucket_cnt;
+    if (++dir->split_idx == 1 << dir->hash_level) {
+        ++dir->hash_level;
+        dir->split_idx = 0;
+    }
+    return TFS_ESUCC;
+}
+
+int TFS_Driver_DirInsert(TFS_Driver* self, TFS_Inode* dir_inode, const char* name, int child_idx) {
+    TFS_Inode_Dir* dir = &dir_inode->dir;
+    if (strlen(name) + 1 > sizeof(dir->entries[0].name)) {
+        return TFS_ENAMETOOLONG;
+    }
+    if (TFS_Driver_DirLookup(self, dir_inode, name) > 0) {
+        return TFS_EEXISTS;
+    }
+
+    if (dir->bucket_cnt == 0) {
+        if (dir->children_cnt < TFS_MAX_DIR_INODE_CHILDREN) {
+            TFS_Inode_DirEnt* entry = &dir->entries[dir->children_cnt++];
+            entry->inode_idx = child_idx;
+            strcpy(entry->name, name);
+            TFS_Driver_DentrySet(self, dir_inode->inode_idx, name, child_idx);
+            return TFS_ESUCC;
+        }
+        int convert_code = TFS_Driver_DirMakeHashed(self, dir);
+        if (convert_code <= 0) {
+            return convert_code;
+        }
+    }
+
+    // full bucket is not chained: buckets get split in order until the target one has room
+    uint32_t hash = TFS_Dir_Hash(name);
+    TFS_DirBucket* bucket = malloc(sizeof(TFS_DirBucket));
+    while (true) {
+        int data_idx = TFS_Driver_DirGetBucket(self, dir, TFS_Dir_BucketOf(dir, hash));
+        TFS_Driver_GetData(self, data_idx, bucket);
+        if (bucket->entry_cnt < TFS_DIR_BUCKET_ENTRIES) {
+            TFS_Inode_DirEnt* entry = &bucket->entries[bucket->entry_cnt++];
+            entry->inode_idx = child_idx;
+            memset(entry->name, 0, sizeof(entry->name));
+            strcpy(entry->name, name);
+            TFS_Driver_PutData(self, data_idx, bucket);
+            ++dir->children_cnt;
+            free(bucket);
+            TFS_Driver_DentrySet(self, dir_inode->inode_idx, name, child_idx);
+            return TFS_ESUCC;
+        }
+        int split_code = TFS_Driver_DirSplit(self, dir);
+        if (split_code <= 0) {
+            free(bucket);
+            return split_code;
+        }
+    }
+}
+
+int TFS_Driver_DirRemove(TFS_Driver* self, TFS_Inode* dir_inode, const char* name) {
+    TFS_Inode_Dir* dir = &dir_inode->dir;
+    if (dir->bucket_cnt == 0) {
+        int idx = TFS_Inode_Dir_FindChildIdx(dir, name);
+        if (idx == -1) {
+            return TFS_ENOENT;
+        }
+        int child_idx = dir->entries[idx].inode_idx;
+        TFS_Inode_Dir_DeleteChildAt(dir, idx);
+        TFS_Driver_DentrySet(self, dir_inode->inode_idx, name, 0);
+        return child_idx;
+    }
+
+    int data_idx = TFS_Driver_DirGetBucket(self, dir, TFS_Dir_BucketOf(dir, TFS_Dir_Hash(name)));
+    TFS_DirBucket* bucket = malloc(sizeof(TFS_DirBucket));
+    TFS_Driver_GetData(self, data_idx, bucket);
+    int idx = TFS_DirBucket_FindIdx(bucket, name);
+    if (idx == -1) {
+        free(bucket);
+        return TFS_ENOENT;
+    }
+    int child_idx = bucket->entries[idx].inode_idx;
+    bucket->entries[idx] = bucket->entries[--bucket->entry_cnt];
+    memset(&bucket->entries[bucket->entry_cnt], 0, sizeof(TFS_Inode_DirEnt));
+    TFS_Driver_PutData(self, data_idx, bucket);
+    free(bucket);
+    TFS_Driver_DentrySet(self, dir_inode->inode_idx, name, 0);
+
+    if (--dir->children_cnt == 0) {
+        // empty dir goes back to inline format, so deleting it never leaks buckets
+        TFS_DirBucketTable* table = malloc(sizeof(TFS_DirBucketTable));
+        TFS_Driver_GetData(self, dir->bucket_table, table);
+        for (int i = 0; i < dir->bucket_cnt; ++i) {
+            TFS_Driver_FreeDataBlockByIdx(self, table->buckets[i]);
+        }
+        free(table);
+        TFS_Driver_FreeDataBlockByIdx(self, dir->bucket_table);
+        memset(dir->entries, 0, sizeof(dir->entries));
+        dir->bucket_cnt = 0;
+        dir->hash_level = 0;
+        dir->split_idx = 0;
+    }
+    return child_idx;
+}
+
+// next_cookies (may be NULL) gets the cookie resuming right after each entry
+static int TFS_Driver_ReadDirCookies(TFS_Driver* self, const TFS_Inode* dir_inode, int64_t* cookie, TFS_Inode_DirEnt* entries, int64_t* next_cookies, int max) {
+    const TFS_Inode_Dir* dir = &dir_inode->dir;
+    int cnt = 0;
+    if (dir->bucket_cnt == 0) {
+        while (cnt < max && *cookie < dir->children_cnt) {
+            entries[cnt] = dir->entries[(*cookie)++];
+            if (next_cookies != NULL) {
+                next_cookies[cnt] = *cookie;
+            }
+            ++cnt;
+        }
+        return cnt;
+    }
+
+    // cookie = bucket * TFS_DIR_BUCKET_ENTRIES + slot
+    TFS_DirBucketTable* table_buf = malloc(sizeof(TFS_DirBucketTable));
+    const TFS_DirBucketTable* table = TFS_Driver_DirGetTable(self, dir, table_buf);
+    TFS_DirBucket* copy = NULL;
+    while (cnt < max) {
+        int bucket_i = *cookie / TFS_DIR_BUCKET_ENTRIES;
+        int slot = *cookie % TFS_DIR_BUCKET_ENTRIES;
+        if (bucket_i >= dir->bucket_cnt) {
+            break;
+        }
+        const TFS_DirBucket* bucket = TFS_Driver_MapData(self, table->buckets[bucket_i]);
+        if (bucket == NULL) {
+            if (copy == NULL) {
+                copy = malloc(sizeof(TFS_DirBucket));
+            }
+            TFS_Driver_GetData(self, table->buckets[bucket_i], copy);
+            bucket = copy;
+        }
+        while (cnt < max && slot < bucket->entry_cnt) {
+            entries[cnt] = bucket->entries[slot++];
+            if (next_cookies != NULL) {
+                // slot past the end of bucket moves on to the next one
+                next_cookies[cnt] = (int64_t)bucket_i * TFS_DIR_BUCKET_ENTRIES + slot;
+            }
+            ++cnt;
+        }
+        if (slot >= bucket->entry_cnt) {
+            *cookie = (int64_t)(bucket_i + 1) * TFS_DIR_BUCKET_ENTRIES;
+        } else {
+            *cookie = (int64_t)bucket_i * TFS_DIR_BUCKET_ENTRIES + slot;
+        }
+    }
+    free(copy);
+    free(table_buf);
+    return cnt;
+}
+
+int TFS_Driver_ReadDirEntries(TFS_Driver* self, const TFS_Inode* dir_inode, int64_t* cookie, TFS_Inode_DirEnt* entries, int max) {
+    return TFS_Driver_ReadDirCookies(self, dir_inode, cookie, entries, NULL, max);
+}
+
+#define TFS_ATTR_READ_BLOCKS 16
+
+static int TFS_DirEntryPtr_CmpByIdx(const void* a, const void* b) {
+    int lhs = (*(const TFS_DirEntry* const*)a)->ent.inode_idx;
+    int rhs = (*(const TFS_DirEntry* const*)b)->ent.inode_idx;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+// fills type and size of entries, reading child inodes in block order,
+// each inode block once and consecutive ones in one I/O
+static void TFS_Driver_LoadDirEntryAttrs(TFS_Driver* self, TFS_DirEntry* entries, int cnt) {
+    TFS_DirEntry** sorted = malloc(sizeof(TFS_DirEntry*) * (cnt + 1));
+    for (int i = 0; i < cnt; ++i) {
+        sorted[i] = &entries[i];
+    }
+    qsort(sorted, cnt, sizeof(TFS_DirEntry*), TFS_DirEntryPtr_CmpByIdx);
+
+    TFS_Inode* inodes = NULL;
+    for (int i = 0; i < cnt;) {
+        int first_block = TFS_Driver_GetInodeBlockIdx(self, sorted[i]->ent.inode_idx);
+        int blocks = 1;
+        int run = 1;
+        while (i + run < cnt) {
+            int block = TFS_Driver_GetInodeBlockIdx(self, sorted[i + run]->ent.inode_idx);
+            if (block - first_block > blocks || block - first_block >= TFS_ATTR_READ_BLOCKS) {
+                break;
+            }
+            blocks = block - first_block + 1;
+            ++run;
+        }
+        // inodes of the run's blocks, starting from the first one in first_block
+        int base_idx = sorted[i]->ent.inode_idx - TFS_Inode_GetPart(sorted[i]->ent.inode_idx);
+        const TFS_Inode* run_inodes = TFS_Driver_MapInode(self, base_idx);
+        if (run_inodes == NULL) {
+            if (inodes == NULL) {
+                inodes = malloc(sizeof(TFS_Inode) * TFS_INODES_PER_BLOCK * TFS_ATTR_READ_BLOCKS);
+            }
+            TFS_Driver_ReadBlocks(self, first_block, blocks, inodes);
+            run_inodes = inodes;
+        }
+        for (int j = i; j < i + run; ++j) {
+            const TFS_Inode* inode = &run_inodes[sorted[j]->ent.inode_idx - base_idx];
+            assert(inode->inode_idx == sorted[j]->ent.inode_idx);
+            sorted[j]->type = inode->type;
+            sorted[j]->file_size = inode->type == TFS_INODE_FILE ? inode->file.file_size : 0;
+        }
+        i += run;
+    }
+    free(inodes);
+    free(sorted);
+}
+
+int TFS_Driver_ReadDirAttrs(TFS_Driver* self, const TFS_Inode* dir, int64_t* cookie, TFS_DirEntry* entries, int max) {
+    TFS_Inode_DirEnt* ents = malloc(sizeof(TFS_Inode_DirEnt) * (max + 1));
+    int64_t* next_cookies = malloc(sizeof(int64_t) * (max + 1));
+    int cnt = TFS_Driver_ReadDirCookies(self, dir, cookie, ents, next_cookies, max);
+    for (int i = 0; i < cnt; ++i) {
+        entries[i].ent = ents[i];
+        entries[i].next_cookie = next_cookies[i];
+    }
+    TFS_Driver_LoadDirEntryAttrs(self, entries, cnt);
+    free(next_cookies);
+    free(ents);
+    return cnt;
+}
+
 int TFS_Driver_ReadFile(TFS_Driver* self, TFS_Inode* inode, void* buf) {
     if (inode->type != TFS_INODE_FILE) {
         return TFS_ENOENT;
@@ -276,61 +1714,724 @@ int TFS_Driver_ReadFile(TFS_Driver* self, TFS_Inode* inode, void* buf) {
         return size;
     }
 
-    int blocks = TFS_CeilDiv(size, TFS_SECTOR_SIZE);
+    TFS_Driver_ReadFileRange(self, inode, 0, size, buf);
+    return size;
+}
+
+// index of the last entry with logical <= file_block; entries are sorted by logical
+#define TFS_LOWER_BOUND_LOGICAL(ARRAY, CNT, FILE_BLOCK, RESULT) \
+    do { \
+        int lo = 0, hi = (CNT); \
+        while (hi - lo > 1) { \
+            int mid = (lo + hi) / 2; \
+            if ((ARRAY)[mid].logical <= (FILE_BLOCK)) { \
+                lo = mid; \
+            } else { \
+                hi = mid; \
+            } \
+        } \
+        (RESULT) = lo; \
+    } while (0)
+
+static int TFS_FileExtent_Map(const TFS_FileExtent* extent, int file_block, int* run_len) {
+    assert(extent->logical <= file_block && file_block < extent->logical + extent->len);
+    *run_len = extent->logical + extent->len - file_block;
+    return extent->start + file_block - extent->logical;
+}
 
-    for (int i = 0, size_left = size; i < blocks; ++i, size_left -= TFS_SECTOR_SIZE) {
-        TFS_Driver_GetData(self, inode->file.used_blocks[i], block_buf);
-        memcpy(buf + i * TFS_SECTOR_SIZE, block_buf, TFS_Min(size_left, TFS_SECTOR_SIZE));
+int TFS_Driver_MapFileBlock(TFS_Driver* self, const TFS_Inode* inode, int file_block, int* run_len) {
+    const TFS_Inode_File* file = &inode->file;
+    assert(!TFS_Inode_File_IsInline(file) && !(inode->flags & TFS_INODE_COMPRESSED));
+    int i;
+    if (file->index_cnt == 0) {
+        TFS_LOWER_BOUND_LOGICAL(file->extents, file->extent_cnt, file_block, i);
+        return TFS_FileExtent_Map(&file->extents[i], file_block, run_len);
+    }
+
+    TFS_ExtentIndexBlock* index = malloc(sizeof(TFS_ExtentIndexBlock));
+    TFS_Driver_GetData(self, file->index_block, index);
+    TFS_LOWER_BOUND_LOGICAL(index->leaves, file->index_cnt, file_block, i);
+    int leaf_idx = index->leaves[i].data_idx;
+    free(index);
+    TFS_ExtentLeaf* leaf = malloc(sizeof(TFS_ExtentLeaf));
+    TFS_Driver_GetData(self, leaf_idx, leaf);
+    TFS_LOWER_BOUND_LOGICAL(leaf->extents, leaf->extent_cnt, file_block, i);
+    int data_idx = TFS_FileExtent_Map(&leaf->extents[i], file_block, run_len);
+    free(leaf);
+    return data_idx;
+}
+
+int TFS_Driver_LoadFileMap(TFS_Driver* self, const TFS_Inode* inode, TFS_FileExtent** extents) {
+    const TFS_Inode_File* file = &inode->file;
+    *extents = malloc(sizeof(TFS_FileExtent) * (file->extent_cnt + 1));
+    if (file->index_cnt <= 0) {
+        // no extents for inline files
+        memcpy(*extents, file->extents, sizeof(TFS_FileExtent) * file->extent_cnt);
+        return file->extent_cnt;
+    }
+
+    TFS_ExtentIndexBlock* index = malloc(sizeof(TFS_ExtentIndexBlock));
+    TFS_Driver_GetData(self, file->index_block, index);
+    TFS_ExtentLeaf* leaf = malloc(sizeof(TFS_ExtentLeaf));
+    int cnt = 0;
+    for (int i = 0; i < file->index_cnt; ++i) {
+        TFS_Driver_GetData(self, index->leaves[i].data_idx, leaf);
+        memcpy(*extents + cnt, leaf->extents, sizeof(TFS_FileExtent) * leaf->extent_cnt);
+        cnt += leaf->extent_cnt;
+    }
+    free(leaf);
+    free(index);
+    assert(cnt == file->extent_cnt);
+    return cnt;
+}
+
+static void TFS_Driver_FreeFileMapLeaves(TFS_Driver* self, TFS_Inode* inode) {
+    if (inode->file.index_cnt > 0) {
+        TFS_ExtentIndexBlock* index = malloc(sizeof(TFS_ExtentIndexBlock));
+        TFS_Driver_GetData(self, inode->file.index_block, index);
+        for (int i = 0; i < inode->file.index_cnt; ++i) {
+            TFS_Driver_FreeDataBlockByIdx(self, index->leaves[i].data_idx);
+        }
+        free(index);
+        TFS_Driver_FreeDataBlockByIdx(self, inode->file.index_block);
+    }
+    inode->file.index_cnt = 0;
+}
+
+int TFS_Driver_StoreFileMap(TFS_Driver* self, TFS_Inode* inode, const TFS_FileExtent* extents, int cnt) {
+    TFS_Driver_FreeFileMapLeaves(self, inode);
+    if (cnt <= TFS_INODE_EXTENTS) {
+        memcpy(inode->file.extents, extents, sizeof(TFS_FileExtent) * cnt);
+        inode->file.extent_cnt = cnt;
+        return TFS_ESUCC;
+    }
+
+    int leaf_cnt = TFS_CeilDiv(cnt, TFS_LEAF_EXTENTS);
+    if (leaf_cnt > TFS_INDEX_LEAVES) {
+        return TFS_ENOSPACE;
+    }
+    // the last one is the index block
+    TFS_Extent* leaf_blocks = malloc(sizeof(TFS_Extent) * (leaf_cnt + 1));
+    for (int i = 0; i <= leaf_cnt; ++i) {
+        if (TFS_Driver_AllocExtents(self, 1, &leaf_blocks[i], 1) != 1) {
+            TFS_Driver_FreeExtents(self, leaf_blocks, i);
+            free(leaf_blocks);
+            return TFS_ENOSPACE;
+        }
+    }
+
+    TFS_ExtentLeaf* leaf = malloc(sizeof(TFS_ExtentLeaf));
+    memset(leaf, 0, sizeof(TFS_ExtentLeaf));
+    TFS_ExtentIndexBlock* index = calloc(1, sizeof(TFS_ExtentIndexBlock));
+    for (int i = 0; i < leaf_cnt; ++i) {
+        const TFS_FileExtent* first = extents + i * TFS_LEAF_EXTENTS;
+        leaf->extent_cnt = TFS_Min(TFS_LEAF_EXTENTS, cnt - i * TFS_LEAF_EXTENTS);
+        memcpy(leaf->extents, first, sizeof(TFS_FileExtent) * leaf->extent_cnt);
+        TFS_Driver_PutData(self, leaf_blocks[i].start, leaf);
+
+        index->leaves[i].logical = first->logical;
+        index->leaves[i].data_idx = leaf_blocks[i].start;
+    }
+    TFS_Driver_PutData(self, leaf_blocks[leaf_cnt].start, index);
+    memset(inode->file.extents, 0, sizeof(inode->file.extents));
+    inode->file.index_block = leaf_blocks[leaf_cnt].start;
+    inode->file.index_cnt = leaf_cnt;
+    inode->file.extent_cnt = cnt;
+
+    free(index);
+    free(leaf);
+    free(leaf_blocks);
+    return TFS_ESUCC;
+}
+
+// releases data blocks of the extents
+static void TFS_Driver_FreeFileExtents(TFS_Driver* self, const TFS_FileExtent* extents, int cnt) {
+    pthread_mutex_lock(&self->map_lock);
+    for (int i = 0; i < cnt; ++i) {
+        TFS_SpaceMap_SetRange(&self->data_map, extents[i].start - 1, extents[i].len, false);
+    }
+    pthread_mutex_unlock(&self->map_lock);
+}
+
+// frees data blocks and leaf blocks of the file, leaving it empty
+static void TFS_Driver_FreeFileBlocks(TFS_Driver* self, TFS_Inode* inode) {
+    TFS_FileExtent* extents;
+    int cnt = TFS_Driver_LoadFileMap(self, inode, &extents);
+    TFS_Driver_FreeFileExtents(self, extents, cnt);
+    free(extents);
+
+    TFS_Driver_FreeFileMapLeaves(self, inode);
+    TFS_Inode_File_InitInline(&inode->file);
+    inode->flags &= ~TFS_INODE_COMPRESSED;
+}
+
+// file block -> data idx, see TFS_Driver_MapFileBlock
+typedef int (*TFS_BlockMapFn)(TFS_Driver* self, const void* ctx, int file_block, int* run_len);
+
+static int TFS_Driver_ReadMapped(TFS_Driver* self, TFS_BlockMapFn map, const void* ctx, int64_t file_size, int64_t offset, int size, void* buf) {
+    if (offset < 0 || offset >= file_size || size <= 0) {
+        return 0;
+    }
+    if (size > file_size - offset) {
+        size = file_size - offset;
+    }
+
+    char block_buf[TFS_SECTOR_SIZE]; // partial blocks
+    char* out = buf;
+    int64_t pos = offset;
+    while (pos < offset + size) {
+        int block_i = pos / TFS_SECTOR_SIZE;
+        int in_block = pos % TFS_SECTOR_SIZE;
+        int chunk = TFS_Min(TFS_SECTOR_SIZE - in_block, offset + size - pos);
+        int run;
+        int data_idx = map(self, ctx, block_i, &run);
+        const char* mapped = TFS_Driver_MapData(self, data_idx);
+        if (chunk == TFS_SECTOR_SIZE) {
+            // whole blocks go straight to the output, one I/O per extent
+            int full_blocks = (offset + size - pos) / TFS_SECTOR_SIZE;
+            run = TFS_Min(run, full_blocks);
+            TFS_Driver_ReadBlocks(self, TFS_Driver_GetDataBlockIdx(self, data_idx), run, out);
+            chunk = run * TFS_SECTOR_SIZE;
+        } else if (mapped != NULL) {
+            memcpy(out, mapped + in_block, chunk);
+        } else {
+            TFS_Driver_GetData(self, data_idx, block_buf);
+            memcpy(out, block_buf + in_block, chunk);
+        }
+        out += chunk;
+        pos += chunk;
     }
 
     return size;
 }
 
-int TFS_Driver_WriteFile(TFS_Driver* self, TFS_Inode* inode, const void* buf, const int size) {
+// inline counterpart of TFS_Driver_ReadMapped
+static int TFS_ReadInline(const char* data, int64_t file_size, int64_t offset, int size, void* buf) {
+    if (offset < 0 || offset >= file_size || size <= 0) {
+        return 0;
+    }
+    if (size > file_size - offset) {
+        size = file_size - offset;
+    }
+    memcpy(buf, data + offset, size);
+    return size;
+}
+
+static int TFS_Driver_MapInodeBlock(TFS_Driver* self, const void* inode, int file_block, int* run_len) {
+    return TFS_Driver_MapFileBlock(self, inode, file_block, run_len);
+}
+
+static int TFS_Driver_MapExtentBlock(TFS_Driver* self, const void* extent, int file_block, int* run_len) {
+    (void)self; // unused
+    return TFS_FileExtent_Map(extent, file_block, run_len);
+}
+
+// first file block past the extent
+static int TFS_FileExtent_End(const TFS_FileExtent* extent) {
+    return extent->logical + (extent->clen != 0 ? TFS_COMPRESS_FRAME_BLOCKS : extent->len);
+}
+
+// counterpart of TFS_Driver_ReadMapped for maps with compressed extents: plain ones are read as usual,
+// every frame in range is read and decompressed whole
+static int TFS_Driver_ReadFrames(TFS_Driver* self, const TFS_FileExtent* extents, int cnt, int64_t file_size, int64_t offset, int size, void* buf) {
+    if (offset < 0 || offset >= file_size || size <= 0) {
+        return 0;
+    }
+    if (size > file_size - offset) {
+        size = file_size - offset;
+    }
+
+    const int frame_bytes = TFS_COMPRESS_FRAME_BLOCKS * TFS_SECTOR_SIZE;
+    char* packed = NULL;
+    char* frame = NULL;
+    char* out = buf;
+    int64_t pos = offset;
+    int64_t end = offset + size;
+    int result = size;
+    while (pos < end) {
+        int i;
+        TFS_LOWER_BOUND_LOGICAL(extents, cnt, pos / TFS_SECTOR_SIZE, i);
+        const TFS_FileExtent* extent = &extents[i];
+        int64_t extent_begin = (int64_t)extent->logical * TFS_SECTOR_SIZE;
+        int64_t extent_end = (int64_t)TFS_FileExtent_End(extent) * TFS_SECTOR_SIZE;
+        int chunk = (extent_end < end ? extent_end : end) - pos;
+        if (extent->clen == 0) {
+            TFS_Driver_ReadMapped(self, TFS_Driver_MapExtentBlock, extent, file_size, pos, chunk, out);
+        } else {
+            if (extent->clen > extent->len * TFS_SECTOR_SIZE || extent->len >= TFS_COMPRESS_FRAME_BLOCKS) {
+                result = TFS_EBADFS;
+                break;
+            }
+            // mapped image holds the frame's blocks one after another
+            const char* src = TFS_Driver_MapData(self, extent->start);
+            if (src == NULL) {
+                if (packed == NULL) {
+                    packed = malloc(frame_bytes);
+                }
+                TFS_Driver_ReadBlocks(self, TFS_Driver_GetDataBlockIdx(self, extent->start), extent->len, packed);
+                src = packed;
+            }
+            if (frame == NULL) {
+                frame = malloc(frame_bytes);
+            }
+            int64_t frame_size = (extent_end < file_size ? extent_end : file_size) - extent_begin;
+            if (TFS_Lz_Decompress(src, extent->clen, frame, frame_bytes) != frame_size) {
+                result = TFS_EBADFS;
+                break;
+            }
+            memcpy(out, frame + (pos - extent_begin), chunk);
+        }
+        out += chunk;
+        pos += chunk;
+    }
+
+    free(frame);
+    free(packed);
+    return result;
+}
+
+int TFS_Driver_ReadFileRange(TFS_Driver* self, TFS_Inode* inode, int64_t offset, int size, void* buf) {
+    if (inode->type != TFS_INODE_FILE) {
+        return TFS_ENOENT;
+    }
+    if (TFS_Inode_File_IsInline(&inode->file)) {
+        return TFS_ReadInline(inode->file.data, inode->file.file_size, offset, size, buf);
+    }
+    if (inode->flags & TFS_INODE_COMPRESSED) {
+        TFS_FileExtent* extents;
+        int cnt = TFS_Driver_LoadFileMap(self, inode, &extents);
+        int read = TFS_Driver_ReadFrames(self, extents, cnt, inode->file.file_size, offset, size, buf);
+        free(extents);
+        return read;
+    }
+    return TFS_Driver_ReadMapped(self, TFS_Driver_MapInodeBlock, inode, inode->file.file_size, offset, size, buf);
+}
+
+// writes data (zero-padded to whole blocks) into allocated extents, one write per extent and
+// only the partial last block goes through a buffer; they are file blocks from first_logical on in file_extents
+static void TFS_Driver_PutExtentsData(TFS_Driver* self, const TFS_Extent* extents, int cnt, const char* data, int size,
+                                      int first_logical, TFS_FileExtent* file_extents) {
+    char block_buf[TFS_SECTOR_SIZE];
+    const char* src = data;
+    int block_i = 0;
+    for (int i = 0; i < cnt; ++i) {
+        int full_blocks = TFS_Min(extents[i].len, (size - block_i * TFS_SECTOR_SIZE) / TFS_SECTOR_SIZE);
+        if (full_blocks > 0) {
+            TFS_Driver_WriteBlocks(self, TFS_Driver_GetDataBlockIdx(self, extents[i].start), full_blocks, src);
+        }
+        if (full_blocks < extents[i].len) {
+            int tail = size - (block_i + full_blocks) * TFS_SECTOR_SIZE;
+            memset(block_buf, 0, TFS_SECTOR_SIZE);
+            memcpy(block_buf, src + full_blocks * TFS_SECTOR_SIZE, tail);
+            TFS_Driver_PutData(self, extents[i].start + full_blocks, block_buf);
+        }
+        file_extents[i] = (TFS_FileExtent){ first_logical + block_i, extents[i].start, extents[i].len, 0 };
+        block_i += extents[i].len;
+        src += (size_t)extents[i].len * TFS_SECTOR_SIZE;
+    }
+}
+
+// writes data into newly allocated blocks, returns extent count of malloc'd *map or TFS_ENOSPACE
+static int TFS_Driver_PutBlocks(TFS_Driver* self, const char* data, int size, TFS_FileExtent** map) {
     int need_blocks = TFS_CeilDiv(size, TFS_SECTOR_SIZE);
-    char* datamap = malloc(TFS_SECTOR_SIZE);
-    int datamap_size = self->super_block.data_map_size;
-    int* free_idxes0 = malloc(sizeof(int) * (need_blocks + 1));
+    int max_extents = TFS_Min(need_blocks, TFS_MAX_FILE_EXTENTS);
+    TFS_Extent* extents = malloc(sizeof(TFS_Extent) * (max_extents + 1));
+    int extent_cnt = TFS_Driver_AllocExtents(self, need_blocks, extents, max_extents);
+    if (extent_cnt >= 0) {
+        *map = malloc(sizeof(TFS_FileExtent) * (extent_cnt + 1));
+        TFS_Driver_PutExtentsData(self, extents, extent_cnt, data, size, 0, *map);
+    }
+    free(extents);
+    return extent_cnt;
+}
 
+// appends extent of freshly written blocks, merging it into the previous one if it continues it both in file and on disk
+static void TFS_FileMap_Append(TFS_FileExtent* map, int* cnt, TFS_FileExtent extent) {
+    TFS_FileExtent* last = *cnt > 0 ? &map[*cnt - 1] : NULL;
+    if (last != NULL && last->clen == 0 && extent.clen == 0
+            && last->logical + last->len == extent.logical && last->start + last->len == extent.start) {
+        last->len += extent.len;
+    } else {
+        map[(*cnt)++] = extent;
+    }
+}
+
+// same as TFS_Driver_PutBlocks, but frame by frame: a frame that shrinks by a block or more
+// becomes one compressed extent, the rest are stored as is; *compressed tells if there are any
+static int TFS_Driver_PutFrames(TFS_Driver* self, const char* data, int size, TFS_FileExtent** map, bool* compressed) {
+    const int frame_bytes = TFS_COMPRESS_FRAME_BLOCKS * TFS_SECTOR_SIZE;
+    int frame_cnt = TFS_CeilDiv(size, frame_bytes);
+    int capacity = frame_cnt + 1;
+    TFS_FileExtent* result = malloc(sizeof(TFS_FileExtent) * capacity);
+    TFS_Extent* extents = malloc(sizeof(TFS_Extent) * TFS_COMPRESS_FRAME_BLOCKS);
+    TFS_FileExtent* frame_extents = malloc(sizeof(TFS_FileExtent) * TFS_COMPRESS_FRAME_BLOCKS);
+    char* packed = malloc(frame_bytes);
+    int cnt = 0;
+    int code = TFS_ESUCC;
+    *compressed = false;
+    for (int frame_i = 0; frame_i < frame_cnt; ++frame_i) {
+        const char* src = data + (size_t)frame_i * frame_bytes;
+        int frame_size = TFS_Min(frame_bytes, size - frame_i * frame_bytes);
+        int frame_blocks = TFS_CeilDiv(frame_size, TFS_SECTOR_SIZE);
+        int logical = frame_i * TFS_COMPRESS_FRAME_BLOCKS;
+        // packed frame must be at least a block shorter, a single block is never compressed
+        int clen = TFS_Lz_Compress(src, frame_size, packed, (frame_blocks - 1) * TFS_SECTOR_SIZE);
+        int extent_cnt;
+        if (clen > 0 && TFS_Driver_AllocExtents(self, TFS_CeilDiv(clen, TFS_SECTOR_SIZE), extents, 1) == 1) {
+            memset(packed + clen, 0, extents[0].len * TFS_SECTOR_SIZE - clen);
+            TFS_Driver_WriteBlocks(self, TFS_Driver_GetDataBlockIdx(self, extents[0].start), extents[0].len, packed);
+            frame_extents[0] = (TFS_FileExtent){ logical, extents[0].start, extents[0].len, clen };
+            extent_cnt = 1;
+            *compressed = true;
+        } else {
+            extent_cnt = TFS_Driver_AllocExtents(self, frame_blocks, extents, frame_blocks);
+            if (extent_cnt < 0) {
+                code = extent_cnt;
+                break;
+            }
+            TFS_Driver_PutExtentsData(self, extents, extent_cnt, src, frame_size, logical, frame_extents);
+        }
+        if (cnt + extent_cnt > capacity) {
+            capacity = 2 * capacity + extent_cnt;
+            result = realloc(result, sizeof(TFS_FileExtent) * capacity);
+        }
+        for (int i = 0; i < extent_cnt; ++i) {
+            TFS_FileMap_Append(result, &cnt, frame_extents[i]);
+        }
+    }
+    free(packed);
+    free(frame_extents);
+    free(extents);
+
+    if (code <= 0) {
+        TFS_Driver_FreeFileExtents(self, result, cnt);
+        free(result);
+        return code;
+    }
+    *map = result;
+    return cnt;
+}
+
+int TFS_Driver_WriteFile(TFS_Driver* self, TFS_Inode* inode, const void* buf, const int size) {
+    // contents are replaced, release old blocks first so they can be reused
+    if (inode->type == TFS_INODE_FILE) {
+        TFS_Driver_FreeFileBlocks(self, inode);
+    } else {
+        if (inode->type == TFS_INODE_DIR) {
+            TFS_Driver_DentryInvalidateParent(self, inode->inode_idx);
+        }
+        TFS_Inode_File_InitInline(&inode->file);
+        inode->flags = 0;
+    }
     inode->type = TFS_INODE_FILE;
+    if (size <= TFS_INODE_INLINE_SIZE) {
+        memcpy(inode->file.data, buf, size);
+        inode->file.file_size = size;
+        TFS_Driver_PutInode(self, inode->inode_idx, inode);
+        TFS_Driver_SetInodeOccupied(self, inode->inode_idx, true);
+        return size;
+    }
 
-    TFS_Driver_ReadBlock(self, TFS_DATAMAP_BLOCK_IDX, datamap);
-    TFS_Bitmap_FindFree(datamap, datamap_size, free_idxes0, need_blocks);
+    TFS_FileExtent* file_extents;
+    bool compressed = false;
+    int extent_cnt = self->compress
+        ? TFS_Driver_PutFrames(self, buf, size, &file_extents, &compressed)
+        : TFS_Driver_PutBlocks(self, buf, size, &file_extents);
+    if (extent_cnt < 0) {
+        TFS_Driver_PutInode(self, inode->inode_idx, inode);
+        return extent_cnt;
+    }
 
-    for (int i = 0, size_left = size; i < need_blocks; ++i, size_left -= TFS_SECTOR_SIZE) {
-        memcpy(block_buf, buf + i * TFS_SECTOR_SIZE, TFS_Min(size_left, TFS_SECTOR_SIZE));
-        TFS_Driver_PutData(self, free_idxes0[i] + 1, block_buf);
-        inode->file.used_blocks[i] = free_idxes0[i] + 1;
+    int store_code = TFS_Driver_StoreFileMap(self, inode, file_extents, extent_cnt);
+    if (store_code <= 0) {
+        TFS_Driver_FreeFileExtents(self, file_extents, extent_cnt);
+        inode->file.extent_cnt = 0;
+    } else {
+        inode->file.file_size = size;
+        if (compressed) {
+            inode->flags |= TFS_INODE_COMPRESSED;
+        }
     }
+    TFS_Driver_PutInode(self, inode->inode_idx, inode);
+    TFS_Driver_SetInodeOccupied(self, inode->inode_idx, true);
+
+    free(file_extents);
 
-    TFS_Bitmap_SetBits(datamap, datamap_size, free_idxes0, need_blocks, 1);
-    TFS_Driver_WriteBlock(self, TFS_DATAMAP_BLOCK_IDX, datamap);
+    return store_code <= 0 ? store_code : size;
+}
+
+// appends newly allocated blocks up to new_blocks to the file map, their contents are undefined
+static int TFS_Driver_GrowFile(TFS_Driver* self, TFS_Inode* inode, int new_blocks) {
+    int old_blocks = TFS_Inode_File_GetBlockCnt(&inode->file);
+    int grow = new_blocks - old_blocks;
+    assert(grow > 0);
+    int max_extents = TFS_Min(grow, TFS_MAX_FILE_EXTENTS);
+    TFS_Extent* extents = malloc(sizeof(TFS_Extent) * (max_extents + 1));
+    int extent_cnt = TFS_Driver_AllocExtents(self, grow, extents, max_extents);
+    if (extent_cnt < 0) {
+        free(extents);
+        return extent_cnt;
+    }
 
+    TFS_FileExtent* old_map;
+    int old_cnt = TFS_Driver_LoadFileMap(self, inode, &old_map);
+    TFS_FileExtent* map = malloc(sizeof(TFS_FileExtent) * (old_cnt + extent_cnt + 1));
+    memcpy(map, old_map, sizeof(TFS_FileExtent) * old_cnt);
+    int cnt = old_cnt;
+    int logical = old_blocks;
+    for (int i = 0; i < extent_cnt; ++i) {
+        TFS_FileExtent* last = cnt > 0 ? &map[cnt - 1] : NULL;
+        if (last != NULL && last->start + last->len == extents[i].start) {
+            // next fit usually continues right after the file's last extent
+            last->len += extents[i].len;
+        } else {
+            map[cnt++] = (TFS_FileExtent){ logical, extents[i].start, extents[i].len, 0 };
+        }
+        logical += extents[i].len;
+    }
+
+    int store_code = TFS_Driver_StoreFileMap(self, inode, map, cnt);
+    if (store_code <= 0) {
+        TFS_Driver_FreeExtents(self, extents, extent_cnt);
+        // old map fits into the leaves just released
+        int restore_code = TFS_Driver_StoreFileMap(self, inode, old_map, old_cnt);
+        assert(restore_code > 0);
+        (void)restore_code;
+    }
+    free(map);
+    free(old_map);
+    free(extents);
+    return store_code;
+}
+
+// moves inline contents into a data block of their own, file stays the same size
+// WARNING! Does not put inode
+static int TFS_Driver_UninlineFile(TFS_Driver* self, TFS_Inode* inode) {
+    char block_buf[TFS_SECTOR_SIZE] = {};
+    // zeroes past EOF come along
+    memcpy(block_buf, inode->file.data, TFS_INODE_INLINE_SIZE);
+    int64_t size = inode->file.file_size;
+    inode->file.index_cnt = 0;
+    if (size == 0) {
+        return TFS_ESUCC;
+    }
+    inode->file.file_size = 0;
+    int grow_code = TFS_Driver_GrowFile(self, inode, 1);
     inode->file.file_size = size;
+    if (grow_code <= 0) {
+        inode->file.extent_cnt = 0;
+        inode->file.index_cnt = TFS_FILE_INLINE;
+        memcpy(inode->file.data, block_buf, TFS_INODE_INLINE_SIZE);
+        return grow_code;
+    }
+    TFS_Driver_PutData(self, inode->file.extents[0].start, block_buf);
+    return TFS_ESUCC;
+}
+
+// rewrites compressed file as plain blocks, so it can be changed in place; contents stay the same
+// WARNING! Does not put inode
+static int TFS_Driver_InflateFile(TFS_Driver* self, TFS_Inode* inode) {
+    int size = inode->file.file_size;
+    char* data = malloc(size);
+    TFS_FileExtent* old_map;
+    int old_cnt = TFS_Driver_LoadFileMap(self, inode, &old_map);
+    TFS_FileExtent* map = NULL;
+    // new blocks are taken before the old ones are released, so on error nothing changes
+    int code = TFS_Driver_ReadFrames(self, old_map, old_cnt, size, 0, size, data);
+    if (code > 0) {
+        code = TFS_Driver_PutBlocks(self, data, size, &map);
+    }
+    if (code > 0) {
+        int cnt = code;
+        code = TFS_Driver_StoreFileMap(self, inode, map, cnt);
+        if (code <= 0) {
+            TFS_Driver_FreeFileExtents(self, map, cnt);
+            // old map fits into the leaves just released
+            int restore_code = TFS_Driver_StoreFileMap(self, inode, old_map, old_cnt);
+            assert(restore_code > 0);
+            (void)restore_code;
+        } else {
+            TFS_Driver_FreeFileExtents(self, old_map, old_cnt);
+            inode->flags &= ~TFS_INODE_COMPRESSED;
+        }
+    }
+    free(map);
+    free(old_map);
+    free(data);
+    return code;
+}
+
+// zero-fills file blocks [begin, end) with one write per run
+static void TFS_Driver_ZeroFileBlocks(TFS_Driver* self, const TFS_Inode* inode, int begin, int end) {
+    const int max_run = 32;
+    char* zeroes = NULL;
+    for (int block_i = begin; block_i < end;) {
+        int run;
+        int data_idx = TFS_Driver_MapFileBlock(self, inode, block_i, &run);
+        run = TFS_Min(TFS_Min(run, end - block_i), max_run);
+        if (zeroes == NULL) {
+            zeroes = calloc(max_run, TFS_SECTOR_SIZE);
+        }
+        TFS_Driver_WriteBlocks(self, TFS_Driver_GetDataBlockIdx(self, data_idx), run, zeroes);
+        block_i += run;
+    }
+    free(zeroes);
+}
+
+int TFS_Driver_WriteFileRange(TFS_Driver* self, TFS_Inode* inode, int64_t offset, int size, const void* buf) {
+    if (inode->type != TFS_INODE_FILE) {
+        return TFS_ENOENT;
+    }
+    if (offset < 0 || size < 0) {
+        return TFS_EINVAL;
+    }
+    int64_t end = offset + size;
+    int64_t new_size = end > inode->file.file_size ? end : inode->file.file_size;
+    if (TFS_Inode_File_IsInline(&inode->file)) {
+        if (new_size <= TFS_INODE_INLINE_SIZE) {
+            // a gap past old EOF is zeroes already
+            if (size > 0) {
+                memcpy(inode->file.data + offset, buf, size);
+            }
+            inode->file.file_size = new_size;
+            TFS_Driver_PutInode(self, inode->inode_idx, inode);
+            return size;
+        }
+        int uninline_code = TFS_Driver_UninlineFile(self, inode);
+        if (uninline_code <= 0) {
+            return uninline_code;
+        }
+    }
+    if (inode->flags & TFS_INODE_COMPRESSED) {
+        int inflate_code = TFS_Driver_InflateFile(self, inode);
+        if (inflate_code <= 0) {
+            return inflate_code;
+        }
+    }
+    int old_blocks = TFS_Inode_File_GetBlockCnt(&inode->file);
+    int new_blocks = (new_size + TFS_SECTOR_SIZE - 1) / TFS_SECTOR_SIZE;
+    if (new_blocks > old_blocks) {
+        int grow_code = TFS_Driver_GrowFile(self, inode, new_blocks);
+        if (grow_code <= 0) {
+            return grow_code;
+        }
+        // new blocks before the written range are a hole, it reads back as zeroes
+        int write_begin = size > 0 ? offset / TFS_SECTOR_SIZE : new_blocks;
+        TFS_Driver_ZeroFileBlocks(self, inode, old_blocks, TFS_Min(write_begin, new_blocks));
+    }
+
+    char block_buf[TFS_SECTOR_SIZE];
+    const char* src = buf;
+    int64_t pos = offset;
+    while (pos < end) {
+        int block_i = pos / TFS_SECTOR_SIZE;
+        int in_block = pos % TFS_SECTOR_SIZE;
+        int chunk = TFS_Min(TFS_SECTOR_SIZE - in_block, end - pos);
+        int run;
+        int data_idx = TFS_Driver_MapFileBlock(self, inode, block_i, &run);
+        if (chunk == TFS_SECTOR_SIZE) {
+            int full_blocks = (end - pos) / TFS_SECTOR_SIZE;
+            run = TFS_Min(run, full_blocks);
+            TFS_Driver_WriteBlocks(self, TFS_Driver_GetDataBlockIdx(self, data_idx), run, src);
+            chunk = run * TFS_SECTOR_SIZE;
+        } else {
+            // partial block: new ones start zeroed, old ones are read-modify-written
+            if (block_i >= old_blocks) {
+                memset(block_buf, 0, TFS_SECTOR_SIZE);
+            } else {
+                TFS_Driver_GetData(self, data_idx, block_buf);
+            }
+            memcpy(block_buf + in_block, src, chunk);
+            TFS_Driver_PutData(self, data_idx, block_buf);
+        }
+        src += chunk;
+        pos += chunk;
+    }
+
+    inode->file.file_size = new_size;
     TFS_Driver_PutInode(self, inode->inode_idx, inode);
-    TFS_Driver_SetInodeOccupied(self, inode->inode_idx, true);
+    return size;
+}
 
-    free(datamap);
-    free(free_idxes0);
+int TFS_Driver_Truncate(TFS_Driver* self, TFS_Inode* inode, int64_t size) {
+    if (inode->type != TFS_INODE_FILE) {
+        return TFS_ENOENT;
+    }
+    if (size < 0) {
+        return TFS_EINVAL;
+    }
+    if (size >= inode->file.file_size) {
+        int write_code = TFS_Driver_WriteFileRange(self, inode, size, 0, NULL);
+        return write_code < 0 ? write_code : TFS_ESUCC;
+    }
+    if (size <= TFS_INODE_INLINE_SIZE) {
+        // what is left goes into the inode, blocks are released
+        char* data = malloc(TFS_INODE_INLINE_SIZE);
+        TFS_Driver_ReadFileRange(self, inode, 0, size, data);
+        TFS_Driver_FreeFileBlocks(self, inode);
+        memcpy(inode->file.data, data, size);
+        inode->file.file_size = size;
+        TFS_Driver_PutInode(self, inode->inode_idx, inode);
+        free(data);
+        return TFS_ESUCC;
+    }
+    if (inode->flags & TFS_INODE_COMPRESSED) {
+        int inflate_code = TFS_Driver_InflateFile(self, inode);
+        if (inflate_code <= 0) {
+            return inflate_code;
+        }
+    }
+
+    int old_blocks = TFS_Inode_File_GetBlockCnt(&inode->file);
+    int new_blocks = (size + TFS_SECTOR_SIZE - 1) / TFS_SECTOR_SIZE;
+    if (new_blocks < old_blocks) {
+        TFS_FileExtent* map;
+        int cnt = TFS_Driver_LoadFileMap(self, inode, &map);
+        TFS_Extent* freed = malloc(sizeof(TFS_Extent) * (cnt + 1));
+        int freed_cnt = 0;
+        int kept = 0;
+        for (int i = 0; i < cnt; ++i) {
+            TFS_FileExtent extent = map[i];
+            int keep_len = TFS_Min(extent.len, new_blocks - extent.logical);
+            if (keep_len < extent.len) {
+                keep_len = keep_len < 0 ? 0 : keep_len;
+                freed[freed_cnt++] = (TFS_Extent){ extent.start + keep_len, extent.len - keep_len };
+                extent.len = keep_len;
+            }
+            if (extent.len > 0) {
+                map[kept++] = extent;
+            }
+        }
+        // fewer extents than before, they fit into the leaves being released
+        int store_code = TFS_Driver_StoreFileMap(self, inode, map, kept);
+        assert(store_code > 0);
+        (void)store_code;
+        TFS_Driver_FreeExtents(self, freed, freed_cnt);
+        free(freed);
+        free(map);
+    }
+
+    // bytes past EOF must read back as zeroes if the file grows again
+    if (size % TFS_SECTOR_SIZE != 0) {
+        char block_buf[TFS_SECTOR_SIZE];
+        int run;
+        int data_idx = TFS_Driver_MapFileBlock(self, inode, new_blocks - 1, &run);
+        TFS_Driver_GetData(self, data_idx, block_buf);
+        memset(block_buf + size % TFS_SECTOR_SIZE, 0, TFS_SECTOR_SIZE - size % TFS_SECTOR_SIZE);
+        TFS_Driver_PutData(self, data_idx, block_buf);
+    }
+    inode->file.file_size = size;
+    TFS_Driver_PutInode(self, inode->inode_idx, inode);
+    return TFS_ESUCC;
+}
 
-    return size;
+int TFS_Inode_File_GetExtentCnt(const TFS_Inode_File* self) {
+    return self->extent_cnt;
 }
 
 void TFS_Driver_RmFileInode(TFS_Driver* self, TFS_Inode* inode) {
     assert(inode->type == TFS_INODE_FILE);
-    int block_cnt = TFS_Inode_File_GetBlockCnt(&inode->file);
-    int* data_blocks0 = malloc(sizeof(int) * block_cnt);
-    for (int i = 0; i < block_cnt; ++i) {
-        data_blocks0[i] = inode->file.used_blocks[i] - 1;
-    }
-    char* datamap = malloc(TFS_SECTOR_SIZE);
-    int datamap_size = self->super_block.data_map_size;
-    TFS_Driver_ReadBlock(self, TFS_DATAMAP_BLOCK_IDX, datamap);
-    TFS_Bitmap_SetBits(datamap, datamap_size, data_blocks0, block_cnt, false);
-    TFS_Driver_WriteBlock(self, TFS_DATAMAP_BLOCK_IDX, datamap);
-
-    free(data_blocks0);
-    free(datamap);
+    TFS_Driver_FreeFileBlocks(self, inode);
     TFS_Driver_FreeInode(self, inode);
 }
 
@@ -368,6 +2469,16 @@ void TFS_Path_Destruct(TFS_Path* self) {
     free(self->_buf);
 }
 
+// mapped inode if possible, otherwise it is read into buf
+static const TFS_Inode* TFS_Driver_MapOrGetInode(TFS_Driver* self, int inode_idx, TFS_Inode* buf) {
+    const TFS_Inode* inode = TFS_Driver_MapInode(self, inode_idx);
+    if (inode == NULL) {
+        TFS_Driver_GetInode(self, inode_idx, buf);
+        inode = buf;
+    }
+    return inode;
+}
+
 int TFS_Path_TraverseSlice(const TFS_Path* path, TFS_Inode* inode, int begin, int end, TFS_Driver* driver) {
     // TODO: differ '/' from unexisting path
     // -1?
@@ -381,27 +2492,82 @@ int TFS_Path_TraverseSlice(const TFS_Path* path, TFS_Inode* inode, int begin, in
     if (!(0 <= begin && begin <= end && end <= path->size)) {
         return TFS_ENOENT;
     }
+    assert(inode != NULL);
+    // walk by idx through dentry cache; inodes are only read on cache misses and at the end
+    // (and only copied if the image is not mapped)
+    int inode_idx = inode->inode_idx;
+    const TFS_Inode* current = inode;
     for (int i = begin; i < end; ++i) {
-        assert(inode != NULL);
-        if (inode->type != TFS_INODE_DIR) {
-            return TFS_ENOENT;
+        const char* name = path->components[i];
+        int child_idx;
+        if (!TFS_Driver_DentryLookup(driver, inode_idx, name, &child_idx)) {
+            if (current == NULL) {
+                current = TFS_Driver_MapOrGetInode(driver, inode_idx, inode);
+            }
+            if (current->type != TFS_INODE_DIR) {
+                return TFS_ENOENT;
+            }
+            child_idx = TFS_Driver_DirLookup(driver, current, name);
         }
-
-        TFS_Inode_DirEnt* dirent = TFS_Inode_Dir_FindChild(&inode->dir, path->components[i]);
-        if (dirent == NULL) {
+        if (child_idx <= 0) {
             return TFS_ENOENT;
         }
-        TFS_Driver_GetInode(driver, dirent->inode_idx, inode);
+        inode_idx = child_idx;
+        current = NULL;
+    }
+    if (current == NULL) {
+        current = TFS_Driver_MapOrGetInode(driver, inode_idx, inode);
+    }
+    if (current != inode) {
+        *inode = *current;
     }
     return inode->inode_idx;
 }
 
-int TFS_Driver_GetInodeByPath(TFS_Driver* self, const TFS_Path* path, TFS_Inode* inode) {
+// doesn't lock, see TFS_Driver_GetInodeByPath
+static int TFS_Driver_ResolvePath(TFS_Driver* self, const TFS_Path* path, TFS_Inode* inode) {
     TFS_Driver_GetInode(self, TFS_ROOT_INODE_IDX, inode);
-    int inode_idx = TFS_Path_TraverseSlice(path, inode, 0, path->size, self);
+    return TFS_Path_TraverseSlice(path, inode, 0, path->size, self);
+}
+
+int TFS_Driver_GetInodeByPath(TFS_Driver* self, const TFS_Path* path, TFS_Inode* inode) {
+    TFS_Driver_LockNamespace(self, false);
+    int inode_idx = TFS_Driver_ResolvePath(self, path, inode);
+    if (inode_idx > 0) {
+        // file may be written concurrently, take a consistent copy
+        TFS_Driver_LockInode(self, inode_idx, false);
+        TFS_Driver_GetInode(self, inode_idx, inode);
+        TFS_Driver_UnlockInode(self, inode_idx);
+    }
+    TFS_Driver_UnlockNamespace(self);
+    return inode_idx;
+}
+
+// resolves path and locks both namespace (shared) and the inode, *inode is read under the lock
+// returns inode idx, nothing stays locked on error
+static int TFS_Driver_LockPathInode(TFS_Driver* self, const char* raw_path, TFS_Inode* inode, bool exclusive) {
+    TFS_Path path;
+    int path_init_code = TFS_Path_Init(&path, raw_path);
+    if (path_init_code <= 0) {
+        return path_init_code;
+    }
+    TFS_Driver_LockNamespace(self, false);
+    int inode_idx = TFS_Driver_ResolvePath(self, &path, inode);
+    TFS_Path_Destruct(&path);
+    if (inode_idx <= 0) {
+        TFS_Driver_UnlockNamespace(self);
+        return inode_idx;
+    }
+    TFS_Driver_LockInode(self, inode_idx, exclusive);
+    TFS_Driver_GetInode(self, inode_idx, inode);
     return inode_idx;
 }
 
+static void TFS_Driver_UnlockPathInode(TFS_Driver* self, int inode_idx) {
+    TFS_Driver_UnlockInode(self, inode_idx);
+    TFS_Driver_UnlockNamespace(self);
+}
+
 int TFS_Driver_GetInodeByRawPath(TFS_Driver* self, const char* raw_path, TFS_Inode* inode) {
     TFS_Path path;
     int path_init_code = TFS_Path_Init(&path, raw_path);
@@ -431,7 +2597,7 @@ int TFS_Driver_GetInodeIdxByRawPath(TFS_Driver* self, const char* raw_path) {
     return inode_idx;
 }
 
-int TFS_Driver_CreateByPath(TFS_Driver* self, TFS_Inode* inode, const TFS_Path* path, enum TFS_InodeType type) {
+static int TFS_Driver_CreateByPathUnlocked(TFS_Driver* self, TFS_Inode* inode, const TFS_Path* path, enum TFS_InodeType type) {
     if (path->size < 1) {
         return TFS_EEXISTS;
     }
@@ -456,6 +2622,15 @@ int TFS_Driver_CreateByPath(TFS_Driver* self, TFS_Inode* inode, const TFS_Path*
     return inode_idx;
 }
 
+int TFS_Driver_CreateByPath(TFS_Driver* self, TFS_Inode* inode, const TFS_Path* path, enum TFS_InodeType type) {
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockNamespace(self, true);
+    int inode_idx = TFS_Driver_CreateByPathUnlocked(self, inode, path, type);
+    TFS_Driver_UnlockNamespace(self);
+    TFS_Driver_EndOp(self);
+    return inode_idx;
+}
+
 int TFS_Driver_CreateByRawPath(TFS_Driver* self, TFS_Inode* inode, const char* raw_path, enum TFS_InodeType type) {
     TFS_Path path;
     int path_init_code = TFS_Path_Init(&path, raw_path);
@@ -476,67 +2651,389 @@ int TFS_Driver_CreateIdxByRawPath(TFS_Driver* self, const char* raw_path, enum T
 
 int TFS_Driver_ReadFileByRawPath(TFS_Driver* self, const char* path, void* buf) {
     TFS_Inode* inode = malloc(sizeof(TFS_Inode));
-    int inode_idx = TFS_Driver_GetInodeByRawPath(self, path, inode);
-    int read = inode_idx > 0? TFS_Driver_ReadFile(self, inode, buf) : inode_idx;
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, false);
+    int read = inode_idx;
+    if (inode_idx > 0) {
+        read = TFS_Driver_ReadFile(self, inode, buf);
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    free(inode);
+    return read;
+}
+
+int TFS_Driver_ReadFileRangeByRawPath(TFS_Driver* self, const char* path, int64_t offset, int size, void* buf) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, false);
+    int read = inode_idx;
+    if (inode_idx > 0) {
+        read = inode->type == TFS_INODE_FILE ? TFS_Driver_ReadFileRange(self, inode, offset, size, buf) : TFS_ENOENT;
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
     free(inode);
     return read;
 }
 
 int TFS_Driver_WriteFileByRawPath(TFS_Driver* self, const char* path, const void* buf, int size) {
     TFS_Inode* inode = malloc(sizeof(TFS_Inode));
-    int inode_idx = TFS_Driver_GetInodeByRawPath(self, path, inode);
-    int written = inode_idx > 0? TFS_Driver_WriteFile(self, inode, buf, size) : inode_idx;
+    TFS_Driver_BeginOp(self);
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, true);
+    int written = inode_idx;
+    if (inode_idx > 0) {
+        written = TFS_Driver_WriteFile(self, inode, buf, size);
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    TFS_Driver_EndOp(self);
     free(inode);
     return written;
 }
 
-int TFS_Driver_DeleteByPath(TFS_Driver* self, const TFS_Path* path) {
-    if (path->size < 1) {
+int TFS_Driver_WriteFileRangeByRawPath(TFS_Driver* self, const char* path, int64_t offset, int size, const void* buf) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, true);
+    int written = inode_idx;
+    if (inode_idx > 0) {
+        written = TFS_Driver_WriteFileRange(self, inode, offset, size, buf);
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return written;
+}
+
+int TFS_Driver_TruncateByRawPath(TFS_Driver* self, const char* path, int64_t size) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, true);
+    int result = inode_idx;
+    if (inode_idx > 0) {
+        result = TFS_Driver_Truncate(self, inode, size);
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return result;
+}
+
+int TFS_Driver_ReadDirByRawPath(TFS_Driver* self, const char* path, int64_t* cookie, TFS_Inode_DirEnt* entries, int max) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, false);
+    int cnt = inode_idx;
+    if (inode_idx > 0) {
+        cnt = inode->type == TFS_INODE_DIR ? TFS_Driver_ReadDirEntries(self, inode, cookie, entries, max) : TFS_ENOENT;
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    free(inode);
+    return cnt;
+}
+
+int TFS_Driver_ReadDirAttrsByRawPath(TFS_Driver* self, const char* path, int64_t* cookie, TFS_DirEntry* entries, int max) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, false);
+    int cnt = inode_idx;
+    if (inode_idx > 0) {
+        cnt = inode->type == TFS_INODE_DIR ? TFS_Driver_ReadDirAttrs(self, inode, cookie, entries, max) : TFS_ENOENT;
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    free(inode);
+    return cnt;
+}
+
+// open files
+
+// (re)loads cached size and block map, file->lock must be held exclusively
+static int TFS_Driver_ReloadFile(TFS_Driver* self, TFS_File* file, const TFS_Inode* inode) {
+    if (inode->type != TFS_INODE_FILE) {
         return TFS_ENOENT;
     }
+    free(file->extents);
+    free(file->data);
+    file->inode_gen = TFS_Driver_GetInodeGen(self, file->inode_idx);
+    file->file_size = inode->file.file_size;
+    file->extent_cnt = TFS_Driver_LoadFileMap(self, inode, &file->extents);
+    file->data = NULL;
+    file->compressed = inode->flags & TFS_INODE_COMPRESSED;
+    if (TFS_Inode_File_IsInline(&inode->file)) {
+        file->data = malloc(TFS_INODE_INLINE_SIZE);
+        memcpy(file->data, inode->file.data, file->file_size);
+    }
+    return TFS_ESUCC;
+}
+
+// inode must be read under the inode lock
+static int TFS_Driver_NewFile(TFS_Driver* self, const TFS_Inode* inode, TFS_File** file) {
+    TFS_File* result = malloc(sizeof(TFS_File));
+    result->inode_idx = inode->inode_idx;
+    result->extents = NULL;
+    result->data = NULL;
+    int reload_code = TFS_Driver_ReloadFile(self, result, inode);
+    if (reload_code <= 0) {
+        free(result);
+        return reload_code;
+    }
+    pthread_rwlock_init(&result->lock, NULL);
+    *file = result;
+    return inode->inode_idx;
+}
 
+int TFS_Driver_OpenFile(TFS_Driver* self, const char* path, TFS_File** file) {
     TFS_Inode* inode = malloc(sizeof(TFS_Inode));
-    TFS_Driver_GetInode(self, TFS_ROOT_INODE_IDX, inode);
-    int inode_idx = TFS_Path_TraverseSlice(path, inode, 0, path->size - 1, self);
-    if (inode_idx <= 0 || inode->type != TFS_INODE_DIR) {
+    int inode_idx = TFS_Driver_LockPathInode(self, path, inode, false);
+    if (inode_idx <= 0) {
         free(inode);
-        return TFS_ENOENT; // if not enoent?
+        return inode_idx;
     }
+    int result = TFS_Driver_NewFile(self, inode, file);
+    TFS_Driver_UnlockPathInode(self, inode_idx);
+    free(inode);
+    return result;
+}
 
-    int dirent_idx = TFS_Inode_Dir_FindChildIdx(&inode->dir, path->components[path->size - 1]);
-    if (dirent_idx == -1) {
-        free(inode);
+void TFS_Driver_CloseFile(TFS_Driver* self, TFS_File* file) {
+    (void)self; // unused
+    pthread_rwlock_destroy(&file->lock);
+    free(file->extents);
+    free(file->data);
+    free(file);
+}
+
+static int TFS_File_MapBlock(TFS_Driver* self, const void* ctx, int file_block, int* run_len) {
+    (void)self; // unused
+    const TFS_File* file = ctx;
+    int i;
+    TFS_LOWER_BOUND_LOGICAL(file->extents, file->extent_cnt, file_block, i);
+    return TFS_FileExtent_Map(&file->extents[i], file_block, run_len);
+}
+
+// takes inode lock (shared, keeps writers and so inode_gen away) and file->lock (shared),
+// reloading the cached copy first if it is stale; nothing stays locked on error
+static int TFS_Driver_LockFile(TFS_Driver* self, TFS_File* file) {
+    TFS_Driver_LockInode(self, file->inode_idx, false);
+    pthread_rwlock_rdlock(&file->lock);
+    if (file->inode_gen != TFS_Driver_GetInodeGen(self, file->inode_idx)) {
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_wrlock(&file->lock);
+        int reload_code = TFS_ESUCC;
+        if (file->inode_gen != TFS_Driver_GetInodeGen(self, file->inode_idx)) {
+            TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+            TFS_Driver_GetInode(self, file->inode_idx, inode);
+            reload_code = TFS_Driver_ReloadFile(self, file, inode);
+            free(inode);
+        }
+        pthread_rwlock_unlock(&file->lock);
+        if (reload_code <= 0) {
+            TFS_Driver_UnlockInode(self, file->inode_idx);
+            return reload_code;
+        }
+        pthread_rwlock_rdlock(&file->lock);
+    }
+    return TFS_ESUCC;
+}
+
+static void TFS_Driver_UnlockFile(TFS_Driver* self, TFS_File* file) {
+    pthread_rwlock_unlock(&file->lock);
+    TFS_Driver_UnlockInode(self, file->inode_idx);
+}
+
+int TFS_Driver_FileRead(TFS_Driver* self, TFS_File* file, int64_t offset, int size, void* buf) {
+    int lock_code = TFS_Driver_LockFile(self, file);
+    if (lock_code <= 0) {
+        return lock_code;
+    }
+    int read;
+    if (file->data != NULL) {
+        read = TFS_ReadInline(file->data, file->file_size, offset, size, buf);
+    } else if (file->compressed) {
+        read = TFS_Driver_ReadFrames(self, file->extents, file->extent_cnt, file->file_size, offset, size, buf);
+    } else {
+        read = TFS_Driver_ReadMapped(self, TFS_File_MapBlock, file, file->file_size, offset, size, buf);
+    }
+    TFS_Driver_UnlockFile(self, file);
+    return read;
+}
+
+int TFS_Driver_FileMapRange(TFS_Driver* self, TFS_File* file, int64_t offset, int size, TFS_ImageRun* runs, int max_runs) {
+    int lock_code = TFS_Driver_LockFile(self, file);
+    if (lock_code <= 0) {
+        return lock_code;
+    }
+    if (file->compressed) {
+        TFS_Driver_UnlockFile(self, file);
+        return TFS_EINVAL;
+    }
+    int64_t end = offset + size;
+    if (end > file->file_size) {
+        end = file->file_size;
+    }
+    int cnt = 0;
+    int64_t pos = offset < 0 ? end : offset;
+    if (file->data != NULL && pos < end && max_runs > 0) {
+        int block_idx = TFS_Driver_GetInodeBlockIdx(self, file->inode_idx);
+        if (self->cache.capacity != 0) {
+            pthread_mutex_lock(&self->cache_lock);
+            TFS_BlockCache_FlushRange(&self->cache, block_idx, 1);
+            pthread_mutex_unlock(&self->cache_lock);
+        }
+        int64_t inode_pos = (int64_t)block_idx * TFS_SECTOR_SIZE + TFS_Inode_GetPart(file->inode_idx) * TFS_INODE_SIZE;
+        runs[0].offset = inode_pos + offsetof(TFS_Inode, file.data) + pos;
+        runs[0].size = end - pos;
+        cnt = 1;
+        pos = end;
+    }
+    while (pos < end) {
+        int block_i = pos / TFS_SECTOR_SIZE;
+        int run;
+        int block_idx = TFS_Driver_GetDataBlockIdx(self, TFS_File_MapBlock(self, file, block_i, &run));
+        int64_t run_end = (int64_t)(block_i + run) * TFS_SECTOR_SIZE;
+        if (run_end > end) {
+            run_end = end;
+        }
+        // image must be up to date for whoever reads it
+        int blocks = TFS_CeilDiv(run_end - (int64_t)block_i * TFS_SECTOR_SIZE, TFS_SECTOR_SIZE);
+        if (self->cache.capacity != 0) {
+            pthread_mutex_lock(&self->cache_lock);
+            TFS_BlockCache_FlushRange(&self->cache, block_idx, blocks);
+            pthread_mutex_unlock(&self->cache_lock);
+        }
+
+        int64_t image_pos = (int64_t)block_idx * TFS_SECTOR_SIZE + pos % TFS_SECTOR_SIZE;
+        if (cnt > 0 && runs[cnt - 1].offset + runs[cnt - 1].size == image_pos) {
+            // extents adjacent in the image
+            runs[cnt - 1].size += run_end - pos;
+        } else if (cnt < max_runs) {
+            runs[cnt].offset = image_pos;
+            runs[cnt].size = run_end - pos;
+            ++cnt;
+        } else {
+            break;
+        }
+        pos = run_end;
+    }
+    TFS_Driver_UnlockFile(self, file);
+    return cnt;
+}
+
+int TFS_Driver_FileWrite(TFS_Driver* self, TFS_File* file, int64_t offset, int size, const void* buf) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockInode(self, file->inode_idx, true);
+    TFS_Driver_GetInode(self, file->inode_idx, inode);
+    // cached map goes stale through inode_gen and is reloaded by the next read
+    int written = TFS_Driver_WriteFileRange(self, inode, offset, size, buf);
+    TFS_Driver_UnlockInode(self, file->inode_idx);
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return written;
+}
+
+int TFS_Driver_FileAppend(TFS_Driver* self, TFS_File* file, int size, const void* buf) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockInode(self, file->inode_idx, true);
+    TFS_Driver_GetInode(self, file->inode_idx, inode);
+    int written = inode->type == TFS_INODE_FILE
+        ? TFS_Driver_WriteFileRange(self, inode, inode->file.file_size, size, buf)
+        : TFS_ENOENT;
+    TFS_Driver_UnlockInode(self, file->inode_idx);
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return written;
+}
+
+int TFS_Driver_FileReplace(TFS_Driver* self, TFS_File* file, int size, const void* buf) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockInode(self, file->inode_idx, true);
+    TFS_Driver_GetInode(self, file->inode_idx, inode);
+    int written = inode->type == TFS_INODE_FILE
+        ? TFS_Driver_WriteFile(self, inode, buf, size)
+        : TFS_ENOENT;
+    TFS_Driver_UnlockInode(self, file->inode_idx);
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return written;
+}
+
+int TFS_Driver_FileTruncate(TFS_Driver* self, TFS_File* file, int64_t size) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockInode(self, file->inode_idx, true);
+    TFS_Driver_GetInode(self, file->inode_idx, inode);
+    int result = TFS_Driver_Truncate(self, inode, size);
+    TFS_Driver_UnlockInode(self, file->inode_idx);
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return result;
+}
+
+// removes name from parent dir, freeing the child
+// returns child idx, 0 if it is a non-empty dir, or TFS_ENOENT
+static int TFS_Driver_DeleteChild(TFS_Driver* self, TFS_Inode* parent, const char* name) {
+    if (parent->type != TFS_INODE_DIR) {
         return TFS_ENOENT;
     }
-    
+    int child_idx = TFS_Driver_DirLookup(self, parent, name);
+    if (child_idx <= 0) {
+        return TFS_ENOENT;
+    }
+
     TFS_Inode* child = malloc(sizeof(TFS_Inode));
-    int child_idx = inode->dir.entries[dirent_idx].inode_idx;
     TFS_Driver_GetInode(self, child_idx, child);
 
     switch (child->type) {
         case TFS_INODE_DIR:
             if (child->dir.children_cnt != 0) {
-                free(inode);
                 free(child);
                 return 0;
             }
+            TFS_Driver_FreeInode(self, child);
             break;
         case TFS_INODE_FILE:
+            // wait for readers still holding the file
+            TFS_Driver_LockInode(self, child_idx, true);
             TFS_Driver_RmFileInode(self, child);
+            TFS_Driver_UnlockInode(self, child_idx);
             break;
         default:
             assert(false);
     }
 
-    TFS_Driver_FreeInode(self, child); // XXX: duplicate call for file
-    assert(TFS_Inode_Dir_DeleteChildAt(&inode->dir, dirent_idx));
-    TFS_Driver_PutInode(self, inode_idx, inode);
+    int removed_idx = TFS_Driver_DirRemove(self, parent, name);
+    assert(removed_idx == child_idx);
+    (void)removed_idx;
+    TFS_Driver_PutInode(self, parent->inode_idx, parent);
 
-    free(inode);
     free(child);
     return child_idx;
 }
 
+static int TFS_Driver_DeleteByPathUnlocked(TFS_Driver* self, const TFS_Path* path) {
+    if (path->size < 1) {
+        return TFS_ENOENT;
+    }
+
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_GetInode(self, TFS_ROOT_INODE_IDX, inode);
+    int inode_idx = TFS_Path_TraverseSlice(path, inode, 0, path->size - 1, self);
+    if (inode_idx <= 0) {
+        free(inode);
+        return TFS_ENOENT; // if not enoent?
+    }
+
+    int result = TFS_Driver_DeleteChild(self, inode, path->components[path->size - 1]);
+    free(inode);
+    return result;
+}
+
+int TFS_Driver_DeleteByPath(TFS_Driver* self, const TFS_Path* path) {
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockNamespace(self, true);
+    int result = TFS_Driver_DeleteByPathUnlocked(self, path);
+    TFS_Driver_UnlockNamespace(self);
+    TFS_Driver_EndOp(self);
+    return result;
+}
+
 int TFS_Driver_DeleteByRawPath(TFS_Driver* self, const char* raw_path) {
     TFS_Path path;
     int path_init_code = TFS_Path_Init(&path, raw_path);
@@ -548,46 +3045,102 @@ int TFS_Driver_DeleteByRawPath(TFS_Driver* self, const char* raw_path) {
     return result;
 }
 
-int TFS_Driver_MvPath(TFS_Driver* self, const TFS_Path* from_path, const TFS_Path* to_path) {
+// true if path is a prefix of other
+static bool TFS_Path_IsPrefix(const TFS_Path* path, const TFS_Path* other) {
+    if (path->size > other->size) {
+        return false;
+    }
+    for (int i = 0; i < path->size; ++i) {
+        if (strcmp(path->components[i], other->components[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// moves entry between (possibly same) dirs, both must be dirs
+// WARNING! Only checks that a dir is not moved into itself, deeper loops are up to the caller
+static int TFS_Driver_MvChild(TFS_Driver* self, TFS_Inode* from_parent, const char* from_name, TFS_Inode* to_parent, const char* to_name) {
+    int from_parent_idx = from_parent->inode_idx;
+    int to_parent_idx = to_parent->inode_idx;
+    int result = TFS_Driver_DirLookup(self, from_parent, from_name);
+    if (result <= 0 || (from_parent_idx == to_parent_idx && strcmp(from_name, to_name) == 0)) {
+        return result;
+    }
+    if (result == to_parent_idx) {
+        return TFS_EINVAL;
+    }
+    if (TFS_Driver_DirLookup(self, to_parent, to_name) > 0) {
+        return TFS_EEXISTS;
+    }
+    if (strlen(to_name) + 1 > sizeof(to_parent->dir.entries[0].name)) {
+        return TFS_ENAMETOOLONG;
+    }
+
+    if (from_parent_idx == to_parent_idx) {
+        // name hash changes, so entry is moved rather than renamed in place
+        TFS_Driver_DirRemove(self, from_parent, from_name);
+        int insert_code = TFS_Driver_DirInsert(self, from_parent, to_name, result);
+        if (insert_code <= 0) {
+            // slot of the removed entry is still free
+            TFS_Driver_DirInsert(self, from_parent, from_name, result);
+            result = insert_code;
+        }
+        TFS_Driver_PutInode(self, from_parent_idx, from_parent);
+    } else {
+        // insert first, so there is nothing to roll back on failure
+        int insert_code = TFS_Driver_DirInsert(self, to_parent, to_name, result);
+        if (insert_code <= 0) {
+            return insert_code;
+        }
+        TFS_Driver_DirRemove(self, from_parent, from_name);
+        TFS_Driver_PutInode(self, to_parent_idx, to_parent);
+        TFS_Driver_PutInode(self, from_parent_idx, from_parent);
+    }
+    return result;
+}
+
+static int TFS_Driver_MvPathUnlocked(TFS_Driver* self, const TFS_Path* from_path, const TFS_Path* to_path) {
     if (from_path->size < 1 || to_path->size < 1) {
         return TFS_ENOENT;
     }
-    TFS_Inode* inodes = malloc(sizeof(TFS_Inode) * 4);
-
+    // dir can't be moved into its' own subtree
+    if (from_path->size < to_path->size && TFS_Path_IsPrefix(from_path, to_path)) {
+        return TFS_EINVAL;
+    }
+    TFS_Inode* inodes = malloc(sizeof(TFS_Inode) * 2);
     TFS_Inode* from_parent = inodes;
-    //TFS_Inode* from_child = inodes + 1;
-    TFS_Inode* to_parent = inodes + 2;
-    //TFS_Inode* to_child = inodes + 3;
+    TFS_Inode* to_parent = inodes + 1;
 
     TFS_Driver_GetInode(self, TFS_ROOT_INODE_IDX, from_parent);
     int from_parent_idx = TFS_Path_TraverseSlice(from_path, from_parent, 0, from_path->size - 1, self);
-    if (from_parent_idx == 0 || from_parent->type != TFS_INODE_DIR) {
+    if (from_parent_idx <= 0 || from_parent->type != TFS_INODE_DIR) {
         free(inodes);
         return TFS_ENOENT;
     }
 
     TFS_Driver_GetInode(self, TFS_ROOT_INODE_IDX, to_parent);
     int to_parent_idx = TFS_Path_TraverseSlice(to_path, to_parent, 0, to_path->size - 1, self);
-    if (to_parent_idx == 0 || to_parent->type != TFS_INODE_DIR) {
-        free(inodes);
-        return TFS_ENOENT;
-    }
-
-    if (from_parent_idx != to_parent_idx) {
-        // TODO: not implemented
+    if (to_parent_idx <= 0 || to_parent->type != TFS_INODE_DIR) {
         free(inodes);
         return TFS_ENOENT;
     }
 
-    TFS_Inode_DirEnt* dirent = TFS_Inode_Dir_FindChild(&from_parent->dir, from_path->components[from_path->size - 1]);
-    strcpy(dirent->name, to_path->components[to_path->size - 1]);
-    TFS_Driver_PutInode(self, from_parent_idx, from_parent);
-
-    int result = dirent->inode_idx;
+    int result = TFS_Driver_MvChild(self, from_parent, from_path->components[from_path->size - 1],
+        to_parent, to_path->components[to_path->size - 1]);
     free(inodes);
     return result;
 }
 
+int TFS_Driver_MvPath(TFS_Driver* self, const TFS_Path* from_path, const TFS_Path* to_path) {
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockNamespace(self, true);
+    int result = TFS_Driver_MvPathUnlocked(self, from_path, to_path);
+    TFS_Driver_UnlockNamespace(self);
+    TFS_Driver_EndOp(self);
+    return result;
+}
+
 int TFS_Driver_MvRawPath(TFS_Driver* self, const char* from_path_raw, const char* to_path_raw) {
     TFS_Path from_path, to_path;
     int path_init_code = TFS_Path_Init(&from_path, from_path_raw);
@@ -603,3 +3156,156 @@ int TFS_Driver_MvRawPath(TFS_Driver* self, const char* from_path_raw, const char
     TFS_Path_Destruct(&to_path);
     return result;
 }
+
+// inode idx based operations
+
+static bool TFS_Driver_IsInodeIdxValid(TFS_Driver* self, int inode_idx) {
+    return 1 <= inode_idx && inode_idx <= 8 * self->super_block.inode_map_size;
+}
+
+// reads dir inode, namespace lock must be held
+static int TFS_Driver_GetDirInode(TFS_Driver* self, int dir_idx, TFS_Inode* inode) {
+    if (!TFS_Driver_IsInodeIdxValid(self, dir_idx)) {
+        return TFS_ENOENT;
+    }
+    TFS_Driver_GetInode(self, dir_idx, inode);
+    return inode->type == TFS_INODE_DIR ? dir_idx : TFS_ENOENT;
+}
+
+// same as TFS_Driver_LockPathInode, but by idx; free inode is TFS_ENOENT
+static int TFS_Driver_LockIdxInode(TFS_Driver* self, int inode_idx, TFS_Inode* inode, bool exclusive) {
+    if (!TFS_Driver_IsInodeIdxValid(self, inode_idx)) {
+        return TFS_ENOENT;
+    }
+    TFS_Driver_LockNamespace(self, false);
+    TFS_Driver_LockInode(self, inode_idx, exclusive);
+    TFS_Driver_GetInode(self, inode_idx, inode);
+    if (inode->type == TFS_INODE_FREE) {
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+        return TFS_ENOENT;
+    }
+    return inode_idx;
+}
+
+int TFS_Driver_GetInodeByIdx(TFS_Driver* self, int inode_idx, TFS_Inode* inode) {
+    inode_idx = TFS_Driver_LockIdxInode(self, inode_idx, inode, false);
+    if (inode_idx > 0) {
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    return inode_idx;
+}
+
+int TFS_Driver_LookupAt(TFS_Driver* self, int parent_idx, const char* name, TFS_Inode* inode) {
+    TFS_Driver_LockNamespace(self, false);
+    int child_idx = TFS_ENOENT;
+    if (!TFS_Driver_IsInodeIdxValid(self, parent_idx)) {
+        // nothing
+    } else if (TFS_Driver_DentryLookup(self, parent_idx, name, &child_idx)) {
+        child_idx = child_idx > 0 ? child_idx : TFS_ENOENT;
+    } else {
+        const TFS_Inode* parent = TFS_Driver_MapOrGetInode(self, parent_idx, inode);
+        if (parent->type == TFS_INODE_DIR) {
+            child_idx = TFS_Driver_DirLookup(self, parent, name);
+        }
+    }
+    if (child_idx > 0) {
+        TFS_Driver_LockInode(self, child_idx, false);
+        TFS_Driver_GetInode(self, child_idx, inode);
+        TFS_Driver_UnlockInode(self, child_idx);
+    }
+    TFS_Driver_UnlockNamespace(self);
+    return child_idx;
+}
+
+int TFS_Driver_CreateAt(TFS_Driver* self, int parent_idx, const char* name, enum TFS_InodeType type, TFS_Inode* inode) {
+    TFS_Inode* parent = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockNamespace(self, true);
+    int inode_idx = TFS_Driver_GetDirInode(self, parent_idx, parent);
+    if (inode_idx > 0) {
+        inode_idx = TFS_Driver_CreateChildInode(self, parent, inode, name, type);
+    }
+    TFS_Driver_UnlockNamespace(self);
+    TFS_Driver_EndOp(self);
+    free(parent);
+    return inode_idx;
+}
+
+int TFS_Driver_DeleteAt(TFS_Driver* self, int parent_idx, const char* name) {
+    TFS_Inode* parent = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockNamespace(self, true);
+    int result = TFS_Driver_GetDirInode(self, parent_idx, parent);
+    if (result > 0) {
+        result = TFS_Driver_DeleteChild(self, parent, name);
+    }
+    TFS_Driver_UnlockNamespace(self);
+    TFS_Driver_EndOp(self);
+    free(parent);
+    return result;
+}
+
+int TFS_Driver_MvAt(TFS_Driver* self, int from_parent_idx, const char* from_name, int to_parent_idx, const char* to_name) {
+    TFS_Inode* inodes = malloc(sizeof(TFS_Inode) * 2);
+    TFS_Driver_BeginOp(self);
+    TFS_Driver_LockNamespace(self, true);
+    int result = TFS_Driver_GetDirInode(self, from_parent_idx, inodes);
+    if (result > 0) {
+        result = TFS_Driver_GetDirInode(self, to_parent_idx, inodes + 1);
+    }
+    if (result > 0) {
+        result = TFS_Driver_MvChild(self, inodes, from_name, inodes + 1, to_name);
+    }
+    TFS_Driver_UnlockNamespace(self);
+    TFS_Driver_EndOp(self);
+    free(inodes);
+    return result;
+}
+
+int TFS_Driver_ReadDirAt(TFS_Driver* self, int dir_idx, int64_t* cookie, TFS_Inode_DirEnt* entries, int max) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_LockIdxInode(self, dir_idx, inode, false);
+    int cnt = inode_idx;
+    if (inode_idx > 0) {
+        cnt = inode->type == TFS_INODE_DIR ? TFS_Driver_ReadDirEntries(self, inode, cookie, entries, max) : TFS_ENOENT;
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    free(inode);
+    return cnt;
+}
+
+int TFS_Driver_ReadDirAttrsAt(TFS_Driver* self, int dir_idx, int64_t* cookie, TFS_DirEntry* entries, int max) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int inode_idx = TFS_Driver_LockIdxInode(self, dir_idx, inode, false);
+    int cnt = inode_idx;
+    if (inode_idx > 0) {
+        cnt = inode->type == TFS_INODE_DIR ? TFS_Driver_ReadDirAttrs(self, inode, cookie, entries, max) : TFS_ENOENT;
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    free(inode);
+    return cnt;
+}
+
+int TFS_Driver_TruncateAt(TFS_Driver* self, int inode_idx, int64_t size) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    TFS_Driver_BeginOp(self);
+    int result = TFS_Driver_LockIdxInode(self, inode_idx, inode, true);
+    if (result > 0) {
+        result = inode->type == TFS_INODE_FILE ? TFS_Driver_Truncate(self, inode, size) : TFS_ENOENT;
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    TFS_Driver_EndOp(self);
+    free(inode);
+    return result;
+}
+
+int TFS_Driver_OpenFileAt(TFS_Driver* self, int inode_idx, TFS_File** file) {
+    TFS_Inode* inode = malloc(sizeof(TFS_Inode));
+    int result = TFS_Driver_LockIdxInode(self, inode_idx, inode, false);
+    if (result > 0) {
+        result = TFS_Driver_NewFile(self, inode, file);
+        TFS_Driver_UnlockPathInode(self, inode_idx);
+    }
+    free(inode);
+    return result;
+}
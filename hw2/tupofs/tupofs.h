@@ -2,23 +2,60 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
-#define TFS_SECTOR_SIZE 2048
-#define TFS_INODE_DATA_SIZE 2016 // TFS_SECTOR_SIZE - 32
-#define TFS_MAX_BLOCKS_PER_FILE 503 // TFS_INODE_DATA_SIZE / sizeof(int) - 1
-#define TFS_MAX_DIR_INODE_CHILDREN 62 // (TFS_INODE_DATA_SIZE - sizeof(int)) / 32
-
-#define TFS_MAX_FILE_SIZE 1030144 // TFS_SECTOR_SIZE * TFS_MAX_BLOCKS_PER_FILE 
+#include "tfs_cache.h"
+#include "tfs_backend.h"
+#include "tfs_dcache.h"
+#include "tfs_journal.h"
 
-#define TFS_INODEMAP_BLOCK_IDX 1
-#define TFS_DATAMAP_BLOCK_IDX 2
+#define TFS_SECTOR_SIZE 2048
+#define TFS_INODE_SIZE 256
+#define TFS_INODES_PER_BLOCK 8 // TFS_SECTOR_SIZE / TFS_INODE_SIZE
+#define TFS_INODE_DATA_SIZE 240 // TFS_INODE_SIZE - 16
+#define TFS_INODE_EXTENTS 14 // (TFS_INODE_DATA_SIZE - 16) / sizeof(TFS_FileExtent)
+#define TFS_INODE_INLINE_SIZE 224 // TFS_INODE_DATA_SIZE - 16, bytes of file data kept inside the inode
+#define TFS_INDEX_LEAVES 256 // TFS_SECTOR_SIZE / sizeof(TFS_ExtentIndex)
+#define TFS_LEAF_EXTENTS 127 // (TFS_SECTOR_SIZE - 16) / sizeof(TFS_FileExtent)
+#define TFS_MAX_FILE_EXTENTS 32512 // TFS_INDEX_LEAVES * TFS_LEAF_EXTENTS
+#define TFS_MAX_DIR_INODE_CHILDREN 7 // (TFS_INODE_DATA_SIZE - 16) / sizeof(TFS_Inode_DirEnt)
+#define TFS_DIR_BUCKET_ENTRIES 63 // (TFS_SECTOR_SIZE - 32) / sizeof(TFS_Inode_DirEnt)
+#define TFS_DIR_MAX_BUCKETS 512 // TFS_SECTOR_SIZE / sizeof(int)
+#define TFS_COMPRESS_FRAME_BLOCKS 32 // 64 KB of file data per compressed extent
+
+// superblock version: 0 - flat block list per file, 1 - extents, 2 - hashed directories,
+// 3 - region layout in superblock, bitmaps of many blocks, 4 - metadata journal, 5 - inline data of small files,
+// 6 - inodes packed 8 per block, leaf index and bucket table out of line, 7 - compressed extents
+#define TFS_FORMAT_VERSION 7
+
+#define TFS_DEFAULT_MAP_SIZE TFS_SECTOR_SIZE // bytes, one block per bitmap
+#define TFS_MAX_MAP_SIZE (1 << 27) // bytes, 2^30 inodes/blocks = 2 TB
+#define TFS_MAP_BLOCK_BITS (8 * TFS_SECTOR_SIZE)
 
 #define TFS_ROOT_INODE_IDX 1
 
+#define TFS_DEFAULT_CACHE_BLOCKS 512 // 1 MB
+#define TFS_DEFAULT_DENTRY_CACHE 4096
+#define TFS_INODE_LOCK_STRIPES 64
+#define TFS_FORMAT_BATCH 64 // inode blocks per write while formatting
+#define TFS_DEFAULT_JOURNAL_BLOCKS 1024 // 2 MB
+#define TFS_COMMIT_INTERVAL_MS 1000 // background group commit
+
+// block numbers are 32-bit: up to 2^31 blocks of 2 KB = 4 TB, byte offsets are always 64-bit
 typedef struct TFS_SuperBlock {
     char magic[16];
-    int inode_map_size;
-    int data_map_size;
+    int inode_map_size; // bytes, 8 inodes each
+    int data_map_size; // bytes, 8 data blocks each
+    int version; // TFS_FORMAT_VERSION
+    // region layout fixed at format time: superblock, inode map, data map, journal, inodes, data
+    int inode_map_start;
+    int data_map_start;
+    int inode_start;
+    int data_start;
+    int block_cnt; // whole image
+    int journal_start;
+    int journal_blocks; // 0 - no journal
 } TFS_SuperBlock;
 
 enum TFS_InodeType {
@@ -27,16 +64,80 @@ enum TFS_InodeType {
     TFS_INODE_FILE,
 };
 
+// run of contiguous data blocks, нумерация с 1 относительно начала data-блоков
+typedef struct TFS_Extent {
+    int start;
+    int len;
+} TFS_Extent;
+
+// extent of file data: file blocks [logical, logical + len) are stored in data blocks [start, start + len);
+// compressed extent holds a whole frame instead, file blocks [logical, logical + TFS_COMPRESS_FRAME_BLOCKS)
+// (fewer at EOF) packed by TFS_Lz_Compress into clen bytes of its len data blocks
+typedef struct TFS_FileExtent {
+    int logical;
+    int start;
+    int len;
+    int clen; // 0 - not compressed
+} TFS_FileExtent;
+
+_Static_assert(sizeof(struct TFS_FileExtent) == 16, "");
+
+// leaf block with extents starting from file block `logical`
+typedef struct TFS_ExtentIndex {
+    int logical;
+    int data_idx;
+} TFS_ExtentIndex;
+
+// index of leaf blocks, takes a whole data block
+typedef struct TFS_ExtentIndexBlock {
+    TFS_ExtentIndex leaves[TFS_INDEX_LEAVES];
+} TFS_ExtentIndexBlock;
+
+_Static_assert(sizeof(struct TFS_ExtentIndexBlock) == TFS_SECTOR_SIZE, "");
+
+typedef struct TFS_ExtentLeaf {
+    int extent_cnt;
+    int reserved[3];
+    TFS_FileExtent extents[TFS_LEAF_EXTENTS];
+} TFS_ExtentLeaf;
+
+_Static_assert(sizeof(struct TFS_ExtentLeaf) == TFS_SECTOR_SIZE, "");
+
+#define TFS_FILE_INLINE (-1) // index_cnt of a file without data blocks
+
 typedef struct TFS_Inode_File {
-    int file_size;
-    // нумерация с 1 относительно начала data-блоков; null-terminated
-    int used_blocks[TFS_MAX_BLOCKS_PER_FILE];
+    int64_t file_size;
+    int extent_cnt;
+    // 0 - extents are inline, TFS_FILE_INLINE - data itself is inline (extent_cnt is 0),
+    // otherwise extents are in index_cnt leaf blocks listed by index block
+    int index_cnt;
+    // extents and leaves of index are sorted by logical
+    union {
+        TFS_FileExtent extents[TFS_INODE_EXTENTS];
+        int index_block; // data idx of TFS_ExtentIndexBlock
+        char data[TFS_INODE_INLINE_SIZE]; // zeroes past file_size
+    };
 } TFS_Inode_File;
 
 _Static_assert(sizeof(struct TFS_Inode_File) == TFS_INODE_DATA_SIZE, "");
 
+// new files start inline and are moved to data blocks once they grow past TFS_INODE_INLINE_SIZE
+bool TFS_Inode_File_IsInline(const TFS_Inode_File* self);
+
+// blocks of file data, 0 if it is inline (compressed ones take fewer data blocks)
 int TFS_Inode_File_GetBlockCnt(const TFS_Inode_File* self);
 
+// number of contiguous runs the file's data is split into
+int TFS_Inode_File_GetExtentCnt(const TFS_Inode_File* self);
+
+typedef struct TFS_FragStats {
+    int free_blocks;
+    int free_runs;
+    int largest_free_run;
+    // 1 - largest_free_run / free_blocks: 0 when all free space is one run
+    double fragmentation;
+} TFS_FragStats;
+
 typedef struct TFS_Inode_DirEnt {
     int inode_idx;
     char name[28];
@@ -44,25 +145,54 @@ typedef struct TFS_Inode_DirEnt {
 
 _Static_assert(sizeof(struct TFS_Inode_DirEnt) == 32, "");
 
+// data idx of every bucket of a hashed directory, takes a whole data block
+typedef struct TFS_DirBucketTable {
+    int buckets[TFS_DIR_MAX_BUCKETS];
+} TFS_DirBucketTable;
+
+_Static_assert(sizeof(struct TFS_DirBucketTable) == TFS_SECTOR_SIZE, "");
+
+// one bucket of a hashed directory, takes a whole data block
+typedef struct TFS_DirBucket {
+    int entry_cnt;
+    int reserved[7];
+    TFS_Inode_DirEnt entries[TFS_DIR_BUCKET_ENTRIES];
+} TFS_DirBucket;
+
+_Static_assert(sizeof(struct TFS_DirBucket) == TFS_SECTOR_SIZE, "");
+
 typedef struct TFS_Inode_Dir {
     int children_cnt;
-    TFS_Inode_DirEnt entries[TFS_MAX_DIR_INODE_CHILDREN];
+    // 0 - entries are inline, otherwise names are spread over bucket_cnt bucket blocks by linear hashing:
+    // bucket = hash % 2^hash_level, or hash % 2^(hash_level + 1) if that is less than split_idx
+    int bucket_cnt;
+    int hash_level;
+    int split_idx;
+    union {
+        TFS_Inode_DirEnt entries[TFS_MAX_DIR_INODE_CHILDREN];
+        int bucket_table; // data idx of TFS_DirBucketTable
+    };
 } TFS_Inode_Dir;
 
-_Static_assert(sizeof(struct TFS_Inode_File) == TFS_INODE_DATA_SIZE, "");
+_Static_assert(sizeof(struct TFS_Inode_Dir) == TFS_INODE_DATA_SIZE, "");
 
 typedef struct TFS_Inode TFS_Inode;
 
+// inline entries only, see TFS_Driver_Dir* for directories of any size
 // WARNING! Does not write anything back to disk
 TFS_Inode_DirEnt* TFS_Inode_Dir_AppendChild(TFS_Inode_Dir* self, TFS_Inode* child, const char* name);
 bool TFS_Inode_Dir_DeleteChildAt(TFS_Inode_Dir* self, int idx);
 
-int TFS_Inode_Dir_FindChildIdx(TFS_Inode_Dir* self, const char* name);
+int TFS_Inode_Dir_FindChildIdx(const TFS_Inode_Dir* self, const char* name);
 TFS_Inode_DirEnt* TFS_Inode_Dir_FindChild(TFS_Inode_Dir* self, const char* name);
 
+#define TFS_INODE_COMPRESSED 1 // file has compressed extents
+
+// TFS_INODES_PER_BLOCK of them are packed into each block of inode region
 typedef struct TFS_Inode {
     char type;  // TFS_InodeType
-    char padding[27];
+    char flags; // TFS_INODE_*
+    char padding[10];
     int inode_idx;
     union {
         TFS_Inode_File file;
@@ -70,11 +200,62 @@ typedef struct TFS_Inode {
     };
 } TFS_Inode;
 
-_Static_assert(sizeof(struct TFS_Inode) == TFS_SECTOR_SIZE, "");
+_Static_assert(sizeof(struct TFS_Inode) == TFS_INODE_SIZE, "");
+
+// resident copy of a bitmap stored in `blocks` image blocks from `first_block`
+// with a summary level on top: free bits per bitmap block, so searches skip full blocks
+// and the free total is known without counting
+typedef struct TFS_SpaceMap {
+    char* bits; // blocks * TFS_SECTOR_SIZE, zeroes past size
+    int size; // bytes
+    int first_block;
+    int blocks;
+    int* free_cnt;
+    int free_total;
+    bool* dirty; // bitmap blocks changed since the last commit (or TFS_Driver_Sync without journal)
+} TFS_SpaceMap;
 
 typedef struct TFS_Driver {
     TFS_SuperBlock super_block;
-    FILE* file;
+    TFS_Backend backend;
+    TFS_BlockCache cache;
+    // name lookups, kept up to date by TFS_Driver_DirInsert/DirRemove and TFS_Driver_FreeInode
+    TFS_DentryCache dentries;
+
+    // resident inode and data bitmaps
+    TFS_SpaceMap inode_map;
+    TFS_SpaceMap data_map;
+
+    // next fit allocation starts here (0-based data idx)
+    int alloc_cursor;
+
+    // bumped by every TFS_Driver_PutInode, lets open files notice their cached copy is stale
+    uint32_t* inode_gens;
+
+    // TFS_Driver_WriteFile compresses data, see TFS_Driver_SetCompression
+    bool compress;
+
+    // metadata journal: blocks written by operations are held in cache until the group commit
+    // logs them; off for mapped and in-memory images and without cache, then writes go in place
+    TFS_Journal journal;
+    bool journaling;
+    pthread_t committer;
+    pthread_mutex_t committer_lock;
+    pthread_cond_t committer_cond;
+    bool committer_stop;
+
+    // locking order: txn_lock -> ns_lock -> inode_locks -> map_lock -> inode_table_lock -> journal.lock -> cache_lock / dentry_lock
+    // operations: shared while an operation changes blocks, exclusive for commit
+    pthread_rwlock_t txn_lock;
+    // directory tree: shared for path walks and readdir, exclusive for create/delete/mv
+    pthread_rwlock_t ns_lock;
+    // file contents, striped by inode idx; hold at most one at a time
+    pthread_rwlock_t inode_locks[TFS_INODE_LOCK_STRIPES];
+    pthread_mutex_t map_lock; // bitmaps and alloc_cursor
+    // read-modify-write of inode blocks: inodes sharing a block may be put by different threads
+    pthread_mutex_t inode_table_lock;
+    pthread_mutex_t cache_lock;
+    pthread_mutex_t dentry_lock;
 } TFS_Driver;
 
 // find first cnt free bits in specified bitmap and save to free_idxes
@@ -86,23 +267,88 @@ void TFS_Bitmap_SetBits(char* bitmap, int size, const int* idxes, int cnt, bool
 
 void TFS_Bitmap_SetBit(char* bitmap, int size, int idx, bool bit);
 
+// bitmap[begin, begin + cnt) = bit
+void TFS_Bitmap_SetRange(char* bitmap, int size, int begin, int cnt, bool bit);
+
 bool TFS_Bitmap_GetBit(const char* bitmap, int size, int idx);
 
-// открывает файл на r+, проверяет и загружает основную информацию об ФС
+int TFS_Bitmap_CountSet(const char* bitmap, int size);
+
+// number of set bits in bitmap[begin, begin + cnt)
+int TFS_Bitmap_CountRange(const char* bitmap, int size, int begin, int cnt);
+
+// index of first bit equal to bit at or after from, size * 8 if there is none
+int TFS_Bitmap_FindNext(const char* bitmap, int size, int from, bool bit);
+
+// берет открытый backend (см. TFS_Backend_Open), проверяет и загружает основную информацию об ФС
 // в случае create создает все
-void TFS_Driver_Init(TFS_Driver* self, FILE* file, bool create);
+// returns TFS_ESUCC or TFS_EBADFS (backend is closed then)
+int TFS_Driver_Init(TFS_Driver* self, const TFS_Backend* backend, bool create);
+
+// formats backend with given bitmap sizes in bytes (1..TFS_MAX_MAP_SIZE, 8 inodes/blocks each)
+// and journal size in blocks (0 or TFS_JOURNAL_MIN_BLOCKS..TFS_JOURNAL_MAX_BLOCKS) and opens it;
+// bitmaps take as many blocks as needed, the whole image must stay under 2^31 blocks
+// returns TFS_ESUCC or TFS_EINVAL (backend is closed then)
+int TFS_Driver_Create(TFS_Driver* self, const TFS_Backend* backend, int inode_map_size, int data_map_size, int journal_blocks);
+
+// syncs and closes the backend
 void TFS_Driver_Destruct(TFS_Driver* self);
 
+// concurrency: highlevel *ByPath/*ByRawPath operations take the locks they need themselves,
+// block I/O, bitmaps and caches are always safe to use; the rest (calls taking TFS_Inode*) expect
+// the namespace lock to be held, exclusively when dirs are modified, and the inode lock for file contents
+void TFS_Driver_LockNamespace(TFS_Driver* self, bool exclusive);
+void TFS_Driver_UnlockNamespace(TFS_Driver* self);
+void TFS_Driver_LockInode(TFS_Driver* self, int inode_idx, bool exclusive);
+void TFS_Driver_UnlockInode(TFS_Driver* self, int inode_idx);
+
+// writes back bitmaps and all dirty cached blocks, then syncs the backend;
+// with journal everything is committed and checkpointed first, so the log is empty after it
+void TFS_Driver_Sync(TFS_Driver* self);
+
+// journal transactions: blocks changed between BeginOp and EndOp are committed together;
+// highlevel operations do it themselves, commits wait for operations in progress to end;
+// single block writes of the operation are batched per thread and written once each, in block order,
+// when it unlocks the namespace or an inode (or at EndOp); operations don't nest
+void TFS_Driver_BeginOp(TFS_Driver* self);
+void TFS_Driver_EndOp(TFS_Driver* self);
+
+// group commit: logs bitmaps and cached blocks changed by all finished operations as one transaction
+// (one write and one sync), checkpointing first if the log is full; no-op without journal
+void TFS_Driver_Commit(TFS_Driver* self);
+
+// syncs and replaces block cache with an empty one of given size (0 disables caching)
+void TFS_Driver_SetCacheSize(TFS_Driver* self, int blocks);
+
+// off by default: whole-file writes (TFS_Driver_WriteFile, TFS_Driver_FileReplace) store every frame
+// of TFS_COMPRESS_FRAME_BLOCKS that shrinks by a block or more as a compressed extent, the rest as is;
+// files written otherwise are never compressed
+void TFS_Driver_SetCompression(TFS_Driver* self, bool enabled);
+
 // читает целиком блок-сектор по адресу (с нуля)
+// goes through the block cache, see TFS_Driver_Sync
 void TFS_Driver_ReadBlock(TFS_Driver* self, int block_idx, void* buf);
 
 // пишет целиком блок-сектор по адресу (с нуля)
 void TFS_Driver_WriteBlock(TFS_Driver* self, int block_idx, const void* buf);
 
+// cnt consecutive blocks in one backend I/O, coherent with the cache but not populating it
+void TFS_Driver_ReadBlocks(TFS_Driver* self, int block_idx, int cnt, void* buf);
+void TFS_Driver_WriteBlocks(TFS_Driver* self, int block_idx, int cnt, const void* buf);
+
+// pointer to the block inside mapped image (TFS_BACKEND_MMAP with cache disabled), otherwise NULL
+// WARNING! Points to live on-disk data, don't write through it
+const void* TFS_Driver_MapBlock(TFS_Driver* self, int block_idx);
+
 // нумерация с 1 относительно начала inode-блоков
+// block holding the inode, TFS_INODES_PER_BLOCK consecutive inodes per block
 int TFS_Driver_GetInodeBlockIdx(TFS_Driver* self, int inode_idx);
 void TFS_Driver_GetInode(TFS_Driver* self, int inode_idx, TFS_Inode* inode);
+// zero-copy version of GetInode, NULL if image is not mapped
+const TFS_Inode* TFS_Driver_MapInode(TFS_Driver* self, int inode_idx);
 void TFS_Driver_PutInode(TFS_Driver* self, int inode_idx, const TFS_Inode* inode);
+uint32_t TFS_Driver_GetInodeGen(TFS_Driver* self, int inode_idx);
+// free inode is not reserved until SetInodeOccupied, so allocate under exclusive namespace lock
 int TFS_Driver_FindFreeInodeIdx(TFS_Driver* self);
 void TFS_Driver_GetFreeInode(TFS_Driver* self, TFS_Inode* inode);
 void TFS_Driver_SetInodeOccupied(TFS_Driver* self, int inode_idx, bool occupied);
@@ -112,10 +358,24 @@ void TFS_Driver_FreeInodeByIdx(TFS_Driver* self, int inode_idx);
 // нумерация с 1 относительно начала data-блоков
 int TFS_Driver_GetDataBlockIdx(TFS_Driver* self, int data_idx);
 void TFS_Driver_GetData(TFS_Driver* self, int data_idx, void* data);
+// zero-copy version of GetData, NULL if image is not mapped
+const void* TFS_Driver_MapData(TFS_Driver* self, int data_idx);
 void TFS_Driver_PutData(TFS_Driver* self, int data_idx, const void* data);
 void TFS_Driver_SetDataBlockOccupied(TFS_Driver* self, int data_idx, bool occupied);
 void TFS_Driver_FreeDataBlockByIdx(TFS_Driver* self, int data_idx);
 
+// allocates blocks as few contiguous extents as possible: next fit from a rotating cursor,
+// falling back to largest free runs first; returns extent count or TFS_ENOSPACE
+int TFS_Driver_AllocExtents(TFS_Driver* self, int blocks, TFS_Extent* extents, int max_extents);
+void TFS_Driver_FreeExtents(TFS_Driver* self, const TFS_Extent* extents, int cnt);
+
+// free inodes / data blocks, from the bitmap summaries
+int TFS_Driver_GetFreeInodeCnt(TFS_Driver* self);
+int TFS_Driver_GetFreeDataCnt(TFS_Driver* self);
+
+// free space fragmentation of data region
+void TFS_Driver_GetFragStats(TFS_Driver* self, TFS_FragStats* stats);
+
 // does nothing to parent inode
 int TFS_Driver_CreateInode(TFS_Driver* self, TFS_Inode* inode, enum TFS_InodeType type);
 
@@ -125,12 +385,68 @@ int TFS_Driver_CreateChildInode(TFS_Driver* self, TFS_Inode* parent, TFS_Inode*
 // deletes inode and erases it from dir's children
 bool TFS_Driver_DeleteChildNode(TFS_Driver* self, TFS_Inode* parent, TFS_Inode* child);
 
+// directory entries, inline or hashed
+
+// child inode idx or TFS_ENOENT, answered from dentry cache when possible
+int TFS_Driver_DirLookup(TFS_Driver* self, const TFS_Inode* dir, const char* name);
+
+// adds entry, converting dir to hashed format once inline entries are full
+// returns TFS_ESUCC, TFS_EEXISTS, TFS_ENAMETOOLONG or TFS_ENOSPACE
+// WARNING! Bucket blocks are written, but dir inode is not put
+int TFS_Driver_DirInsert(TFS_Driver* self, TFS_Inode* dir, const char* name, int child_idx);
+
+// removes entry and returns its' inode idx or TFS_ENOENT; empty dir gets its' buckets freed
+// WARNING! Does not put dir inode
+int TFS_Driver_DirRemove(TFS_Driver* self, TFS_Inode* dir, const char* name);
+
+// streams up to max entries starting at *cookie (0 for the first call), advances cookie
+// returns number of entries, 0 at the end; order is stable while dir is not modified
+int TFS_Driver_ReadDirEntries(TFS_Driver* self, const TFS_Inode* dir, int64_t* cookie, TFS_Inode_DirEnt* entries, int max);
+
+// what readdir needs to fill `struct stat` without a getattr per entry
+typedef struct TFS_DirEntry {
+    TFS_Inode_DirEnt ent;
+    int64_t next_cookie; // resumes listing right after this entry
+    char type; // TFS_InodeType
+    int64_t file_size;
+} TFS_DirEntry;
+
+// same as ReadDirEntries plus attributes; child inodes are read in one pass sorted by block
+int TFS_Driver_ReadDirAttrs(TFS_Driver* self, const TFS_Inode* dir, int64_t* cookie, TFS_DirEntry* entries, int max);
+
 // entirely reads file by specified inode into buf and returns its size
 // if buf is NULL, just returns size
 int TFS_Driver_ReadFile(TFS_Driver* self, TFS_Inode* inode, void* buf);
 
+// reads up to size bytes starting at offset, touching only the data blocks in range
+// (compressed frames in range are decompressed whole)
+// returns number of bytes read (0 at or past EOF) or TFS_EBADFS if a frame is corrupt
+int TFS_Driver_ReadFileRange(TFS_Driver* self, TFS_Inode* inode, int64_t offset, int size, void* buf);
+
+// file block -> data idx in O(log extents); *run_len gets number of blocks stored contiguously from there
+// (not for inline and compressed files)
+int TFS_Driver_MapFileBlock(TFS_Driver* self, const TFS_Inode* inode, int file_block, int* run_len);
+
+// reads all extents of file (inline or from leaf blocks) into malloc'd *extents, returns count
+int TFS_Driver_LoadFileMap(TFS_Driver* self, const TFS_Inode* inode, TFS_FileExtent** extents);
+
+// stores extents into inode, inline or in newly allocated leaf blocks and their index block (old ones are freed)
+// WARNING! Does not put inode
+int TFS_Driver_StoreFileMap(TFS_Driver* self, TFS_Inode* inode, const TFS_FileExtent* extents, int cnt);
+
+// replaces file contents, inline if they fit, compressed if it is on; returns size or TFS_ENOSPACE
 int TFS_Driver_WriteFile(TFS_Driver* self, TFS_Inode* inode, const void* buf, int size);
 
+// writes size bytes at offset, touching only the blocks in range; file grows if needed,
+// allocating only the new blocks (a gap past old EOF reads as zeroes); inline file that
+// doesn't fit anymore is moved into a data block first, compressed one is decompressed into plain blocks
+// returns size, TFS_ENOSPACE or TFS_EINVAL
+int TFS_Driver_WriteFileRange(TFS_Driver* self, TFS_Inode* inode, int64_t offset, int size, const void* buf);
+
+// shrinks (releasing blocks past the new end, a file short enough goes inline again)
+// or zero-extends file, compressed one is decompressed first; returns TFS_ESUCC or error
+int TFS_Driver_Truncate(TFS_Driver* self, TFS_Inode* inode, int64_t size);
+
 // frees file inode and its' associated data blocks
 // WARNING! Does not remove ref from parent inode
 void TFS_Driver_RmFileInode(TFS_Driver* self, TFS_Inode* inode);
@@ -164,10 +480,90 @@ int TFS_Driver_CreateIdxByRawPath(TFS_Driver* self, const char* raw_path, enum T
 
 int TFS_Driver_ReadFileByRawPath(TFS_Driver* self, const char* path, void* buf);
 
+// see TFS_Driver_ReadFileRange
+int TFS_Driver_ReadFileRangeByRawPath(TFS_Driver* self, const char* path, int64_t offset, int size, void* buf);
+
+// see TFS_Driver_WriteFileRange and TFS_Driver_Truncate
+int TFS_Driver_WriteFileRangeByRawPath(TFS_Driver* self, const char* path, int64_t offset, int size, const void* buf);
+int TFS_Driver_TruncateByRawPath(TFS_Driver* self, const char* path, int64_t size);
+
+// see TFS_Driver_ReadDirEntries; path is resolved again on every call
+int TFS_Driver_ReadDirByRawPath(TFS_Driver* self, const char* path, int64_t* cookie, TFS_Inode_DirEnt* entries, int max);
+int TFS_Driver_ReadDirAttrsByRawPath(TFS_Driver* self, const char* path, int64_t* cookie, TFS_DirEntry* entries, int max);
+
 int TFS_Driver_WriteFileByRawPath(TFS_Driver* self, const char* path, const void* buf, int size);
 
 int TFS_Driver_DeleteByPath(TFS_Driver* self, const TFS_Path* path);
 int TFS_Driver_DeleteByRawPath(TFS_Driver* self, const char* path);
 
+// moves entry to another name and/or dir; TFS_EEXISTS if target exists,
+// TFS_EINVAL if dir is moved into its' own subtree
 int TFS_Driver_MvPath(TFS_Driver* self, const TFS_Path* from_path, const TFS_Path* to_path);
 int TFS_Driver_MvRawPath(TFS_Driver* self, const char* from_path, const char* to_path);
+
+// open files: inode idx with a cached copy of size and block map, so I/O needs no path walk
+// and no inode/leaf reads; the copy is reloaded when the inode is written by anyone
+
+typedef struct TFS_File {
+    int inode_idx;
+    uint32_t inode_gen; // TFS_Driver_GetInodeGen at the time extents were loaded
+    int64_t file_size;
+    int extent_cnt;
+    TFS_FileExtent* extents;
+    char* data; // copy of inline contents, NULL if the file has data blocks
+    bool compressed; // some of extents are compressed frames
+    pthread_rwlock_t lock; // guards the cached copy
+} TFS_File;
+
+// returns inode idx and malloc'd *file, TFS_ENOENT if path is not a file
+int TFS_Driver_OpenFile(TFS_Driver* self, const char* path, TFS_File** file);
+void TFS_Driver_CloseFile(TFS_Driver* self, TFS_File* file);
+
+// see TFS_Driver_ReadFileRange, TFS_Driver_WriteFileRange, TFS_Driver_Truncate
+int TFS_Driver_FileRead(TFS_Driver* self, TFS_File* file, int64_t offset, int size, void* buf);
+int TFS_Driver_FileWrite(TFS_Driver* self, TFS_File* file, int64_t offset, int size, const void* buf);
+int TFS_Driver_FileTruncate(TFS_Driver* self, TFS_File* file, int64_t size);
+
+// writes at the current end of file, whatever it is by then; see TFS_Driver_WriteFileRange
+int TFS_Driver_FileAppend(TFS_Driver* self, TFS_File* file, int size, const void* buf);
+
+// replaces whole contents; see TFS_Driver_WriteFile
+int TFS_Driver_FileReplace(TFS_Driver* self, TFS_File* file, int size, const void* buf);
+
+// chunk size for streaming a file through FileRead/FileAppend: whole blocks,
+// so every chunk is a few multi-block I/Os and memory use doesn't depend on file size
+#define TFS_STREAM_CHUNK (16 * TFS_SECTOR_SIZE)
+
+// piece of file data as a byte range of the image
+typedef struct TFS_ImageRun {
+    int64_t offset;
+    int size;
+} TFS_ImageRun;
+
+// maps [offset, offset + size) of the file (clamped to EOF) to image runs, one per extent
+// (inline data is a single run inside the inode block),
+// so the data can be read from backend.fd directly (e.g. spliced by FUSE) without copying;
+// dirty cached blocks in range are written back first
+// returns run count (0 at EOF), runs past max_runs are left out; size / TFS_SECTOR_SIZE + 2 always suffice;
+// TFS_EINVAL if the file is compressed, its' data is not in the image as is (read it with FileRead)
+// WARNING! Nothing is locked after return, runs may go stale if the file is written or truncated meanwhile
+int TFS_Driver_FileMapRange(TFS_Driver* self, TFS_File* file, int64_t offset, int size, TFS_ImageRun* runs, int max_runs);
+
+// inode idx based operations: same as the path ones, but start from a known dir idx
+// instead of walking from root (for clients that keep inode numbers, like the low-level FUSE daemon);
+// they lock themselves, free or out of range idx is TFS_ENOENT
+
+// *inode is a consistent copy, returns inode idx
+int TFS_Driver_GetInodeByIdx(TFS_Driver* self, int inode_idx, TFS_Inode* inode);
+// child inode idx and its' copy in *inode, answered from dentry cache when possible
+int TFS_Driver_LookupAt(TFS_Driver* self, int parent_idx, const char* name, TFS_Inode* inode);
+int TFS_Driver_CreateAt(TFS_Driver* self, int parent_idx, const char* name, enum TFS_InodeType type, TFS_Inode* inode);
+// returns removed inode idx, 0 if it is a non-empty dir
+int TFS_Driver_DeleteAt(TFS_Driver* self, int parent_idx, const char* name);
+// see TFS_Driver_MvPath; only a move of a dir right into itself is detected,
+// the caller must not move a dir deeper into its' own subtree (the kernel checks that for FUSE)
+int TFS_Driver_MvAt(TFS_Driver* self, int from_parent_idx, const char* from_name, int to_parent_idx, const char* to_name);
+int TFS_Driver_ReadDirAt(TFS_Driver* self, int dir_idx, int64_t* cookie, TFS_Inode_DirEnt* entries, int max);
+int TFS_Driver_ReadDirAttrsAt(TFS_Driver* self, int dir_idx, int64_t* cookie, TFS_DirEntry* entries, int max);
+int TFS_Driver_TruncateAt(TFS_Driver* self, int inode_idx, int64_t size);
+int TFS_Driver_OpenFileAt(TFS_Driver* self, int inode_idx, TFS_File** file);